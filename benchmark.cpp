@@ -1,21 +1,40 @@
 #include <chrono>
 #include <iostream>
+#include "block_codec.h"
 #include "index_engine.h"
 
 int main()
 {
     IndexEngine engine;
     engine.load("data/index.bin");
+    engine.build();
+    engine.set_cache_enabled(false);
 
-    auto start = std::chrono::high_resolution_clock::now();
+    std::cout << "posting decode kernel: "
+              << BlockCodec::kernel_name(BlockCodec::active_kernel()) << "\n";
 
-    for (int i = 0; i < 10000; i++)
+    auto baseline = engine.search("distributed systems", 10);
+
+    const std::pair<SearchMode, const char *> modes[] = {
+        {SearchMode::Exhaustive, "exhaustive"},
+        {SearchMode::Wand, "wand"},
+        {SearchMode::BlockMaxWand, "block-max wand"}};
+
+    for (const auto &[mode, name] : modes)
     {
-        engine.search("distributed systems", 10);
-    }
+        if (engine.search("distributed systems", 10, mode) != baseline)
+            std::cout << name << ": results differ from exhaustive\n";
 
-    auto end = std::chrono::high_resolution_clock::now();
-    double ms = std::chrono::duration<double, std::milli>(end - start).count();
+        auto start = std::chrono::high_resolution_clock::now();
 
-    std::cout << "Executed 10k queries in " << ms << " ms\n";
+        for (int i = 0; i < 10000; i++)
+        {
+            engine.search("distributed systems", 10, mode);
+        }
+
+        auto end = std::chrono::high_resolution_clock::now();
+        double ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+        std::cout << name << ": executed 10k queries in " << ms << " ms\n";
+    }
 }
@@ -0,0 +1,240 @@
+#include "block_codec.h"
+#include <array>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLOCK_CODEC_X86 1
+#endif
+
+namespace
+{
+    struct Tables
+    {
+        std::array<uint8_t, 256> length;
+        alignas(16) uint8_t shuffle[256][16];
+
+        Tables()
+        {
+            for (int c = 0; c < 256; c++)
+            {
+                uint8_t offset = 0;
+                for (int i = 0; i < 4; i++)
+                {
+                    int bytes = ((c >> (2 * i)) & 3) + 1;
+                    for (int j = 0; j < 4; j++)
+                        shuffle[c][4 * i + j] = j < bytes ? offset + j : 0x80;
+                    offset += bytes;
+                }
+                length[c] = offset;
+            }
+        }
+    };
+
+    const Tables tables;
+
+    uint8_t byte_length(uint32_t v)
+    {
+        return v < (1u << 8) ? 1 : v < (1u << 16) ? 2 : v < (1u << 24) ? 3 : 4;
+    }
+
+    void encode_stream(const uint32_t *values, size_t count, bool delta,
+                       std::vector<uint8_t> &out)
+    {
+        size_t control = out.size();
+        out.resize(out.size() + (count + 3) / 4, 0);
+
+        uint32_t prev = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            uint32_t v = delta ? values[i] - prev : values[i];
+            prev = values[i];
+
+            uint8_t bytes = byte_length(v);
+            out[control + i / 4] |= (bytes - 1) << (2 * (i % 4));
+            for (uint8_t j = 0; j < bytes; j++)
+                out.push_back(static_cast<uint8_t>(v >> (8 * j)));
+        }
+    }
+
+    // Decodes values [from, count) of a stream whose data for value `from`
+    // starts at `data`; used for whole blocks and for SIMD tails.
+    const uint8_t *decode_tail(const uint8_t *control, const uint8_t *data,
+                               size_t from, size_t count, bool delta,
+                               uint32_t prev, uint32_t *out)
+    {
+        for (size_t i = from; i < count; i++)
+        {
+            int bytes = ((control[i / 4] >> (2 * (i % 4))) & 3) + 1;
+            uint32_t v = 0;
+            for (int j = 0; j < bytes; j++)
+                v |= static_cast<uint32_t>(data[j]) << (8 * j);
+            data += bytes;
+
+            prev = delta ? prev + v : v;
+            out[i] = prev;
+        }
+        return data;
+    }
+
+    const uint8_t *decode_scalar(const uint8_t *in, size_t count, bool delta,
+                                 uint32_t *out)
+    {
+        return decode_tail(in, in + (count + 3) / 4, 0, count, delta, 0, out);
+    }
+
+#ifdef BLOCK_CODEC_X86
+    __attribute__((target("ssse3"))) const uint8_t *
+    decode_ssse3(const uint8_t *in, size_t count, bool delta, uint32_t *out)
+    {
+        const uint8_t *control = in;
+        const uint8_t *data = in + (count + 3) / 4;
+        __m128i prev = _mm_setzero_si128();
+
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            uint8_t c = control[i / 4];
+            __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+            __m128i v = _mm_shuffle_epi8(
+                raw, _mm_load_si128(reinterpret_cast<const __m128i *>(tables.shuffle[c])));
+            data += tables.length[c];
+
+            if (delta)
+            {
+                v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+                v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+                v = _mm_add_epi32(v, prev);
+                prev = _mm_shuffle_epi32(v, 0xFF);
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), v);
+        }
+
+        uint32_t last = i > 0 && delta ? out[i - 1] : 0;
+        return decode_tail(control, data, i, count, delta, last, out);
+    }
+
+    __attribute__((target("avx2"))) const uint8_t *
+    decode_avx2(const uint8_t *in, size_t count, bool delta, uint32_t *out)
+    {
+        const uint8_t *control = in;
+        const uint8_t *data = in + (count + 3) / 4;
+        __m256i prev = _mm256_setzero_si256();
+        const __m256i last_lane = _mm256_set1_epi32(7);
+
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8)
+        {
+            uint8_t c0 = control[i / 4];
+            uint8_t c1 = control[i / 4 + 1];
+            __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+            __m128i hi = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(data + tables.length[c0]));
+            data += tables.length[c0] + tables.length[c1];
+
+            __m256i raw = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+            __m256i mask = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(
+                    _mm_load_si128(reinterpret_cast<const __m128i *>(tables.shuffle[c0]))),
+                _mm_load_si128(reinterpret_cast<const __m128i *>(tables.shuffle[c1])), 1);
+            __m256i v = _mm256_shuffle_epi8(raw, mask);
+
+            if (delta)
+            {
+                // Prefix sum within each 128-bit lane, then carry lane 0's
+                // total into lane 1 and the previous group's total into both.
+                v = _mm256_add_epi32(v, _mm256_slli_si256(v, 4));
+                v = _mm256_add_epi32(v, _mm256_slli_si256(v, 8));
+                __m256i carry = _mm256_shuffle_epi32(v, 0xFF);
+                carry = _mm256_permute2x128_si256(carry, carry, 0x08);
+                v = _mm256_add_epi32(v, _mm256_add_epi32(carry, prev));
+                prev = _mm256_permutevar8x32_epi32(v, last_lane);
+            }
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), v);
+        }
+        // Callers are built without AVX; avoid SSE/AVX transition stalls.
+        _mm256_zeroupper();
+
+        uint32_t last = i > 0 && delta ? out[i - 1] : 0;
+        return decode_tail(control, data, i, count, delta, last, out);
+    }
+#endif
+
+    using DecodeFn = const uint8_t *(*)(const uint8_t *, size_t, bool, uint32_t *);
+
+    bool supported(BlockCodec::Kernel kernel)
+    {
+#ifdef BLOCK_CODEC_X86
+        __builtin_cpu_init();
+        if (kernel == BlockCodec::Kernel::Avx2)
+            return __builtin_cpu_supports("avx2");
+        if (kernel == BlockCodec::Kernel::Ssse3)
+            return __builtin_cpu_supports("ssse3");
+#endif
+        return kernel == BlockCodec::Kernel::Scalar;
+    }
+
+    DecodeFn kernel_fn(BlockCodec::Kernel kernel)
+    {
+#ifdef BLOCK_CODEC_X86
+        if (kernel == BlockCodec::Kernel::Avx2)
+            return decode_avx2;
+        if (kernel == BlockCodec::Kernel::Ssse3)
+            return decode_ssse3;
+#endif
+        return decode_scalar;
+    }
+
+    BlockCodec::Kernel best_kernel()
+    {
+        if (supported(BlockCodec::Kernel::Avx2))
+            return BlockCodec::Kernel::Avx2;
+        if (supported(BlockCodec::Kernel::Ssse3))
+            return BlockCodec::Kernel::Ssse3;
+        return BlockCodec::Kernel::Scalar;
+    }
+
+    BlockCodec::Kernel active = best_kernel();
+    DecodeFn decode = kernel_fn(active);
+}
+
+void BlockCodec::encode_block(const uint32_t *docs, const uint32_t *freqs,
+                              size_t count, std::vector<uint8_t> &out)
+{
+    encode_stream(docs, count, true, out);
+    encode_stream(freqs, count, false, out);
+}
+
+size_t BlockCodec::decode_block(const uint8_t *in, size_t count,
+                                uint32_t *docs, uint32_t *freqs)
+{
+    const uint8_t *p = decode(in, count, true, docs);
+    p = decode(p, count, false, freqs);
+    return p - in;
+}
+
+BlockCodec::Kernel BlockCodec::active_kernel()
+{
+    return active;
+}
+
+bool BlockCodec::set_kernel(Kernel kernel)
+{
+    if (!supported(kernel))
+        return false;
+    active = kernel;
+    decode = kernel_fn(kernel);
+    return true;
+}
+
+const char *BlockCodec::kernel_name(Kernel kernel)
+{
+    switch (kernel)
+    {
+    case Kernel::Avx2:
+        return "avx2";
+    case Kernel::Ssse3:
+        return "ssse3";
+    default:
+        return "scalar";
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Stream VByte coding for posting blocks: 2-bit length codes for four
+// values per control byte, followed by the value bytes. Doc ids are stored
+// as deltas; decoding picks an AVX2, SSSE3 or scalar kernel at runtime.
+class BlockCodec
+{
+public:
+    enum class Kernel
+    {
+        Scalar,
+        Ssse3,
+        Avx2
+    };
+
+    // SIMD kernels may load this many bytes past the last encoded block, so
+    // buffers handed to decode_block must be padded by at least this much.
+    static constexpr size_t PADDING = 32;
+
+    static void encode_block(const uint32_t *docs, const uint32_t *freqs,
+                             size_t count, std::vector<uint8_t> &out);
+
+    // Returns the number of bytes consumed.
+    static size_t decode_block(const uint8_t *in, size_t count,
+                               uint32_t *docs, uint32_t *freqs);
+
+    static Kernel active_kernel();
+    // Returns false (and keeps the current kernel) if the CPU lacks support.
+    static bool set_kernel(Kernel kernel);
+    static const char *kernel_name(Kernel kernel);
+};
@@ -1,12 +1,17 @@
 #pragma once
 #include <cmath>
 
+// score() is idf(df, N) * (k1 + 1) * tf / (tf + length_norm(doc_len, avgdl));
+// the parts are exposed so indexes can precompute them per term and per doc.
 class BM25
 {
 public:
-    BM25(double k1 = 1.5, double b = 0.75)
+    constexpr BM25(double k1 = 1.5, double b = 0.75)
         : k1(k1), b(b) {}
 
+    constexpr double get_k1() const { return k1; }
+    constexpr double get_b() const { return b; }
+
     double score(int tf, int df, int doc_len,
                  double avgdl, int N) const
     {
@@ -16,6 +21,16 @@ public:
                 (tf + k1 * (1 - b + b * doc_len / avgdl)));
     }
 
+    double idf(int df, int N) const
+    {
+        return log((N - df + 0.5) / (df + 0.5));
+    }
+
+    constexpr double length_norm(int doc_len, double avgdl) const
+    {
+        return k1 * (1 - b + b * doc_len / avgdl);
+    }
+
 private:
     double k1;
     double b;
@@ -0,0 +1,361 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Thread-safe, byte-budgeted cache with W-TinyLFU admission.
+//
+// Keys are hashed onto independent shards, each behind its own mutex, so
+// concurrent lookups of different keys rarely contend. Within a shard, new
+// entries land in a small LRU window (1% of the budget); entries falling out
+// of the window only enter the main segmented LRU (probation + protected) if
+// a count-min sketch says they are requested more often than the entry they
+// would displace. A burst of one-off keys therefore cycles through the
+// window without evicting the frequently requested head of the workload.
+//
+// Values are stored behind shared_ptr so get() copies them outside the lock.
+template <typename K, typename V, typename Hash = std::hash<K>>
+class ConcurrentCache
+{
+public:
+    using Weigher = std::function<size_t(const K &, const V &)>;
+
+    struct Stats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        size_t bytes = 0;
+        size_t entries = 0;
+    };
+
+    ConcurrentCache(size_t capacity_bytes, Weigher weigher, size_t shard_count = 16)
+        : weigher(std::move(weigher)), shards(std::max<size_t>(1, shard_count))
+    {
+        for (auto &shard : shards)
+            shard.set_capacity(capacity_bytes / shards.size());
+    }
+
+    bool get(const K &key, V &value)
+    {
+        size_t h = hasher(key);
+        std::shared_ptr<const V> found;
+        {
+            Shard &shard = shard_for(h);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            found = shard.get(key, h);
+        }
+        if (!found)
+            return false;
+        value = *found;
+        return true;
+    }
+
+    void put(const K &key, const V &value)
+    {
+        size_t h = hasher(key);
+        size_t weight = weigher(key, value);
+        auto stored = std::make_shared<const V>(value);
+
+        Shard &shard = shard_for(h);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.put(key, h, std::move(stored), weight);
+    }
+
+    // Recent request frequency of `key` (0-15) from the admission sketch,
+    // counting misses as well as hits.
+    unsigned frequency(const K &key) const
+    {
+        size_t h = hasher(key);
+        const Shard &shard = shards[shard_index(h)];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.sketch.estimate(h);
+    }
+
+    void clear()
+    {
+        for (auto &shard : shards)
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.clear();
+        }
+    }
+
+    Stats stats() const
+    {
+        Stats total;
+        for (auto &shard : shards)
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            total.hits += shard.hits;
+            total.misses += shard.misses;
+            total.bytes += shard.window.weight + shard.probation.weight + shard.protect.weight;
+            total.entries += shard.map.size();
+        }
+        return total;
+    }
+
+private:
+    // 4-row count-min sketch of saturating 8-bit counters. All counters are
+    // halved every `sample` increments so popularity decays over time.
+    class Sketch
+    {
+    public:
+        void resize(size_t expected_entries)
+        {
+            size_t width = 64;
+            while (width < expected_entries)
+                width <<= 1;
+            counters.assign(width * ROWS, 0);
+            mask = width - 1;
+            sample = width * 10;
+            additions = 0;
+        }
+
+        void increment(size_t hash)
+        {
+            bool added = false;
+            for (size_t row = 0; row < ROWS; row++)
+            {
+                uint8_t &c = counters[index(hash, row)];
+                if (c < MAX_COUNT)
+                {
+                    c++;
+                    added = true;
+                }
+            }
+            if (added && ++additions >= sample)
+                age();
+        }
+
+        uint8_t estimate(size_t hash) const
+        {
+            uint8_t freq = MAX_COUNT;
+            for (size_t row = 0; row < ROWS; row++)
+                freq = std::min(freq, counters[index(hash, row)]);
+            return freq;
+        }
+
+    private:
+        static constexpr size_t ROWS = 4;
+        static constexpr uint8_t MAX_COUNT = 15;
+
+        // Each row runs the hash through the murmur3 finalizer with its own
+        // seed, so keys that collide in one row are no more likely than any
+        // others to collide in the rest.
+        size_t index(size_t hash, size_t row) const
+        {
+            static constexpr uint64_t SEEDS[ROWS] = {
+                0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full,
+                0x165667B19E3779F9ull, 0xD6E8FEB86659FD93ull};
+            uint64_t h = static_cast<uint64_t>(hash) ^ SEEDS[row];
+            h ^= h >> 33;
+            h *= 0xFF51AFD7ED558CCDull;
+            h ^= h >> 33;
+            h *= 0xC4CEB9FE1A85EC53ull;
+            h ^= h >> 33;
+            return row * (mask + 1) + (h & mask);
+        }
+
+        void age()
+        {
+            for (auto &c : counters)
+                c >>= 1;
+            additions /= 2;
+        }
+
+        std::vector<uint8_t> counters;
+        size_t mask = 0;
+        size_t sample = 0;
+        size_t additions = 0;
+    };
+
+    enum class Segment
+    {
+        Window,
+        Probation,
+        Protected
+    };
+
+    struct Node
+    {
+        K key;
+        size_t hash;
+        std::shared_ptr<const V> value;
+        size_t weight;
+        Segment segment;
+    };
+
+    using NodeList = std::list<Node>;
+
+    struct Queue
+    {
+        NodeList nodes;
+        size_t weight = 0;
+    };
+
+    struct Shard
+    {
+        mutable std::mutex mutex;
+        std::unordered_map<K, typename NodeList::iterator, Hash> map;
+        Queue window, probation, protect;
+        Sketch sketch;
+        size_t capacity = 0;
+        size_t window_max = 0;
+        size_t protected_max = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+
+        void set_capacity(size_t bytes)
+        {
+            capacity = bytes;
+            window_max = bytes / 100;
+            protected_max = (bytes - window_max) * 8 / 10;
+            // Assume ~1 KiB entries to size the sketch.
+            sketch.resize(std::max<size_t>(bytes >> 10, 64));
+        }
+
+        Queue &queue(Segment segment)
+        {
+            switch (segment)
+            {
+            case Segment::Window:
+                return window;
+            case Segment::Probation:
+                return probation;
+            default:
+                return protect;
+            }
+        }
+
+        void move_to_front(typename NodeList::iterator node, Segment to)
+        {
+            Queue &from = queue(node->segment);
+            Queue &target = queue(to);
+            from.weight -= node->weight;
+            target.weight += node->weight;
+            target.nodes.splice(target.nodes.begin(), from.nodes, node);
+            node->segment = to;
+        }
+
+        void erase(typename NodeList::iterator node)
+        {
+            Queue &from = queue(node->segment);
+            from.weight -= node->weight;
+            map.erase(node->key);
+            from.nodes.erase(node);
+        }
+
+        std::shared_ptr<const V> get(const K &key, size_t hash)
+        {
+            sketch.increment(hash);
+            auto it = map.find(key);
+            if (it == map.end())
+            {
+                misses++;
+                return nullptr;
+            }
+            hits++;
+
+            auto node = it->second;
+            // A second hit in probation promotes to protected.
+            move_to_front(node, node->segment == Segment::Window ? Segment::Window
+                                                                 : Segment::Protected);
+            demote_protected();
+            return node->value;
+        }
+
+        void put(const K &key, size_t hash, std::shared_ptr<const V> value, size_t weight)
+        {
+            sketch.increment(hash);
+            auto it = map.find(key);
+            if (weight > capacity - window_max)
+            {
+                // Could never be admitted to the main space; the old value
+                // must not outlive the rejected one.
+                if (it != map.end())
+                    erase(it->second);
+                return;
+            }
+
+            if (it != map.end())
+            {
+                auto node = it->second;
+                queue(node->segment).weight += weight - node->weight;
+                node->weight = weight;
+                node->value = std::move(value);
+                move_to_front(node, node->segment);
+            }
+            else
+            {
+                window.nodes.push_front({key, hash, std::move(value), weight, Segment::Window});
+                window.weight += weight;
+                map.emplace(key, window.nodes.begin());
+            }
+            demote_protected();
+            evict();
+        }
+
+        void demote_protected()
+        {
+            while (protect.weight > protected_max && !protect.nodes.empty())
+                move_to_front(std::prev(protect.nodes.end()), Segment::Probation);
+        }
+
+        // Window overflow produces candidates; each one is admitted only if
+        // the sketch rates it above the main-space victims it displaces.
+        void evict()
+        {
+            while (window.weight > window_max && !window.nodes.empty())
+            {
+                auto candidate = std::prev(window.nodes.end());
+                move_to_front(candidate, Segment::Probation);
+
+                uint8_t candidate_freq = sketch.estimate(candidate->hash);
+                while (probation.weight + protect.weight > capacity - window_max)
+                {
+                    auto victim = std::prev(probation.nodes.end());
+                    if (victim == candidate)
+                        victim = std::prev(protect.nodes.end());
+                    if (sketch.estimate(victim->hash) >= candidate_freq)
+                    {
+                        erase(candidate);
+                        break;
+                    }
+                    erase(victim);
+                }
+            }
+
+            // An in-place update can also grow the main space.
+            while (probation.weight + protect.weight > capacity - window_max)
+                erase(std::prev((probation.nodes.empty() ? protect : probation).nodes.end()));
+        }
+
+        void clear()
+        {
+            map.clear();
+            window = Queue();
+            probation = Queue();
+            protect = Queue();
+        }
+    };
+
+    size_t shard_index(size_t hash) const
+    {
+        // The low bits also pick the map bucket; mix before choosing a shard.
+        return (hash * 0x9E3779B97F4A7C15ull >> 32) % shards.size();
+    }
+
+    Shard &shard_for(size_t hash)
+    {
+        return shards[shard_index(hash)];
+    }
+
+    Hash hasher;
+    Weigher weigher;
+    std::vector<Shard> shards;
+};
@@ -1,17 +1,192 @@
 #include "consistent_hash.h"
-#include <functional>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
 
-void ConsistentHash::add_node(const std::string &node)
+namespace
 {
-    size_t hash = std::hash<std::string>{}(node);
-    ring[hash] = node;
+    // MurmurHash3's 64-bit finalizer: spreads FNV-1a's weak low bits.
+    uint64_t fmix(uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDull;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ull;
+        h ^= h >> 33;
+        return h;
+    }
+
+    // Lamping and Veach, "A Fast, Minimal Memory, Consistent Hash
+    // Algorithm": the bucket in [0, buckets) of `key`, which only moves to
+    // the new bucket when one is added.
+    size_t jump_hash(uint64_t key, size_t buckets)
+    {
+        int64_t b = -1, j = 0;
+        while (j < static_cast<int64_t>(buckets))
+        {
+            b = j;
+            key = key * 2862933555777941757ull + 1;
+            j = static_cast<int64_t>((b + 1) * (static_cast<double>(1ll << 31) /
+                                                static_cast<double>((key >> 33) + 1)));
+        }
+        return static_cast<size_t>(b);
+    }
+}
+
+ConsistentHash::ConsistentHash() : ConsistentHash(Options()) {}
+
+ConsistentHash::ConsistentHash(Options options) : options(options)
+{
+    if (options.load_factor != 0 && options.load_factor <= 1)
+        throw std::runtime_error("ConsistentHash: load factor must be above 1");
+    if (options.load_factor != 0 && options.mode == Mode::Jump)
+        throw std::runtime_error("ConsistentHash: bounded loads need Ring mode");
+}
+
+uint64_t ConsistentHash::hash(const std::string &key)
+{
+    uint64_t h = 0xCBF29CE484222325ull;
+    for (unsigned char c : key)
+    {
+        h ^= c;
+        h *= 0x100000001B3ull;
+    }
+    return fmix(h);
+}
+
+void ConsistentHash::add_node(const std::string &node, double weight)
+{
+    if (!(weight > 0))
+        throw std::runtime_error("ConsistentHash: node weight must be positive");
+    if (options.mode == Mode::Jump && weight != 1.0)
+        throw std::runtime_error("ConsistentHash: Jump mode has no weights");
+
+    auto it = std::find_if(nodes.begin(), nodes.end(),
+                           [&](const Node &n)
+                           { return n.name == node; });
+    if (it != nodes.end())
+    {
+        total_weight += weight - it->weight;
+        it->weight = weight;
+    }
+    else
+    {
+        nodes.push_back({node, weight});
+        total_weight += weight;
+    }
+    rebuild_ring();
+}
+
+bool ConsistentHash::remove_node(const std::string &node)
+{
+    auto it = std::find_if(nodes.begin(), nodes.end(),
+                           [&](const Node &n)
+                           { return n.name == node; });
+    if (it == nodes.end())
+        return false;
+    if (options.mode == Mode::Jump && it + 1 != nodes.end())
+        throw std::runtime_error("ConsistentHash: Jump mode can only remove the last node");
+
+    total_weight -= it->weight;
+    total_load -= it->load;
+    nodes.erase(it);
+    rebuild_ring();
+    return true;
+}
+
+void ConsistentHash::rebuild_ring()
+{
+    points.clear();
+    owners.clear();
+    if (options.mode == Mode::Jump)
+        return;
+
+    std::vector<std::pair<uint64_t, uint32_t>> ring;
+    for (uint32_t n = 0; n < nodes.size(); n++)
+    {
+        size_t count = std::max<size_t>(1, std::llround(nodes[n].weight * options.virtual_nodes));
+        for (size_t i = 0; i < count; i++)
+            ring.push_back({hash(nodes[n].name + '#' + std::to_string(i)), n});
+    }
+    std::sort(ring.begin(), ring.end(),
+              [&](const auto &a, const auto &b)
+              {
+                  if (a.first != b.first)
+                      return a.first < b.first;
+                  return nodes[a.second].name < nodes[b.second].name;
+              });
+
+    points.reserve(ring.size());
+    owners.reserve(ring.size());
+    for (const auto &[point, owner] : ring)
+    {
+        points.push_back(point);
+        owners.push_back(owner);
+    }
+}
+
+// Index of the first ring point at or after `key_hash`, wrapping around.
+size_t ConsistentHash::locate(uint64_t key_hash) const
+{
+    size_t point = std::lower_bound(points.begin(), points.end(), key_hash) - points.begin();
+    return point == points.size() ? 0 : point;
+}
+
+size_t ConsistentHash::node_index(uint64_t key_hash) const
+{
+    if (nodes.empty())
+        throw std::runtime_error("ConsistentHash: no nodes");
+    if (options.mode == Mode::Jump)
+        return jump_hash(key_hash, nodes.size());
+    return owners[locate(key_hash)];
+}
+
+const std::string &ConsistentHash::get_node(const std::string &key) const
+{
+    return nodes[node_index(hash(key))].name;
+}
+
+// Counting the key being placed, so an empty ring still admits it.
+size_t ConsistentHash::capacity(const Node &node) const
+{
+    return static_cast<size_t>(
+        std::ceil(options.load_factor * (total_load + 1) * node.weight / total_weight));
+}
+
+// With a load factor above 1 the bounds add up to more than the keys, so
+// the walk always finds a node with room.
+const std::string &ConsistentHash::assign(const std::string &key)
+{
+    Node *node = nullptr;
+    if (options.load_factor == 0)
+    {
+        node = &nodes[node_index(hash(key))];
+    }
+    else
+    {
+        if (nodes.empty())
+            throw std::runtime_error("ConsistentHash: no nodes");
+        size_t start = locate(hash(key));
+        for (size_t i = 0; i < points.size() && !node; i++)
+        {
+            Node &candidate = nodes[owners[(start + i) % points.size()]];
+            if (candidate.load < capacity(candidate))
+                node = &candidate;
+        }
+    }
+    node->load++;
+    total_load++;
+    return node->name;
 }
 
-std::string ConsistentHash::get_node(const std::string &key)
+void ConsistentHash::release(const std::string &node)
 {
-    size_t hash = std::hash<std::string>{}(key);
-    auto it = ring.lower_bound(hash);
-    if (it == ring.end())
-        return ring.begin()->second;
-    return it->second;
+    auto it = std::find_if(nodes.begin(), nodes.end(),
+                           [&](const Node &n)
+                           { return n.name == node; });
+    if (it != nodes.end() && it->load > 0)
+    {
+        it->load--;
+        total_load--;
+    }
 }
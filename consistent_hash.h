@@ -1,13 +1,85 @@
 #pragma once
-#include <map>
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <vector>
 
+// Maps keys to nodes so that adding or removing a node only moves the keys
+// that land on it.
+//
+// In Ring mode every node owns `virtual_nodes` points per unit of weight
+// on a 64-bit hash ring, and a key belongs to the first point at or after
+// its hash. Many points per node even out the arc each node owns, and
+// weights let larger nodes take a proportional share. The ring is a flat
+// sorted array, so a lookup is one binary search over contiguous hashes.
+// Points are ordered by hash and then node name, so every process that
+// adds the same nodes builds the same ring, whatever the order.
+//
+// Jump mode uses jump consistent hashing instead: no ring memory, lookups
+// in O(log n) arithmetic and a perfectly even split, but nodes are
+// numbered by insertion, only the last one can be removed, and all nodes
+// weigh the same.
+//
+// Lookups may run concurrently with each other; adding or removing nodes
+// and assign()/release() must not run concurrently with anything else.
 class ConsistentHash
 {
 public:
-    void add_node(const std::string &node);
-    std::string get_node(const std::string &key);
+    enum class Mode
+    {
+        Ring,
+        Jump
+    };
+
+    struct Options
+    {
+        Mode mode = Mode::Ring;
+        size_t virtual_nodes = 160;
+        // Consistent hashing with bounded loads, for keys placed with
+        // assign(): no node takes more than ceil(load_factor * share) of
+        // the assigned keys, where share is its weight's part of them.
+        // Must be above 1; 0 leaves loads unbounded. Ring mode only.
+        double load_factor = 0;
+    };
+
+    ConsistentHash();
+    explicit ConsistentHash(Options options);
+
+    // Re-adding a node changes its weight.
+    void add_node(const std::string &node, double weight = 1.0);
+    // Returns false if there is no such node. Only keys on `node` move.
+    bool remove_node(const std::string &node);
+    const std::string &get_node(const std::string &key) const;
+
+    // Like get_node() but skips nodes that are full under the load bound,
+    // and counts the key against the node it returns. The result depends
+    // on earlier assignments, so callers must remember where keys went.
+    const std::string &assign(const std::string &key);
+    // Takes back a key assign() placed on `node`.
+    void release(const std::string &node);
+
+    size_t size() const { return nodes.size(); }
+    static uint64_t hash(const std::string &key);
 
 private:
-    std::map<size_t, std::string> ring;
+    struct Node
+    {
+        std::string name;
+        double weight;
+        size_t load = 0;
+    };
+
+    void rebuild_ring();
+    size_t locate(uint64_t key_hash) const;
+    size_t node_index(uint64_t key_hash) const;
+    size_t capacity(const Node &node) const;
+
+    Options options;
+    std::vector<Node> nodes;
+    double total_weight = 0;
+    size_t total_load = 0;
+    // The ring: point hashes ascending, and the index in `nodes` of each
+    // point's node.
+    std::vector<uint64_t> points;
+    std::vector<uint32_t> owners;
 };
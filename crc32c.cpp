@@ -0,0 +1,73 @@
+#include "crc32c.h"
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#endif
+
+namespace
+{
+    struct Table
+    {
+        std::array<uint32_t, 256> entries;
+
+        Table()
+        {
+            for (uint32_t i = 0; i < 256; i++)
+            {
+                uint32_t crc = i;
+                for (int j = 0; j < 8; j++)
+                    crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+                entries[i] = crc;
+            }
+        }
+    };
+
+    const Table table;
+
+    uint32_t update_scalar(uint32_t crc, const uint8_t *p, size_t size)
+    {
+        for (size_t i = 0; i < size; i++)
+            crc = table.entries[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+        return crc;
+    }
+
+#ifdef CRC32C_X86
+    __attribute__((target("sse4.2"))) uint32_t
+    update_sse42(uint32_t crc, const uint8_t *p, size_t size)
+    {
+        uint64_t c = crc;
+        for (; size >= 8; size -= 8, p += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, p, sizeof(word));
+            c = _mm_crc32_u64(c, word);
+        }
+        crc = static_cast<uint32_t>(c);
+        for (; size > 0; size--, p++)
+            crc = _mm_crc32_u8(crc, *p);
+        return crc;
+    }
+#endif
+
+    using UpdateFn = uint32_t (*)(uint32_t, const uint8_t *, size_t);
+
+    UpdateFn select_update()
+    {
+#ifdef CRC32C_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse4.2"))
+            return update_sse42;
+#endif
+        return update_scalar;
+    }
+
+    const UpdateFn update = select_update();
+}
+
+uint32_t CRC32C::compute(const void *data, size_t size, uint32_t crc)
+{
+    return ~update(~crc, static_cast<const uint8_t *>(data), size);
+}
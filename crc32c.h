@@ -0,0 +1,11 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// CRC-32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the CPU has
+// it and a table-driven fallback otherwise.
+class CRC32C
+{
+public:
+    static uint32_t compute(const void *data, size_t size, uint32_t crc = 0);
+};
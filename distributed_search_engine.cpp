@@ -6,33 +6,27 @@
 #include <algorithm>
 #include <mutex>
 #include <thread>
-#include <queue>
-#include <condition_variable>
 #include <cmath>
 #include <fstream>
 #include <map>
 #include <list>
 #include <chrono>
 #include <atomic>
+#include <functional>
+#include <memory>
+#include "concurrent_cache.h"
+#include "thread_pool.h"
+#include "tokenizer.h"
 
 using namespace std;
 
+// Shares the engine's single-pass tokenizer so indexing and queries here
+// normalize exactly like IndexEngine.
 vector<string> tokenize(const string &text)
 {
-    vector<string> tokens;
-    string word;
-    stringstream ss(text);
-    while (ss >> word)
-    {
-        transform(word.begin(), word.end(), word.begin(), ::tolower);
-        word.erase(remove_if(word.begin(), word.end(),
-                             [](char c)
-                             { return !isalnum(c); }),
-                   word.end());
-        if (!word.empty())
-            tokens.push_back(word);
-    }
-    return tokens;
+    thread_local Tokenizer tokenizer;
+    const auto &tokens = tokenizer.tokenize(text);
+    return vector<string>(tokens.begin(), tokens.end());
 }
 
 void encode_uint32(uint32_t value, vector<uint8_t> &out)
@@ -45,95 +39,6 @@ void encode_uint32(uint32_t value, vector<uint8_t> &out)
     out.push_back(value);
 }
 
-template <typename K, typename V>
-class LRUCache
-{
-    size_t capacity;
-    list<pair<K, V>> items;
-    unordered_map<K, typename list<pair<K, V>>::iterator> map;
-
-public:
-    LRUCache(size_t cap) : capacity(cap) {}
-
-    bool get(const K &key, V &value)
-    {
-        if (!map.count(key))
-            return false;
-        items.splice(items.begin(), items, map[key]);
-        value = map[key]->second;
-        return true;
-    }
-
-    void put(const K &key, const V &value)
-    {
-        if (map.count(key))
-            items.erase(map[key]);
-
-        items.push_front({key, value});
-        map[key] = items.begin();
-
-        if (map.size() > capacity)
-        {
-            auto last = items.end();
-            --last;
-            map.erase(last->first);
-            items.pop_back();
-        }
-    }
-};
-
-class ThreadPool
-{
-    vector<thread> workers;
-    queue<function<void()>> tasks;
-    mutex mtx;
-    condition_variable cv;
-    bool stop = false;
-
-public:
-    ThreadPool(size_t n)
-    {
-        for (size_t i = 0; i < n; i++)
-        {
-            workers.emplace_back([this]()
-                                 {
-                while(true){
-                    function<void()> task;
-                    {
-                        unique_lock<mutex> lock(mtx);
-                        cv.wait(lock,[this]{
-                            return stop || !tasks.empty();
-                        });
-                        if(stop && tasks.empty()) return;
-                        task = move(tasks.front());
-                        tasks.pop();
-                    }
-                    task();
-                } });
-        }
-    }
-
-    void enqueue(function<void()> f)
-    {
-        {
-            unique_lock<mutex> lock(mtx);
-            tasks.push(f);
-        }
-        cv.notify_one();
-    }
-
-    ~ThreadPool()
-    {
-        {
-            unique_lock<mutex> lock(mtx);
-            stop = true;
-        }
-        cv.notify_all();
-        for (auto &w : workers)
-            w.join();
-    }
-};
-
 class PageRank
 {
     unordered_map<uint32_t, vector<uint32_t>> graph;
@@ -204,15 +109,58 @@ double bm25(int tf, int df, int doc_len,
 
 class IndexEngine
 {
-    unordered_map<string, vector<pair<uint32_t, uint32_t>>> index;
-    unordered_map<uint32_t, uint32_t> doc_len;
-    size_t total_docs = 0;
-    uint64_t total_len = 0;
+    struct DocPosting
+    {
+        uint32_t doc_id;
+        uint32_t tf;
+        uint32_t doc_len;
+    };
+    using PostingList = vector<DocPosting>;
+
+    // Immutable once published. Each add_documents() call becomes a new
+    // segment, and a segment no larger than the one after it is merged
+    // into it, like carries in a binary counter: segment sizes halve from
+    // first to last, there are O(log N) of them, and every posting is
+    // copied O(log N) times over the whole ingest however documents arrive.
+    struct Segment
+    {
+        unordered_map<string, PostingList> postings;
+        size_t docs = 0;
+    };
+
+    struct Snapshot
+    {
+        vector<shared_ptr<const Segment>> segments;
+        size_t total_docs = 0;
+        uint64_t total_len = 0;
+        uint64_t generation = 0;
+    };
+
+    static shared_ptr<const Segment> merge_segments(const Segment &a, const Segment &b)
+    {
+        auto merged = make_shared<Segment>(a);
+        for (auto &[term, list] : b.postings)
+        {
+            PostingList &into = merged->postings[term];
+            PostingList both;
+            both.reserve(into.size() + list.size());
+            std::merge(into.begin(), into.end(), list.begin(), list.end(), back_inserter(both),
+                       [](const DocPosting &x, const DocPosting &y)
+                       { return x.doc_id < y.doc_id; });
+            into = move(both);
+        }
+        merged->docs = a.docs + b.docs;
+        return merged;
+    }
+
+    // Read and replaced with atomic_load/atomic_store; searches never take
+    // mtx, which only serializes writers.
+    shared_ptr<const Snapshot> snapshot = make_shared<const Snapshot>();
     mutex mtx;
 
-    LRUCache<string,
-             vector<pair<uint32_t, double>>>
-        cache{100};
+    ConcurrentCache<string, vector<pair<uint32_t, double>>> cache{
+        32 << 20, [](const string &query, const vector<pair<uint32_t, double>> &result)
+        { return query.size() + result.size() * sizeof(result[0]) + 128; }};
 
     PageRank pagerank;
     WAL wal{"wal.log"};
@@ -220,71 +168,139 @@ class IndexEngine
 public:
     void add_document(uint32_t id, const string &content)
     {
-        wal.append(id, content);
+        add_documents({{id, content}});
+    }
 
-        auto tokens = tokenize(content);
-        unordered_map<string, uint32_t> tf;
-        for (auto &t : tokens)
-            tf[t]++;
+    // Tokenizes outside the lock and publishes the batch as one snapshot.
+    void add_documents(const vector<pair<uint32_t, string>> &docs)
+    {
+        auto segment = make_shared<Segment>();
+        uint64_t batch_len = 0;
+        for (auto &[id, content] : docs)
+        {
+            wal.append(id, content);
+            auto tokens = tokenize(content);
+            unordered_map<string, uint32_t> tf;
+            for (auto &t : tokens)
+                tf[t]++;
+            uint32_t len = tokens.size();
+            for (auto &[term, count] : tf)
+                segment->postings[term].push_back({id, count, len});
+            batch_len += len;
+        }
+        for (auto &[term, list] : segment->postings)
+            stable_sort(list.begin(), list.end(), [](const DocPosting &x, const DocPosting &y)
+                        { return x.doc_id < y.doc_id; });
+        segment->docs = docs.size();
 
         lock_guard<mutex> lock(mtx);
-        for (auto &p : tf)
+        auto next = make_shared<Snapshot>(*atomic_load(&snapshot));
+        shared_ptr<const Segment> tail = move(segment);
+        while (!next->segments.empty() && next->segments.back()->docs <= tail->docs)
         {
-            index[p.first].push_back({id, p.second});
+            tail = merge_segments(*next->segments.back(), *tail);
+            next->segments.pop_back();
         }
-
-        doc_len[id] = tokens.size();
-        total_len += tokens.size();
-        total_docs++;
+        next->segments.push_back(move(tail));
+        next->total_len += batch_len;
+        next->total_docs += docs.size();
+        next->generation++;
+        atomic_store(&snapshot, shared_ptr<const Snapshot>(move(next)));
     }
 
     vector<pair<uint32_t, double>>
     search(const string &query, int k)
     {
+        auto snap = atomic_load(&snapshot);
 
-        vector<pair<uint32_t, double>> result;
-        if (cache.get(query, result))
-            return result;
-
+        // The key holds k, the generation and the sorted normalized terms
+        // the snapshot has, so case, word order and unknown words do not
+        // split cache entries; scoring sums the terms in that same order.
         auto terms = tokenize(query);
-        unordered_map<uint32_t, double> scores;
-
+        sort(terms.begin(), terms.end());
+        string key;
+        key.append(reinterpret_cast<const char *>(&k), sizeof(k));
+        key.append(reinterpret_cast<const char *>(&snap->generation), sizeof(snap->generation));
+        // One cursor per term and segment; df is the term's total.
+        vector<const PostingList *> lists;
+        vector<int> dfs;
         for (auto &term : terms)
         {
-            if (!index.count(term))
+            size_t first = lists.size();
+            int df = 0;
+            for (auto &segment : snap->segments)
+            {
+                auto it = segment->postings.find(term);
+                if (it == segment->postings.end())
+                    continue;
+                lists.push_back(&it->second);
+                df += it->second.size();
+            }
+            if (df == 0)
                 continue;
-            int df = index[term].size();
+            dfs.insert(dfs.end(), lists.size() - first, df);
+            key += term;
+            key += '\0';
+        }
 
-            for (auto &post : index[term])
-            {
-                uint32_t doc_id = post.first;
-                int tf = post.second;
+        vector<pair<uint32_t, double>> result;
+        if (cache.get(key, result))
+            return result;
+        if (snap->total_docs == 0)
+            return result;
+
+        vector<size_t> pos(lists.size(), 0);
 
-                double score = bm25(
-                    tf, df,
-                    doc_len[doc_id],
-                    (double)total_len / total_docs,
-                    total_docs);
+        // Min-heap on score; ties keep the smaller doc id.
+        auto worse = [](const pair<uint32_t, double> &a,
+                        const pair<uint32_t, double> &b)
+        {
+            if (a.second != b.second)
+                return a.second > b.second;
+            return a.first < b.first;
+        };
+        double avgdl = (double)snap->total_len / snap->total_docs;
 
-                score += 0.3 * pagerank.get(doc_id);
+        while (k > 0)
+        {
+            uint32_t doc_id = UINT32_MAX;
+            for (size_t i = 0; i < lists.size(); i++)
+                if (pos[i] < lists[i]->size())
+                    doc_id = min(doc_id, (*lists[i])[pos[i]].doc_id);
+            if (doc_id == UINT32_MAX)
+                break;
+
+            double score = 0;
+            for (size_t i = 0; i < lists.size(); i++)
+            {
+                auto &postings = *lists[i];
+                int df = dfs[i];
+                while (pos[i] < postings.size() &&
+                       postings[pos[i]].doc_id == doc_id)
+                {
+                    const DocPosting &posting = postings[pos[i]];
+                    score += bm25(posting.tf, df, posting.doc_len, avgdl, snap->total_docs);
+                    score += 0.3 * pagerank.get(doc_id);
+                    pos[i]++;
+                }
+            }
 
-                scores[doc_id] += score;
+            if (result.size() < (size_t)k)
+            {
+                result.push_back({doc_id, score});
+                push_heap(result.begin(), result.end(), worse);
+            }
+            else if (score > result.front().second)
+            {
+                pop_heap(result.begin(), result.end(), worse);
+                result.back() = {doc_id, score};
+                push_heap(result.begin(), result.end(), worse);
             }
         }
 
-        for (auto &s : scores)
-            result.push_back(s);
-
-        sort(result.begin(), result.end(),
-             [](auto &a, auto &b)
-             {
-                 return a.second > b.second;
-             });
-
-        if (result.size() > k)
-            result.resize(k);
+        sort_heap(result.begin(), result.end(), worse);
 
-        cache.put(query, result);
+        cache.put(key, result);
         return result;
     }
 };
@@ -347,16 +363,16 @@ int main()
     IndexEngine engine;
     ThreadPool pool(4);
 
-    pool.enqueue([&]
-                 { engine.add_document(1,
-                                       "Distributed systems are scalable"); });
+    auto first = pool.submit([&]
+                             { engine.add_document(1,
+                                                   "Distributed systems are scalable"); });
 
-    pool.enqueue([&]
-                 { engine.add_document(2,
-                                       "Search engine uses inverted index"); });
+    auto second = pool.submit([&]
+                              { engine.add_document(2,
+                                                    "Search engine uses inverted index"); });
 
-    this_thread::sleep_for(
-        chrono::milliseconds(500));
+    first.get();
+    second.get();
 
     auto results =
         engine.search("distributed search", 5);
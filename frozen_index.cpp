@@ -0,0 +1,452 @@
+#include "frozen_index.h"
+#include "block_codec.h"
+#include "mmap_loader.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace
+{
+    const char MAGIC[8] = {'D', 'S', 'E', 'F', 'R', 'Z', 'N', '\0'};
+
+    static_assert(sizeof(FrozenIndex::TermInfo) == 16, "on-disk layout");
+    static_assert(sizeof(FrozenIndex::SkipEntry) == 16, "on-disk layout");
+
+    // Version 1 headers end before the fields added in version 2.
+    constexpr size_t V1_HEADER_SIZE = offsetof(FrozenIndex::Header, doc_lookup_offset);
+
+    uint64_t append_section(std::vector<uint8_t> &image, const void *data, size_t size)
+    {
+        image.resize((image.size() + 7) & ~size_t(7), 0);
+        uint64_t offset = image.size();
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        image.insert(image.end(), bytes, bytes + size);
+        return offset;
+    }
+
+    void sync_file(const std::string &path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("open " + path + ": " + std::strerror(errno));
+        int result = fsync(fd);
+        close(fd);
+        if (result != 0)
+            throw std::runtime_error("fsync " + path + ": " + std::strerror(errno));
+    }
+
+    void sync_directory(const std::string &path)
+    {
+        std::filesystem::path dir = std::filesystem::path(path).parent_path();
+        sync_file(dir.empty() ? "." : dir.string());
+    }
+}
+
+FrozenIndex FrozenIndex::build(
+    const std::unordered_map<std::string, std::vector<Posting>> &index,
+    const std::unordered_map<uint32_t, uint32_t> &doc_lengths,
+    const Layout &layout)
+{
+    std::vector<TermRef> sorted_terms;
+    sorted_terms.reserve(index.size());
+    for (const auto &[term, postings] : index)
+    {
+        if (!postings.empty())
+            sorted_terms.push_back({&term, &postings});
+    }
+    std::sort(sorted_terms.begin(), sorted_terms.end(),
+              [](const TermRef &a, const TermRef &b)
+              { return *a.first < *b.first; });
+    return build_terms(sorted_terms, false, doc_lengths, layout);
+}
+
+FrozenIndex FrozenIndex::build_sorted(
+    const SortedTerms &terms,
+    const std::unordered_map<uint32_t, uint32_t> &doc_lengths,
+    const Layout &layout)
+{
+    std::vector<TermRef> sorted_terms;
+    sorted_terms.reserve(terms.size());
+    for (const auto &[term, postings] : terms)
+    {
+        if (!postings.empty())
+            sorted_terms.push_back({&term, &postings});
+    }
+    return build_terms(sorted_terms, true, doc_lengths, layout);
+}
+
+FrozenIndex FrozenIndex::build_terms(
+    const std::vector<TermRef> &sorted_terms, bool presorted,
+    const std::unordered_map<uint32_t, uint32_t> &doc_lengths,
+    const Layout &layout)
+{
+    Header header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = FORMAT_VERSION;
+    header.header_size = sizeof(Header);
+
+    std::vector<uint32_t> sorted_ids;
+    sorted_ids.reserve(doc_lengths.size());
+    for (const auto &[doc_id, length] : doc_lengths)
+        sorted_ids.push_back(doc_id);
+    std::sort(sorted_ids.begin(), sorted_ids.end());
+
+    // Ordinal of every doc, indexed like sorted_ids. Ranked docs go highest
+    // first; equal ranks keep doc-id order.
+    std::vector<uint32_t> doc_ids = sorted_ids;
+    std::vector<uint32_t> lookup;
+    bool reordered = static_cast<bool>(layout.static_rank);
+    if (reordered)
+    {
+        std::vector<std::pair<double, uint32_t>> ranked;
+        ranked.reserve(sorted_ids.size());
+        for (uint32_t i = 0; i < sorted_ids.size(); i++)
+            ranked.push_back({layout.static_rank(sorted_ids[i]), i});
+        std::stable_sort(ranked.begin(), ranked.end(),
+                         [](const auto &a, const auto &b)
+                         { return a.first > b.first; });
+
+        lookup.resize(sorted_ids.size());
+        for (uint32_t ordinal = 0; ordinal < ranked.size(); ordinal++)
+        {
+            doc_ids[ordinal] = sorted_ids[ranked[ordinal].second];
+            lookup[ranked[ordinal].second] = ordinal;
+        }
+        double share = std::min(1.0, std::max(0.0, layout.first_tier));
+        header.tier_boundary = static_cast<uint64_t>(share * doc_ids.size());
+    }
+    else
+    {
+        header.tier_boundary = doc_ids.size();
+    }
+
+    std::vector<uint32_t> lengths;
+    lengths.reserve(doc_ids.size());
+    for (uint32_t doc_id : doc_ids)
+    {
+        lengths.push_back(doc_lengths.at(doc_id));
+        header.total_doc_length += lengths.back();
+    }
+
+    std::vector<TermInfo> terms;
+    std::string term_text;
+    std::vector<SkipEntry> skips;
+    std::vector<uint8_t> postings;
+
+    std::vector<Posting> scratch;
+    std::vector<uint32_t> block_docs, block_freqs;
+    terms.reserve(sorted_terms.size());
+
+    for (const auto &[term, list] : sorted_terms)
+    {
+        const std::vector<Posting> *source = list;
+        if (!presorted || reordered)
+        {
+            // Postings are rewritten to ordinals and sorted by them.
+            scratch.clear();
+            for (const Posting &p : *list)
+            {
+                auto it = std::lower_bound(sorted_ids.begin(), sorted_ids.end(), p.doc_id);
+                uint32_t i = static_cast<uint32_t>(it - sorted_ids.begin());
+                scratch.push_back({reordered ? lookup[i] : i, p.term_freq});
+            }
+            std::sort(scratch.begin(), scratch.end(),
+                      [](const Posting &a, const Posting &b)
+                      { return a.doc_id < b.doc_id; });
+            source = &scratch;
+        }
+        const std::vector<Posting> &sorted = *source;
+
+        terms.push_back({static_cast<uint32_t>(term_text.size()),
+                         static_cast<uint32_t>(term->size()),
+                         static_cast<uint32_t>(sorted.size()),
+                         static_cast<uint32_t>(skips.size())});
+        term_text += *term;
+
+        // Each block restarts its delta chain from zero so it can be decoded
+        // on its own after a skip.
+        for (size_t start = 0; start < sorted.size(); start += POSTING_BLOCK_SIZE)
+        {
+            size_t end = std::min(start + POSTING_BLOCK_SIZE, sorted.size());
+            block_docs.clear();
+            block_freqs.clear();
+            for (size_t i = start; i < end; i++)
+            {
+                uint32_t ordinal = sorted[i].doc_id;
+                if (source == list)
+                    ordinal = static_cast<uint32_t>(
+                        std::lower_bound(doc_ids.begin(), doc_ids.end(), ordinal) -
+                        doc_ids.begin());
+                block_docs.push_back(ordinal);
+                block_freqs.push_back(sorted[i].term_freq);
+            }
+
+            skips.push_back({block_docs.back(),
+                             static_cast<uint32_t>(block_docs.size()),
+                             postings.size()});
+            BlockCodec::encode_block(block_docs.data(), block_freqs.data(),
+                                     block_docs.size(), postings);
+        }
+    }
+    postings.resize(postings.size() + BlockCodec::PADDING, 0);
+
+    header.doc_count = doc_ids.size();
+    header.term_count = terms.size();
+    header.block_count = skips.size();
+    header.term_text_size = term_text.size();
+    header.postings_size = postings.size();
+
+    auto image = std::make_shared<std::vector<uint8_t>>(sizeof(Header));
+    header.doc_ids_offset = append_section(*image, doc_ids.data(), doc_ids.size() * sizeof(uint32_t));
+    header.doc_lengths_offset = append_section(*image, lengths.data(), lengths.size() * sizeof(uint32_t));
+    if (reordered)
+        header.doc_lookup_offset = append_section(*image, lookup.data(), lookup.size() * sizeof(uint32_t));
+    header.terms_offset = append_section(*image, terms.data(), terms.size() * sizeof(TermInfo));
+    header.term_text_offset = append_section(*image, term_text.data(), term_text.size());
+    header.skips_offset = append_section(*image, skips.data(), skips.size() * sizeof(SkipEntry));
+    header.postings_offset = append_section(*image, postings.data(), postings.size());
+    header.file_size = image->size();
+    std::memcpy(image->data(), &header, sizeof(Header));
+
+    FrozenIndex frozen;
+    frozen.attach(std::shared_ptr<const uint8_t>(image, image->data()), image->size(), false);
+    return frozen;
+}
+
+FrozenIndex FrozenIndex::open(const std::string &path)
+{
+    size_t size = 0;
+    void *addr = MMapLoader::map_file(path, size);
+    std::shared_ptr<const uint8_t> image(
+        static_cast<const uint8_t *>(addr),
+        [size](const uint8_t *p)
+        { MMapLoader::unmap_file(const_cast<uint8_t *>(p), size); });
+
+    FrozenIndex frozen;
+    frozen.attach(std::move(image), size, true);
+
+    // Dictionary and per-doc arrays are touched by every query; posting
+    // blocks are reached through skips, so readahead there is mostly waste.
+    const Header &h = *frozen.header;
+    const uint8_t *base = frozen.image.get();
+    MMapLoader::advise(base, h.postings_offset, MMapLoader::Advice::WillNeed);
+    MMapLoader::advise(base + h.postings_offset, h.postings_size, MMapLoader::Advice::Random);
+    return frozen;
+}
+
+bool FrozenIndex::is_frozen_file(const std::string &path)
+{
+    std::ifstream in(path, std::ios::binary);
+    char magic[sizeof(MAGIC)] = {};
+    in.read(magic, sizeof(magic));
+    return in && std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+void FrozenIndex::write(const std::string &path) const
+{
+    // A default-constructed index has no image yet; write an empty one.
+    const FrozenIndex &source = header ? *this : build({}, {});
+
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char *>(source.image.get()), source.image_size);
+        if (!out)
+            throw std::runtime_error("write " + tmp + " failed");
+    }
+    // A WAL checkpoint drops the log on the strength of this file, so its
+    // contents must be durable before the rename and the rename after.
+    sync_file(tmp);
+    if (std::rename(tmp.c_str(), path.c_str()) != 0)
+        throw std::runtime_error("rename " + tmp + " failed");
+    sync_directory(path);
+}
+
+void FrozenIndex::attach(std::shared_ptr<const uint8_t> data, size_t size, bool is_mapped)
+{
+    if (!data || size < sizeof(Header))
+        throw std::runtime_error("FrozenIndex: image too small");
+
+    const Header *h = reinterpret_cast<const Header *>(data.get());
+    if (std::memcmp(h->magic, MAGIC, sizeof(MAGIC)) != 0)
+        throw std::runtime_error("FrozenIndex: bad magic");
+    bool v1 = h->version == 1 && h->header_size == V1_HEADER_SIZE;
+    if (!v1 && (h->version != FORMAT_VERSION || h->header_size != sizeof(Header)))
+        throw std::runtime_error("FrozenIndex: unsupported format version " +
+                                 std::to_string(h->version));
+    if (h->file_size != size)
+        throw std::runtime_error("FrozenIndex: truncated image");
+
+    auto fits = [size](uint64_t offset, uint64_t bytes)
+    { return offset <= size && bytes <= size - offset; };
+    if (!fits(h->doc_ids_offset, h->doc_count * sizeof(uint32_t)) ||
+        !fits(h->doc_lengths_offset, h->doc_count * sizeof(uint32_t)) ||
+        !fits(h->terms_offset, h->term_count * sizeof(TermInfo)) ||
+        !fits(h->term_text_offset, h->term_text_size) ||
+        !fits(h->skips_offset, h->block_count * sizeof(SkipEntry)) ||
+        !fits(h->postings_offset, h->postings_size) ||
+        h->postings_size < BlockCodec::PADDING)
+        throw std::runtime_error("FrozenIndex: section out of bounds");
+    if (!v1 && ((h->doc_lookup_offset != 0 &&
+                 !fits(h->doc_lookup_offset, h->doc_count * sizeof(uint32_t))) ||
+                h->tier_boundary > h->doc_count))
+        throw std::runtime_error("FrozenIndex: section out of bounds");
+
+    // Every term's text and blocks, and every block's count and start,
+    // must lie within their sections: cursors decode into fixed
+    // POSTING_BLOCK_SIZE buffers and trust these fields. This reads the
+    // dictionary and skip entries but no posting block, so opening stays
+    // cheap; corrupt bytes inside a block are not detected.
+    const uint8_t *base = data.get();
+    const auto *term_infos = reinterpret_cast<const TermInfo *>(base + h->terms_offset);
+    const auto *skip_entries = reinterpret_cast<const SkipEntry *>(base + h->skips_offset);
+    for (uint64_t t = 0; t < h->term_count; t++)
+    {
+        const TermInfo &info = term_infos[t];
+        uint64_t blocks = (uint64_t(info.df) + POSTING_BLOCK_SIZE - 1) / POSTING_BLOCK_SIZE;
+        if (uint64_t(info.text_offset) + info.text_length > h->term_text_size ||
+            info.df > h->doc_count || uint64_t(info.first_block) + blocks > h->block_count)
+            throw std::runtime_error("FrozenIndex: corrupt term " + std::to_string(t));
+        for (uint64_t i = 0; i < blocks; i++)
+        {
+            uint64_t expected = std::min<uint64_t>(POSTING_BLOCK_SIZE, info.df - i * POSTING_BLOCK_SIZE);
+            if (skip_entries[info.first_block + i].count != expected)
+                throw std::runtime_error("FrozenIndex: corrupt skip entry " +
+                                         std::to_string(info.first_block + i));
+        }
+    }
+    uint64_t previous = 0;
+    for (uint64_t b = 0; b < h->block_count; b++)
+    {
+        const SkipEntry &entry = skip_entries[b];
+        if (entry.count > POSTING_BLOCK_SIZE || entry.offset < previous ||
+            entry.offset > h->postings_size - BlockCodec::PADDING)
+            throw std::runtime_error("FrozenIndex: corrupt skip entry " + std::to_string(b));
+        previous = entry.offset;
+    }
+
+    image = std::move(data);
+    image_size = size;
+    mapped = is_mapped;
+    header = h;
+    num_docs = h->doc_count;
+    num_terms = h->term_count;
+    num_blocks = h->block_count;
+    doc_ids = reinterpret_cast<const uint32_t *>(base + h->doc_ids_offset);
+    doc_lengths = reinterpret_cast<const uint32_t *>(base + h->doc_lengths_offset);
+    doc_lookup = nullptr;
+    first_tier_end = static_cast<uint32_t>(num_docs);
+    if (!v1)
+    {
+        if (h->doc_lookup_offset != 0)
+            doc_lookup = reinterpret_cast<const uint32_t *>(base + h->doc_lookup_offset);
+        first_tier_end = static_cast<uint32_t>(h->tier_boundary);
+    }
+    terms = reinterpret_cast<const TermInfo *>(base + h->terms_offset);
+    term_text_data = std::string_view(reinterpret_cast<const char *>(base + h->term_text_offset),
+                                      h->term_text_size);
+    skips = reinterpret_cast<const SkipEntry *>(base + h->skips_offset);
+    postings = base + h->postings_offset;
+}
+
+void FrozenIndex::advise_postings(bool sequential) const
+{
+    if (!mapped)
+        return;
+    MMapLoader::advise(postings, header->postings_size,
+                       sequential ? MMapLoader::Advice::Sequential
+                                  : MMapLoader::Advice::Random);
+}
+
+void FrozenIndex::materialize(
+    SortedTerms &sorted_terms,
+    std::unordered_map<uint32_t, uint32_t> &lengths) const
+{
+    for (size_t ordinal = 0; ordinal < num_docs; ordinal++)
+        lengths[doc_ids[ordinal]] = doc_lengths[ordinal];
+
+    advise_postings(true);
+    uint32_t docs[POSTING_BLOCK_SIZE], freqs[POSTING_BLOCK_SIZE];
+    for (size_t t = 0; t < num_terms; t++)
+    {
+        sorted_terms.push_back({std::string(term_text(t)), {}});
+        auto &list = sorted_terms.back().second;
+        list.reserve(terms[t].df);
+
+        size_t first = terms[t].first_block;
+        for (size_t b = first; b < first + block_count(t); b++)
+        {
+            size_t n = decode_block(b, docs, freqs);
+            for (size_t i = 0; i < n; i++)
+                list.push_back({doc_ids[docs[i]], freqs[i]});
+        }
+        if (doc_lookup)
+            std::sort(list.begin(), list.end(),
+                      [](const Posting &a, const Posting &b)
+                      { return a.doc_id < b.doc_id; });
+    }
+    advise_postings(false);
+}
+
+long FrozenIndex::find_term(std::string_view term) const
+{
+    const TermInfo *end = terms + num_terms;
+    const TermInfo *it = std::lower_bound(terms, end, term,
+                                          [this](const TermInfo &info, std::string_view key)
+                                          {
+                                              return term_text_data.substr(
+                                                         info.text_offset, info.text_length) < key;
+                                          });
+    if (it == end || term_text(it - terms) != term)
+        return -1;
+    return it - terms;
+}
+
+std::string_view FrozenIndex::term_text(size_t term) const
+{
+    return term_text_data.substr(terms[term].text_offset, terms[term].text_length);
+}
+
+long FrozenIndex::find_doc(uint32_t doc_id) const
+{
+    if (doc_lookup)
+    {
+        const uint32_t *end = doc_lookup + num_docs;
+        const uint32_t *it = std::lower_bound(doc_lookup, end, doc_id,
+                                              [this](uint32_t ordinal, uint32_t key)
+                                              { return doc_ids[ordinal] < key; });
+        if (it == end || doc_ids[*it] != doc_id)
+            return -1;
+        return *it;
+    }
+
+    const uint32_t *end = doc_ids + num_docs;
+    const uint32_t *it = std::lower_bound(doc_ids, end, doc_id);
+    if (it == end || *it != doc_id)
+        return -1;
+    return it - doc_ids;
+}
+
+uint64_t FrozenIndex::total_doc_length() const
+{
+    return header ? header->total_doc_length : 0;
+}
+
+size_t FrozenIndex::block_count(size_t term) const
+{
+    return (terms[term].df + POSTING_BLOCK_SIZE - 1) / POSTING_BLOCK_SIZE;
+}
+
+size_t FrozenIndex::decode_block(size_t block, uint32_t *docs, uint32_t *freqs) const
+{
+    const SkipEntry &entry = skips[block];
+    BlockCodec::decode_block(postings + entry.offset, entry.count, docs, freqs);
+    return entry.count;
+}
@@ -0,0 +1,175 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "posting.h"
+
+// Immutable, read-optimized form of the inverted index produced by
+// IndexEngine::build(). Documents are renumbered to dense ordinals, in
+// ascending doc-id order or, with a static rank, in descending rank order;
+// every posting list is ordinal-sorted and stored as delta-coded BlockCodec
+// blocks of POSTING_BLOCK_SIZE postings, with one skip entry per block.
+// Terms live in one sorted, contiguous dictionary.
+//
+// With a static rank the ordinals below tier_boundary() form the
+// high-authority tier: the same prefix of every posting list, so a query
+// can finish that tier and stop before reading any of the tail.
+//
+// The whole structure is a single byte image, identical in memory and on
+// disk, so an index written with write() is served in place by open()
+// without deserialization. Copies share the underlying image.
+//
+// Image layout (native little-endian, sections 8-byte aligned):
+//   Header | doc ids | doc lengths | [doc lookup] | term infos | term text |
+//   skip entries | posting blocks (+ BlockCodec::PADDING)
+// The doc lookup (ordinals in ascending doc-id order) is only present when
+// ordinals are not in doc-id order.
+class FrozenIndex
+{
+public:
+    static constexpr uint32_t FORMAT_VERSION = 2;
+
+    struct TermInfo
+    {
+        uint32_t text_offset;
+        uint32_t text_length;
+        uint32_t df;
+        uint32_t first_block;
+    };
+
+    struct SkipEntry
+    {
+        uint32_t last_doc;
+        uint32_t count;
+        uint64_t offset;
+    };
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t header_size;
+        uint64_t file_size;
+        uint64_t doc_count;
+        uint64_t total_doc_length;
+        uint64_t term_count;
+        uint64_t block_count;
+        uint64_t doc_ids_offset;
+        uint64_t doc_lengths_offset;
+        uint64_t terms_offset;
+        uint64_t term_text_offset;
+        uint64_t term_text_size;
+        uint64_t skips_offset;
+        uint64_t postings_offset;
+        uint64_t postings_size;
+        // Added in version 2.
+        uint64_t doc_lookup_offset;
+        uint64_t tier_boundary;
+    };
+
+    // Document order for build(). Without a static rank ordinals follow doc
+    // ids and there is a single tier.
+    struct Layout
+    {
+        std::function<double(uint32_t doc_id)> static_rank;
+        // Share of documents, highest rank first, in the first tier.
+        double first_tier = 0.1;
+    };
+
+    static FrozenIndex build(
+        const std::unordered_map<std::string, std::vector<Posting>> &index,
+        const std::unordered_map<uint32_t, uint32_t> &doc_lengths,
+        const Layout &layout);
+    static FrozenIndex build(
+        const std::unordered_map<std::string, std::vector<Posting>> &index,
+        const std::unordered_map<uint32_t, uint32_t> &doc_lengths)
+    {
+        return build(index, doc_lengths, Layout());
+    }
+
+    // Terms in ascending order, each with a doc-id-sorted posting list.
+    using SortedTerms = std::vector<std::pair<std::string, std::vector<Posting>>>;
+
+    // Same as build() for input that is already sorted, e.g. the output of
+    // a k-way merge of sub-indexes; nothing is copied or re-sorted.
+    static FrozenIndex build_sorted(
+        const SortedTerms &terms,
+        const std::unordered_map<uint32_t, uint32_t> &doc_lengths,
+        const Layout &layout);
+    static FrozenIndex build_sorted(
+        const SortedTerms &terms,
+        const std::unordered_map<uint32_t, uint32_t> &doc_lengths)
+    {
+        return build_sorted(terms, doc_lengths, Layout());
+    }
+
+    // Memory-maps an image written by write(). Throws std::runtime_error if
+    // the file is missing or not a valid image of FORMAT_VERSION or 1.
+    static FrozenIndex open(const std::string &path);
+    static bool is_frozen_file(const std::string &path);
+
+    // Writes the image to a temporary file and renames it over `path`.
+    void write(const std::string &path) const;
+
+    // Appends every term, in order, with its posting list keyed by external
+    // doc id and sorted by it; the output is a sorted run for a k-way merge.
+    void materialize(
+        SortedTerms &terms,
+        std::unordered_map<uint32_t, uint32_t> &doc_lengths) const;
+
+    // Term ordinal, or -1 when the term is not in the dictionary.
+    long find_term(std::string_view term) const;
+    std::string_view term_text(size_t term) const;
+    const TermInfo &term_info(size_t term) const { return terms[term]; }
+    size_t term_count() const { return num_terms; }
+
+    // Doc ordinal for an external doc id, or -1.
+    long find_doc(uint32_t doc_id) const;
+    uint32_t doc_id(uint32_t ordinal) const { return doc_ids[ordinal]; }
+    uint32_t doc_length(uint32_t ordinal) const { return doc_lengths[ordinal]; }
+    size_t doc_count() const { return num_docs; }
+    uint64_t total_doc_length() const;
+    // Ordinals below this are the first tier; doc_count() when untiered.
+    uint32_t tier_boundary() const { return first_tier_end; }
+    bool is_rank_ordered() const { return doc_lookup != nullptr; }
+
+    const SkipEntry &skip(size_t block) const { return skips[block]; }
+    size_t block_count() const { return num_blocks; }
+    size_t block_count(size_t term) const;
+
+    // Decodes one block into ordinals and term frequencies; returns its size.
+    size_t decode_block(size_t block, uint32_t *docs, uint32_t *freqs) const;
+
+    size_t memory_usage() const { return image_size; }
+    bool is_mapped() const { return mapped; }
+
+private:
+    using TermRef = std::pair<const std::string *, const std::vector<Posting> *>;
+    static FrozenIndex build_terms(const std::vector<TermRef> &sorted_terms, bool presorted,
+                                   const std::unordered_map<uint32_t, uint32_t> &doc_lengths,
+                                   const Layout &layout);
+
+    void attach(std::shared_ptr<const uint8_t> image, size_t size, bool is_mapped);
+    void advise_postings(bool sequential) const;
+
+    std::shared_ptr<const uint8_t> image;
+    size_t image_size = 0;
+    bool mapped = false;
+
+    const Header *header = nullptr;
+    size_t num_docs = 0;
+    size_t num_terms = 0;
+    size_t num_blocks = 0;
+    const uint32_t *doc_ids = nullptr;
+    const uint32_t *doc_lengths = nullptr;
+    const uint32_t *doc_lookup = nullptr;
+    uint32_t first_tier_end = 0;
+    const TermInfo *terms = nullptr;
+    std::string_view term_text_data;
+    const SkipEntry *skips = nullptr;
+    const uint8_t *postings = nullptr;
+};
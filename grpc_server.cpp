@@ -1,31 +1,315 @@
 #include "bm25.h"
-#include "lru_cache.h"
+#include "concurrent_cache.h"
 #include "index_engine.h"
 #include "search.grpc.pb.h"
+#include "search_coordinator.h"
 #include <grpcpp/grpcpp.h>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <thread>
 
+using grpc::ServerContext;
+using grpc::ServerReader;
+using grpc::ServerWriter;
+using grpc::Status;
+
+namespace
+{
+    CollectionStats from_proto(const IndexStats &global)
+    {
+        CollectionStats stats;
+        stats.version = global.version();
+        stats.doc_count = global.doc_count();
+        stats.live_doc_count = global.live_doc_count();
+        stats.total_doc_length = global.total_doc_length();
+        for (const auto &[term, df] : global.doc_freqs())
+            stats.doc_freqs[term] = df;
+        return stats;
+    }
+
+    void add_results(QueryResponse *response,
+                     const std::vector<std::pair<uint32_t, double>> &results)
+    {
+        for (auto &r : results)
+        {
+            auto *res = response->add_results();
+            res->set_doc_id(r.first);
+            res->set_score(r.second);
+        }
+    }
+
+    void to_proto(const SearchCoordinator::Result &merged, QueryResponse *response)
+    {
+        add_results(response, merged.results);
+        response->set_shards_queried(merged.shards_queried);
+        response->set_shards_answered(merged.shards_answered);
+    }
+}
+
+// Serves one shard from a local IndexEngine or, in coordinator mode, fans
+// each query out to the shard servers and returns their merged results.
 class SearchServiceImpl final : public SearchService::Service
 {
+public:
+    SearchServiceImpl() = default;
+    explicit SearchServiceImpl(std::unique_ptr<SearchCoordinator> coordinator)
+        : coordinator(std::move(coordinator)) {}
+
+    IndexEngine &engine() { return index_engine; }
+    // Stalls a `fraction` of shard queries for `delay`, to benchmark a
+    // coordinator against a slow shard or replica.
+    void inject_delay(std::chrono::milliseconds delay, double fraction)
+    {
+        injected_delay = delay;
+        delay_fraction = fraction;
+    }
+
     Status Search(ServerContext *context,
                   const QueryRequest *request,
                   QueryResponse *response) override
     {
+        if (coordinator)
+        {
+            to_proto(coordinator->search(request->query(), request->top_k()), response);
+            return Status::OK;
+        }
+        if (stall())
+            std::this_thread::sleep_for(injected_delay);
 
-        std::string query = request->query();
+        std::vector<std::pair<uint32_t, double>> results;
+        if (request->has_stats())
+            results = index_engine.search(request->query(), request->top_k(),
+                                          SearchMode::Exhaustive, from_proto(request->stats()));
+        else
+            results = index_engine.search(request->query(), request->top_k());
+        response->set_generation(index_engine.get_snapshot()->generation);
+        add_results(response, results);
+        return Status::OK;
+    }
 
-        std::vector<std::pair<uint32_t, double>> results =
-            index_engine.search(query, request->top_k());
+    Status BatchSearch(ServerContext *context,
+                       const BatchQueryRequest *request,
+                       BatchQueryResponse *response) override
+    {
+        std::vector<std::string> queries(request->queries().begin(), request->queries().end());
+        if (coordinator)
+        {
+            for (const auto &merged : coordinator->search_batch(queries, request->top_k()))
+                to_proto(merged, response->add_responses());
+            return Status::OK;
+        }
+        if (stall())
+            std::this_thread::sleep_for(injected_delay);
 
-        for (auto &r : results)
+        std::vector<std::vector<std::pair<uint32_t, double>>> results;
+        if (request->has_stats())
         {
-            auto *res = response->add_results();
-            res->set_doc_id(r.first);
-            res->set_score(r.second);
+            CollectionStats stats = from_proto(request->stats());
+            results = index_engine.search_batch(queries, request->top_k(),
+                                                SearchMode::Exhaustive, &stats);
+        }
+        else
+            results = index_engine.search_batch(queries, request->top_k());
+        // Read after searching, as in Search: a refresh in between only
+        // makes the coordinator drop statistics that were still good.
+        uint64_t generation = index_engine.get_snapshot()->generation;
+        for (const auto &result : results)
+        {
+            QueryResponse *reply = response->add_responses();
+            reply->set_generation(generation);
+            add_results(reply, result);
+        }
+        return Status::OK;
+    }
+
+    Status SearchStream(ServerContext *context,
+                        const QueryRequest *request,
+                        ServerWriter<QueryResponse> *writer) override
+    {
+        if (!coordinator)
+        {
+            QueryResponse response;
+            Status status = Search(context, request, &response);
+            if (status.ok())
+                writer->Write(response);
+            return status;
         }
 
+        // A client that went away stops getting updates, not the search.
+        bool open = true;
+        SearchCoordinator::Result merged = coordinator->search(
+            request->query(), request->top_k(),
+            [&](const SearchCoordinator::Result &progress)
+            {
+                QueryResponse response;
+                to_proto(progress, &response);
+                open = open && writer->Write(response);
+            });
+        if (merged.shards_answered == 0)
+        {
+            QueryResponse response;
+            to_proto(merged, &response);
+            writer->Write(response);
+        }
+        return Status::OK;
+    }
+
+    Status Index(ServerContext *context,
+                 ServerReader<Document> *reader,
+                 IndexResponse *response) override
+    {
+        if (coordinator)
+            return coordinator->index([&](Document &document)
+                                      { return reader->Read(&document); },
+                                      response);
+
+        // Adds go in batches; a delete first flushes the adds before it,
+        // which may include an earlier version of the doc it deletes.
+        std::vector<std::pair<uint32_t, std::string>> batch;
+        auto flush = [&]
+        {
+            index_engine.add_documents(batch);
+            response->set_indexed(response->indexed() + batch.size());
+            batch.clear();
+        };
+        Document document;
+        while (reader->Read(&document))
+        {
+            if (document.deleted())
+            {
+                if (!batch.empty())
+                    flush();
+                if (index_engine.delete_document(document.doc_id()))
+                    response->set_deleted(response->deleted() + 1);
+                continue;
+            }
+            batch.push_back({document.doc_id(), std::move(*document.mutable_content())});
+            if (batch.size() >= INGEST_BATCH)
+                flush();
+        }
+        if (!batch.empty())
+            flush();
+        index_engine.refresh();
+        return Status::OK;
+    }
+
+    Status Stats(ServerContext *context,
+                 const StatsRequest *request,
+                 IndexStats *response) override
+    {
+        if (coordinator)
+            return Status(grpc::StatusCode::UNIMPLEMENTED, "not a shard");
+
+        std::vector<std::string> terms(request->terms().begin(), request->terms().end());
+        CollectionStats stats = index_engine.collection_stats(terms);
+        response->set_version(stats.version);
+        response->set_doc_count(stats.doc_count);
+        response->set_live_doc_count(stats.live_doc_count);
+        response->set_total_doc_length(stats.total_doc_length);
+        response->mutable_doc_freqs()->insert(stats.doc_freqs.begin(), stats.doc_freqs.end());
         return Status::OK;
     }
 
 private:
+    // Documents a streamed ingest indexes at a time.
+    static constexpr size_t INGEST_BATCH = 1024;
+
+    bool stall()
+    {
+        if (delay_fraction <= 0)
+            return false;
+        thread_local std::mt19937 rng(std::random_device{}());
+        return std::uniform_real_distribution<double>(0, 1)(rng) < delay_fraction;
+    }
+
     IndexEngine index_engine;
+    std::unique_ptr<SearchCoordinator> coordinator;
+    std::chrono::milliseconds injected_delay{0};
+    double delay_fraction = 0;
 };
+
+// grpc_server <address> --index <file> [--delay-ms <ms> [--delay-fraction <f>]]
+//     serves a shard from an index written by IndexEngine::save(),
+//     optionally stalling a fraction (default all) of its queries.
+// grpc_server <address> (--shards <addr,...> | --shard <replica,...>...)
+//             [--deadline-ms <ms>] [--hedge-percentile <p>]
+//     serves as the coordinator of those shards: --shards lists shards
+//     with one address each, and each --shard adds one shard served by
+//     the listed replicas.
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "usage: " << argv[0]
+                  << " <address> (--index <file> [--delay-ms <ms> [--delay-fraction <f>]]"
+                  << " | (--shards <addr,...> | --shard <replica,...>...)"
+                  << " [--deadline-ms <ms>] [--hedge-percentile <p>])\n";
+        return 1;
+    }
+    std::string address = argv[1];
+    std::string index_path;
+    std::vector<std::vector<std::string>> shards;
+    SearchCoordinator::Options options;
+    std::chrono::milliseconds delay{0};
+    double delay_fraction = 1;
+    auto split = [](const std::string &list)
+    {
+        std::vector<std::string> items;
+        std::stringstream stream(list);
+        for (std::string item; std::getline(stream, item, ',');)
+            items.push_back(item);
+        return items;
+    };
+    for (int i = 2; i + 1 < argc; i += 2)
+    {
+        std::string flag = argv[i];
+        if (flag == "--index")
+            index_path = argv[i + 1];
+        else if (flag == "--shards")
+        {
+            for (const std::string &shard : split(argv[i + 1]))
+                shards.push_back({shard});
+        }
+        else if (flag == "--shard")
+            shards.push_back(split(argv[i + 1]));
+        else if (flag == "--deadline-ms")
+            options.deadline = std::chrono::milliseconds(std::atol(argv[i + 1]));
+        else if (flag == "--hedge-percentile")
+            options.hedge_percentile = std::atof(argv[i + 1]);
+        else if (flag == "--delay-ms")
+            delay = std::chrono::milliseconds(std::atol(argv[i + 1]));
+        else if (flag == "--delay-fraction")
+            delay_fraction = std::atof(argv[i + 1]);
+    }
+
+    std::unique_ptr<SearchServiceImpl> service;
+    if (!shards.empty())
+        service = std::make_unique<SearchServiceImpl>(
+            std::make_unique<SearchCoordinator>(shards, options));
+    else
+    {
+        service = std::make_unique<SearchServiceImpl>();
+        if (!index_path.empty())
+            service->engine().load(index_path);
+        if (delay.count() > 0)
+            service->inject_delay(delay, delay_fraction);
+    }
+
+    grpc::ServerBuilder builder;
+    builder.AddListeningPort(address, grpc::InsecureServerCredentials());
+    builder.RegisterService(service.get());
+    std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+    if (!server)
+    {
+        std::cerr << "cannot listen on " << address << "\n";
+        return 1;
+    }
+    std::cout << (shards.empty() ? "shard" : "coordinator") << " listening on " << address
+              << std::endl;
+    server->Wait();
+    return 0;
+}
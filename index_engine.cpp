@@ -1,71 +1,1409 @@
 #include "index_engine.h"
 #include "tokenizer.h"
 #include "serializer.h"
+#include "query_evaluator.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cmath>
+#include <future>
+#include <iterator>
+#include <queue>
+#include <stdexcept>
 
-IndexEngine::IndexEngine()
+namespace
 {
-    document_count = 0;
-    total_doc_length = 0;
+    // Calls emit(term id, frequency) once per distinct term of a document
+    // whose ids are sorted; cheaper than a per-document hash map.
+    template <typename Emit>
+    void count_terms(const std::vector<uint32_t> &term_ids, Emit emit)
+    {
+        for (size_t i = 0; i < term_ids.size();)
+        {
+            size_t j = i + 1;
+            while (j < term_ids.size() && term_ids[j] == term_ids[i])
+                j++;
+            emit(term_ids[i], static_cast<uint32_t>(j - i));
+            i = j;
+        }
+    }
+
+    bool by_doc(const Posting &a, const Posting &b)
+    {
+        return a.doc_id < b.doc_id;
+    }
+
+    // Moves a sub-index's postings into a term-sorted run of doc-sorted lists.
+    FrozenIndex::SortedTerms to_run(SubIndex &part, const TermDictionary &terms)
+    {
+        FrozenIndex::SortedTerms run;
+        run.reserve(part.postings.size());
+        for (auto &[term_id, list] : part.postings)
+        {
+            if (!part.dropped.empty())
+                list.erase(std::remove_if(list.begin(), list.end(),
+                                          [&](const Posting &p)
+                                          { return part.dropped.count(p.doc_id) > 0; }),
+                           list.end());
+            if (list.empty())
+                continue;
+            if (!std::is_sorted(list.begin(), list.end(), by_doc))
+                std::sort(list.begin(), list.end(), by_doc);
+            run.push_back({std::string(terms.term(term_id)), std::move(list)});
+        }
+        part.postings = {};
+        std::sort(run.begin(), run.end(),
+                  [](const auto &a, const auto &b)
+                  { return a.first < b.first; });
+        return run;
+    }
+
+    // k-way merge of the entries [begin[r], end[r]) of each run r. Lists of
+    // a term found in several runs are merged by doc id.
+    void merge_range(std::vector<FrozenIndex::SortedTerms> &runs,
+                     const std::vector<size_t> &begin, const std::vector<size_t> &end,
+                     FrozenIndex::SortedTerms &out)
+    {
+        std::vector<size_t> pos = begin;
+        using Head = std::pair<const std::string *, size_t>;
+        auto later = [](const Head &a, const Head &b)
+        { return *a.first > *b.first; };
+        std::priority_queue<Head, std::vector<Head>, decltype(later)> heads(later);
+
+        for (size_t r = 0; r < runs.size(); r++)
+        {
+            if (pos[r] < end[r])
+                heads.push({&runs[r][pos[r]].first, r});
+        }
+
+        while (!heads.empty())
+        {
+            size_t r = heads.top().second;
+            heads.pop();
+            auto &[term, list] = runs[r][pos[r]];
+            out.push_back({std::move(term), std::move(list)});
+            auto &merged = out.back().second;
+
+            auto advance = [&](size_t run)
+            {
+                if (++pos[run] < end[run])
+                    heads.push({&runs[run][pos[run]].first, run});
+            };
+            advance(r);
+
+            while (!heads.empty() && *heads.top().first == out.back().first)
+            {
+                size_t other = heads.top().second;
+                heads.pop();
+                auto &more = runs[other][pos[other]].second;
+                size_t middle = merged.size();
+                merged.insert(merged.end(), more.begin(), more.end());
+                std::inplace_merge(merged.begin(), merged.begin() + middle, merged.end(), by_doc);
+                more = {};
+                advance(other);
+            }
+        }
+    }
+
+    // Removes the postings and lengths of a segment's deleted docs from its
+    // materialized run; terms left without postings are dropped.
+    void drop_deleted(const FrozenIndex &index, const DeletedDocs &deleted,
+                      FrozenIndex::SortedTerms &run,
+                      std::unordered_map<uint32_t, uint32_t> &lengths)
+    {
+        std::vector<uint32_t> doc_ids;
+        for (uint32_t ordinal = 0; ordinal < index.doc_count(); ordinal++)
+        {
+            if (deleted.contains(ordinal))
+                doc_ids.push_back(index.doc_id(ordinal));
+        }
+        std::sort(doc_ids.begin(), doc_ids.end());
+        for (uint32_t doc_id : doc_ids)
+            lengths.erase(doc_id);
+
+        auto is_deleted = [&](const Posting &p)
+        { return std::binary_search(doc_ids.begin(), doc_ids.end(), p.doc_id); };
+        for (auto &[term, list] : run)
+            list.erase(std::remove_if(list.begin(), list.end(), is_deleted), list.end());
+        run.erase(std::remove_if(run.begin(), run.end(),
+                                 [](const auto &entry)
+                                 { return entry.second.empty(); }),
+                  run.end());
+    }
+
+    // Splits the term space at evenly spaced terms of the largest run and
+    // merges each range on its own worker.
+    FrozenIndex::SortedTerms merge_runs(std::vector<FrozenIndex::SortedTerms> &runs,
+                                        ThreadPool &pool, size_t ranges)
+    {
+        size_t largest = 0;
+        for (size_t r = 1; r < runs.size(); r++)
+            if (runs[r].size() > runs[largest].size())
+                largest = r;
+
+        std::vector<std::string> splitters;
+        size_t terms = runs.empty() ? 0 : runs[largest].size();
+        ranges = std::max<size_t>(1, std::min(ranges, terms));
+        for (size_t i = 1; i < ranges; i++)
+            splitters.push_back(runs[largest][i * terms / ranges].first);
+
+        // Range boundaries in every run are found up front: merging moves
+        // terms out of the runs, so no range may search them afterwards.
+        std::vector<std::vector<size_t>> cuts(ranges + 1, std::vector<size_t>(runs.size()));
+        for (size_t r = 0; r < runs.size(); r++)
+        {
+            cuts[ranges][r] = runs[r].size();
+            for (size_t i = 1; i < ranges; i++)
+                cuts[i][r] = static_cast<size_t>(
+                    std::lower_bound(runs[r].begin(), runs[r].end(), splitters[i - 1],
+                                     [](const auto &entry, const std::string &key)
+                                     { return entry.first < key; }) -
+                    runs[r].begin());
+        }
+
+        std::vector<FrozenIndex::SortedTerms> merged(ranges);
+        pool.parallel_for(0, ranges, [&](size_t i)
+                          { merge_range(runs, cuts[i], cuts[i + 1], merged[i]); }, 1);
+
+        FrozenIndex::SortedTerms result = std::move(merged[0]);
+        for (size_t i = 1; i < ranges; i++)
+            std::move(merged[i].begin(), merged[i].end(), std::back_inserter(result));
+        return result;
+    }
+
+    void evaluate(SearchMode mode, std::vector<PostingCursor> &cursors, const Scorer &scorer,
+                  TopKHeap &top, uint32_t end)
+    {
+        switch (mode)
+        {
+        case SearchMode::Exhaustive:
+            evaluate_daat(cursors, scorer, top, end);
+            break;
+        case SearchMode::Wand:
+            evaluate_wand(cursors, scorer, top, end);
+            break;
+        case SearchMode::BlockMaxWand:
+            evaluate_block_max_wand(cursors, scorer, top, end);
+            break;
+        }
+    }
+
+    std::atomic<uint64_t> next_instance{0};
+}
+
+IndexEngine::IndexEngine() : instance(++next_instance) {}
+
+IndexEngine::~IndexEngine()
+{
+    set_refresh_interval(std::chrono::milliseconds(0));
+    merge_pool.wait();
 }
 
 void IndexEngine::add_document(uint32_t doc_id, const std::string &content)
 {
-    Tokenizer tokenizer;
-    auto tokens = tokenizer.tokenize(content);
+    thread_local Tokenizer tokenizer;
+    thread_local std::vector<uint32_t> term_ids;
+    term_ids.clear();
+    tokenizer.tokenize(content, terms, term_ids);
+    uint32_t length = term_ids.size();
+    std::sort(term_ids.begin(), term_ids.end());
+
+    std::lock_guard<std::mutex> lock(index_mutex);
+    delete_locked(&doc_id, 1);
+
+    count_terms(term_ids, [&](uint32_t term, uint32_t freq)
+                { inverted_index[term].push_back({doc_id, freq}); });
+
+    doc_lengths[doc_id] = length;
+    pending = true;
+}
+
+void IndexEngine::add_documents(const std::vector<std::pair<uint32_t, std::string>> &docs,
+                                size_t threads)
+{
+    // Only the last version of a doc listed twice is indexed.
+    std::unordered_map<uint32_t, size_t> last;
+    for (size_t i = 0; i < docs.size(); i++)
+        last[docs[i].first] = i;
+
+    threads = std::max<size_t>(1, std::min(threads, docs.size()));
+    std::vector<SubIndex> parts(threads);
+    size_t per_part = (docs.size() + threads - 1) / threads;
+    workers.parallel_for(0, threads, [&](size_t w)
+                         {
+        Tokenizer tokenizer;
+        std::vector<uint32_t> term_ids;
+        size_t end = std::min(docs.size(), (w + 1) * per_part);
+        for (size_t i = w * per_part; i < end; i++)
+        {
+            if (last.at(docs[i].first) != i)
+                continue;
+            term_ids.clear();
+            tokenizer.tokenize(docs[i].second, terms, term_ids);
+            parts[w].add_document(docs[i].first, term_ids);
+        } }, 1);
+
+    for (auto &part : parts)
+        merge(std::move(part));
+}
+
+void SubIndex::add_document(uint32_t doc_id, std::vector<uint32_t> &term_ids)
+{
+    uint32_t length = term_ids.size();
+    std::sort(term_ids.begin(), term_ids.end());
+    count_terms(term_ids, [&](uint32_t term, uint32_t freq)
+                { postings[term].push_back({doc_id, freq}); });
+
+    doc_lengths[doc_id] = length;
+    total_doc_length += length;
+}
 
-    std::unordered_map<std::string, uint32_t> term_freq;
+void IndexEngine::merge(SubIndex &&sub)
+{
+    if (sub.doc_lengths.empty())
+        return;
+
+    std::vector<uint32_t> doc_ids;
+    doc_ids.reserve(sub.doc_lengths.size());
+    for (const auto &[doc_id, length] : sub.doc_lengths)
+        doc_ids.push_back(doc_id);
+
+    std::lock_guard<std::mutex> lock(index_mutex);
+    delete_locked(doc_ids.data(), doc_ids.size());
+    pending_parts.push_back(std::move(sub));
+    pending = true;
+}
 
-    for (const auto &token : tokens)
+bool IndexEngine::delete_document(uint32_t doc_id)
+{
+    std::lock_guard<std::mutex> lock(index_mutex);
+    return delete_locked(&doc_id, 1) > 0;
+}
+
+void IndexEngine::refresh()
+{
+    std::lock_guard<std::mutex> lock(index_mutex);
+    refresh_locked(true);
+}
+
+// Merges already running finish first; their results would be discarded
+// anyway once everything is merged here.
+void IndexEngine::build()
+{
+    merge_pool.wait();
+    std::lock_guard<std::mutex> lock(index_mutex);
+    build_locked();
+}
+
+void IndexEngine::build_locked()
+{
+    refresh_locked(false);
+    if (segments.size() > 1 || relayout || !deletes.empty())
+        merge_all_locked();
+}
+
+bool IndexEngine::has_pending_locked() const
+{
+    return !pending_parts.empty() || !inverted_index.empty() || !doc_lengths.empty() ||
+           !deferred_deletes.empty();
+}
+
+void IndexEngine::refresh_locked(bool schedule_merges)
+{
+    if (has_pending_locked())
+        flush_locked();
+    pending = false;
+    if (!unpublished)
+        return;
+
+    publish_locked();
+    if (schedule_merges)
+        schedule_merges_locked();
+}
+
+// The add_document() buffer is one more part; every part is turned into a
+// sorted run in parallel and the runs are k-way merged straight into the
+// frozen layout of a new segment.
+void IndexEngine::flush_locked()
+{
+    // Before the new segment joins: it holds the latest versions.
+    apply_deletes_locked();
+    seal_buffer_locked();
+
+    std::vector<FrozenIndex::SortedTerms> runs(pending_parts.size());
+    std::vector<std::future<void>> sorted;
+    for (size_t i = 0; i < pending_parts.size(); i++)
+        sorted.push_back(workers.submit([this, &runs, i]
+                                        { runs[i] = to_run(pending_parts[i], terms); }));
+
+    // Workers only touch postings, so lengths can be gathered meanwhile.
+    std::unordered_map<uint32_t, uint32_t> lengths;
+    for (auto &part : pending_parts)
+    {
+        if (lengths.empty())
+            lengths = std::move(part.doc_lengths);
+        else
+            lengths.insert(part.doc_lengths.begin(), part.doc_lengths.end());
+    }
+    for (auto &done : sorted)
+        done.get();
+    pending_parts.clear();
+    // Every buffered doc was dropped again.
+    if (lengths.empty())
+        return;
+
+    SegmentSettings settings = settings_locked();
+    FrozenIndex index = FrozenIndex::build_sorted(merge_runs(runs, workers, workers.size()),
+                                                  lengths, settings.layout);
+    segments.push_back(make_segment(std::move(index), segments, settings));
+    unpublished = true;
+}
+
+// Moves the write buffer into pending_parts as it is, without building a
+// segment.
+void IndexEngine::seal_buffer_locked()
+{
+    SubIndex base;
+    base.postings = std::move(inverted_index);
+    base.doc_lengths = std::move(doc_lengths);
+    pending_parts.push_back(std::move(base));
+    inverted_index = {};
+    doc_lengths = {};
+}
+
+// A doc in the write buffer proper seals it first: the buffer may receive
+// the doc again, and a part must hold each doc at most once for a dropped
+// doc to be skipped by id. Sealing is a move, so updating one doc many
+// times between refreshes costs a part each time, not a segment.
+size_t IndexEngine::drop_buffered_locked(uint32_t doc_id)
+{
+    if (doc_lengths.count(doc_id))
+        seal_buffer_locked();
+    for (auto &part : pending_parts)
+    {
+        auto it = part.doc_lengths.find(doc_id);
+        if (it == part.doc_lengths.end())
+            continue;
+        part.total_doc_length -= std::min<uint64_t>(part.total_doc_length, it->second);
+        part.doc_lengths.erase(it);
+        part.dropped.insert(doc_id);
+        return 1;
+    }
+    return 0;
+}
+
+// A version still in the write buffer has no ordinal to tombstone, so it
+// is dropped in place. Versions in segments are only noted here and
+// tombstoned by the next flush, so a publish in between (a merge, new
+// settings) does not show a delete, or the removal half of an update,
+// ahead of the refresh that shows the rest.
+size_t IndexEngine::delete_locked(const uint32_t *doc_ids, size_t count)
+{
+    size_t removed = 0;
+    for (size_t i = 0; i < count; i++)
     {
-        term_freq[token]++;
+        uint32_t doc_id = doc_ids[i];
+        bool live = drop_buffered_locked(doc_id) > 0;
+        if (!deferred_deletes.insert(doc_id).second)
+        {
+            removed += live;
+            continue;
+        }
+        for (size_t s = 0; s < segments.size() && !live; s++)
+        {
+            long ordinal = segments[s]->index.find_doc(doc_id);
+            auto tombstones = deleted_locked(*segments[s]);
+            live = ordinal >= 0 && !(tombstones && tombstones->contains(ordinal));
+        }
+        removed += live;
     }
 
+    if (!deferred_deletes.empty())
+        pending = true;
+    return removed;
+}
+
+// Tombstones the segment versions of every deferred delete. Segments left
+// without a live doc are dropped right away.
+void IndexEngine::apply_deletes_locked()
+{
+    if (deferred_deletes.empty())
+        return;
+    for (auto it = segments.begin(); it != segments.end();)
+    {
+        const Segment &segment = **it;
+        const FrozenIndex &index = segment.index;
+        auto current = deleted_locked(segment);
+        std::shared_ptr<DeletedDocs> updated;
+        for (uint32_t doc_id : deferred_deletes)
+        {
+            long ordinal = index.find_doc(doc_id);
+            if (ordinal < 0)
+                continue;
+            const DeletedDocs *seen = updated ? updated.get() : current.get();
+            if (seen && seen->contains(ordinal))
+                continue;
+            if (!updated)
+                updated = current ? std::make_shared<DeletedDocs>(*current)
+                                  : std::make_shared<DeletedDocs>(index.doc_count());
+            updated->add(ordinal, index.doc_length(ordinal));
+        }
+
+        if (updated && updated->count == index.doc_count())
+        {
+            deletes.erase(segment.id);
+            it = segments.erase(it);
+            unpublished = true;
+            continue;
+        }
+        if (updated)
+        {
+            deletes[segment.id] = std::move(updated);
+            unpublished = true;
+        }
+        ++it;
+    }
+    deferred_deletes.clear();
+}
+
+std::shared_ptr<const DeletedDocs> IndexEngine::deleted_locked(const Segment &segment) const
+{
+    auto found = deletes.find(segment.id);
+    return found == deletes.end() ? nullptr : found->second;
+}
+
+// `others` are the rest of the collection, which quantized impacts need
+// for document frequencies, N and avgdl.
+std::shared_ptr<const Segment> IndexEngine::make_segment(
+    FrozenIndex index, const std::vector<std::shared_ptr<const Segment>> &others,
+    const SegmentSettings &settings)
+{
+    auto segment = std::make_shared<Segment>();
+    segment->index = std::move(index);
+    segment->id = next_segment_id++;
+    const FrozenIndex &frozen = segment->index;
+    if (!settings.quantized)
+        return segment;
+
+    const BM25 &bm25 = settings.bm25;
+
+    uint64_t docs = frozen.doc_count();
+    uint64_t length = frozen.total_doc_length();
+    for (const auto &other : others)
+    {
+        docs += other->index.doc_count();
+        length += other->index.total_doc_length();
+    }
+    std::vector<double> weights(frozen.term_count());
+    for (size_t t = 0; t < frozen.term_count(); t++)
+    {
+        uint64_t df = frozen.term_info(t).df;
+        for (const auto &other : others)
+        {
+            long found = other->index.find_term(frozen.term_text(t));
+            if (found >= 0)
+                df += other->index.term_info(found).df;
+        }
+        weights[t] = Scorer::term_weight(bm25, df, docs);
+    }
+
+    segment->impact_docs = docs;
+    segment->impact_length = length;
+    double avgdl = docs == 0 ? 0 : static_cast<double>(length) / docs;
+    Scorer scorer{&frozen, nullptr, nullptr, bm25.get_k1() * (1 - bm25.get_b()),
+                  avgdl > 0 ? bm25.get_k1() * bm25.get_b() / avgdl : 0};
+    segment->impacts = QuantizedImpacts::build(frozen, scorer, weights);
+    return segment;
+}
+
+// Every source is materialized back into a sorted run and the runs are
+// k-way merged like a flush.
+std::shared_ptr<const Segment> IndexEngine::merge_segments(
+    const std::vector<std::shared_ptr<const Segment>> &sources,
+    const std::vector<std::shared_ptr<const DeletedDocs>> &reclaimed,
+    const std::vector<std::shared_ptr<const Segment>> &others,
+    const SegmentSettings &settings)
+{
+    std::vector<FrozenIndex::SortedTerms> runs(sources.size());
+    std::vector<std::unordered_map<uint32_t, uint32_t>> run_lengths(sources.size());
+    workers.parallel_for(0, sources.size(), [&](size_t i)
+                         {
+        sources[i]->index.materialize(runs[i], run_lengths[i]);
+        if (reclaimed[i])
+            drop_deleted(sources[i]->index, *reclaimed[i], runs[i], run_lengths[i]); }, 1);
+
+    std::unordered_map<uint32_t, uint32_t> lengths = std::move(run_lengths[0]);
+    for (size_t i = 1; i < run_lengths.size(); i++)
+        lengths.insert(run_lengths[i].begin(), run_lengths[i].end());
+
+    FrozenIndex index = FrozenIndex::build_sorted(merge_runs(runs, workers, workers.size()),
+                                                  lengths, settings.layout);
+    return make_segment(std::move(index), others, settings);
+}
+
+void IndexEngine::merge_all_locked()
+{
+    std::vector<std::shared_ptr<const DeletedDocs>> reclaimed;
+    for (const auto &segment : segments)
+        reclaimed.push_back(deleted_locked(*segment));
+    if (!segments.empty())
+        segments = {merge_segments(segments, reclaimed, {}, settings_locked())};
+    if (!segments.empty() && segments[0]->index.doc_count() == 0)
+        segments.clear();
+    deletes.clear();
+    relayout = false;
+    publish_locked();
+}
+
+void IndexEngine::rebuild_impacts_locked()
+{
+    SegmentSettings settings = settings_locked();
+    for (size_t i = 0; i < segments.size(); i++)
+        rebuild_impacts_locked(i, settings);
+}
+
+void IndexEngine::rebuild_impacts_locked(size_t i, const SegmentSettings &settings)
+{
+    std::vector<std::shared_ptr<const Segment>> others = segments;
+    others.erase(others.begin() + i);
+    auto deleted = deleted_locked(*segments[i]);
+    deletes.erase(segments[i]->id);
+    segments[i] = make_segment(segments[i]->index, others, settings);
+    if (deleted)
+        deletes[segments[i]->id] = std::move(deleted);
+}
+
+// Flushes and merges change the statistics the older segments' impacts
+// were built with. Rebuilding only past IMPACT_DRIFT keeps that from
+// happening on every refresh: a segment is rebuilt each time the
+// collection grows by a constant factor, so the total work stays
+// proportional to the index size times a logarithm. Segments in a running
+// merge are left alone; the merged segment gets fresh impacts anyway.
+void IndexEngine::refresh_impacts_locked()
+{
+    if (!quantized)
+        return;
+    uint64_t docs = 0, length = 0;
+    for (const auto &segment : segments)
+    {
+        docs += segment->index.doc_count();
+        length += segment->index.total_doc_length();
+    }
+    auto drifted = [](double now, double built)
+    { return std::abs(now - built) > IMPACT_DRIFT * built; };
+
+    SegmentSettings settings = settings_locked();
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+        const Segment &segment = *segments[i];
+        if (segment.impacts.empty() || merging.count(segment.id) || segment.impact_docs == 0)
+            continue;
+        double avgdl = static_cast<double>(length) / docs;
+        double built_avgdl = static_cast<double>(segment.impact_length) / segment.impact_docs;
+        if (drifted(docs, segment.impact_docs) || drifted(avgdl, built_avgdl))
+            rebuild_impacts_locked(i, settings);
+    }
+}
+
+IndexEngine::SegmentSettings IndexEngine::settings_locked() const
+{
+    SegmentSettings settings{{}, bm25, quantized};
+    if (rank_order)
+    {
+        auto ranks = std::atomic_load(&pagerank);
+        settings.layout.static_rank = [ranks](uint32_t doc_id)
+        { return ranks->get_rank(doc_id); };
+        settings.layout.first_tier = first_tier;
+    }
+    return settings;
+}
+
+void IndexEngine::schedule_merges_locked()
+{
+    while (true)
+    {
+        std::vector<size_t> doc_counts, deleted;
+        std::vector<bool> busy;
+        for (const auto &segment : segments)
+        {
+            auto tombstones = deleted_locked(*segment);
+            doc_counts.push_back(segment->index.doc_count());
+            deleted.push_back(tombstones ? tombstones->count : 0);
+            busy.push_back(merging.count(segment->id) > 0);
+        }
+        std::vector<size_t> picked = merge_policy.select(doc_counts, deleted, busy);
+        if (picked.empty())
+            return;
+
+        std::vector<std::shared_ptr<const Segment>> sources;
+        for (size_t i : picked)
+        {
+            sources.push_back(segments[i]);
+            merging.insert(segments[i]->id);
+        }
+        merge_pool.enqueue([this, sources]
+                           { run_merge(sources); });
+    }
+}
+
+// Runs on merge_pool. The merge itself happens outside index_mutex; only
+// swapping the result into the segment list takes the lock. The result is
+// dropped if a source has gone meanwhile (build(), load()) or the settings
+// it was built with have changed. Docs deleted from a source while it was
+// being merged are tombstoned again in the merged segment.
+void IndexEngine::run_merge(std::vector<std::shared_ptr<const Segment>> sources)
+{
+    SegmentSettings settings;
+    uint64_t version;
+    std::vector<std::shared_ptr<const DeletedDocs>> reclaimed;
+    std::vector<std::shared_ptr<const Segment>> others;
+    {
+        std::lock_guard<std::mutex> lock(index_mutex);
+        settings = settings_locked();
+        version = settings_version;
+        for (const auto &source : sources)
+            reclaimed.push_back(deleted_locked(*source));
+        for (const auto &segment : segments)
+        {
+            if (std::find(sources.begin(), sources.end(), segment) == sources.end())
+                others.push_back(segment);
+        }
+    }
+
+    auto merged = merge_segments(sources, reclaimed, others, settings);
+
     std::lock_guard<std::mutex> lock(index_mutex);
+    for (const auto &source : sources)
+        merging.erase(source->id);
+
+    std::vector<std::shared_ptr<const Segment>> next;
+    size_t found = 0;
+    for (const auto &segment : segments)
+    {
+        if (std::find(sources.begin(), sources.end(), segment) == sources.end())
+            next.push_back(segment);
+        else if (found++ == 0)
+            next.push_back(merged);
+    }
+    if (found != sources.size() || version != settings_version)
+        return;
 
-    for (const auto &[term, freq] : term_freq)
+    std::shared_ptr<DeletedDocs> carried;
+    const FrozenIndex &index = merged->index;
+    for (size_t i = 0; i < sources.size(); i++)
     {
-        inverted_index[term].push_back({doc_id, freq});
+        auto now = deleted_locked(*sources[i]);
+        deletes.erase(sources[i]->id);
+        if (!now || now == reclaimed[i])
+            continue;
+        for (uint32_t ordinal = 0; ordinal < sources[i]->index.doc_count(); ordinal++)
+        {
+            if (!now->contains(ordinal) || (reclaimed[i] && reclaimed[i]->contains(ordinal)))
+                continue;
+            long moved = index.find_doc(sources[i]->index.doc_id(ordinal));
+            if (!carried)
+                carried = std::make_shared<DeletedDocs>(index.doc_count());
+            carried->add(moved, index.doc_length(moved));
+        }
     }
 
-    doc_lengths[doc_id] = tokens.size();
-    total_doc_length += tokens.size();
-    document_count++;
+    if (index.doc_count() == 0 || (carried && carried->count == index.doc_count()))
+        next.erase(std::find(next.begin(), next.end(), merged));
+    else if (carried)
+        deletes[merged->id] = std::move(carried);
+
+    segments = std::move(next);
+    publish_locked();
+    schedule_merges_locked();
 }
 
-void IndexEngine::build()
+// Per-segment ranks are carried over while PageRank is unchanged, and
+// bounds too while collection statistics and scoring settings are.
+// Segments with stale quantized impacts are rebuilt first.
+void IndexEngine::publish_locked()
+{
+    refresh_impacts_locked();
+    auto previous = std::atomic_load(&snapshot);
+    auto ranks = std::atomic_load(&pagerank);
+    auto next = std::make_shared<IndexSnapshot>();
+    next->ranks_version = ranks_version;
+    next->settings_version = settings_version;
+    next->bm25 = bm25;
+    next->tier_guarantee = tier_guarantee;
+    for (const auto &segment : segments)
+    {
+        auto deleted = deleted_locked(*segment);
+        next->doc_count += segment->index.doc_count();
+        next->total_doc_length += segment->index.total_doc_length();
+        if (deleted)
+        {
+            next->doc_count -= deleted->count;
+            next->total_doc_length -= deleted->doc_length;
+            next->deleted_count += deleted->count;
+        }
+    }
+    bool same_ranks = previous->ranks_version == ranks_version;
+    bool same_scores = same_ranks && previous->settings_version == settings_version &&
+                       previous->doc_count == next->doc_count &&
+                       previous->total_doc_length == next->total_doc_length &&
+                       previous->deleted_count == next->deleted_count;
+
+    for (const auto &segment : segments)
+    {
+        IndexSnapshot::Part part{segment, nullptr, nullptr, deleted_locked(*segment)};
+        for (const auto &old : previous->parts)
+        {
+            if (old.segment != segment)
+                continue;
+            if (same_ranks)
+                part.ranks = old.ranks;
+            if (same_scores)
+                part.bounds = old.bounds;
+        }
+        if (!part.ranks)
+        {
+            const FrozenIndex &index = segment->index;
+            auto by_ordinal = std::make_shared<std::vector<double>>(index.doc_count());
+            for (uint32_t ordinal = 0; ordinal < by_ordinal->size(); ordinal++)
+                (*by_ordinal)[ordinal] = ranks->get_rank(index.doc_id(ordinal));
+            part.ranks = std::move(by_ordinal);
+        }
+        if (!part.bounds)
+            part.bounds = std::make_shared<ScoreBounds>();
+        next->parts.push_back(std::move(part));
+    }
+
+    unpublished = false;
+    uint64_t number = next->generation = ++generation;
+    std::atomic_store(&snapshot, std::shared_ptr<const IndexSnapshot>(std::move(next)));
+    published.store(number, std::memory_order_release);
+}
+
+void IndexEngine::refresh_loop()
 {
-    // For large-scale system, sorting and compression would go here.
+    std::unique_lock<std::mutex> lock(index_mutex);
+    while (!stopping)
+    {
+        refresh_wakeup.wait_for(lock, refresh_interval);
+        if (!stopping)
+            refresh_locked(true);
+    }
+}
+
+void IndexEngine::set_refresh_interval(std::chrono::milliseconds interval)
+{
+    {
+        std::lock_guard<std::mutex> lock(index_mutex);
+        stopping = true;
+    }
+    refresh_wakeup.notify_all();
+    if (refresher.joinable())
+        refresher.join();
+
+    std::lock_guard<std::mutex> lock(index_mutex);
+    stopping = false;
+    refresh_interval = interval;
+    background_refresh = interval.count() > 0;
+    if (background_refresh)
+        refresher = std::thread([this]
+                                { refresh_loop(); });
+}
+
+void IndexEngine::set_merge_policy(const TieredMergePolicy &policy)
+{
+    std::lock_guard<std::mutex> lock(index_mutex);
+    merge_policy = policy;
+    schedule_merges_locked();
+}
+
+void IndexEngine::set_intra_query_parallelism(size_t partitions, uint64_t min_postings)
+{
+    query_partitions = std::max<size_t>(1, partitions);
+    parallel_min_postings = min_postings;
+}
+
+void IndexEngine::wait_for_merges()
+{
+    merge_pool.wait();
 }
 
 void IndexEngine::save(const std::string &filepath)
 {
-    Serializer::save_index(filepath, inverted_index, doc_lengths,
-                           document_count, total_doc_length);
+    merge_pool.wait();
+    std::lock_guard<std::mutex> lock(index_mutex);
+    build_locked();
+    if (segments.empty())
+        FrozenIndex().write(filepath);
+    else
+        segments[0]->index.write(filepath);
 }
 
+// Frozen images are memory-mapped and served in place; files written by the
+// older Serializer format are decoded and re-frozen. Either way the loaded
+// index replaces everything, as one segment.
 void IndexEngine::load(const std::string &filepath)
 {
-    Serializer::load_index(filepath, inverted_index, doc_lengths,
-                           document_count, total_doc_length);
+    merge_pool.wait();
+    std::lock_guard<std::mutex> lock(index_mutex);
+    inverted_index = {};
+    doc_lengths = {};
+    pending_parts.clear();
+    deferred_deletes.clear();
+    pending = false;
+    segments.clear();
+    deletes.clear();
+    SegmentSettings settings = settings_locked();
+
+    if (FrozenIndex::is_frozen_file(filepath))
+    {
+        FrozenIndex index = FrozenIndex::open(filepath);
+        relayout = index.is_rank_ordered() != rank_order;
+        segments.push_back(make_segment(std::move(index), {}, settings));
+        publish_locked();
+        return;
+    }
+
+    std::unordered_map<std::string, std::vector<Posting>> index;
+    std::unordered_map<uint32_t, uint32_t> lengths;
+    size_t doc_count;
+    uint64_t total_length;
+    Serializer::load_index(filepath, index, lengths, doc_count, total_length);
+    relayout = false;
+    segments.push_back(make_segment(FrozenIndex::build(index, lengths, settings.layout), {},
+                                    settings));
+    publish_locked();
+}
+
+void IndexEngine::refresh_if_pending()
+{
+    if (pending && !background_refresh)
+    {
+        std::lock_guard<std::mutex> lock(index_mutex);
+        refresh_locked(true);
+    }
+}
+
+std::vector<std::pair<uint32_t, double>>
+IndexEngine::search(const std::string &query, int k, SearchMode mode)
+{
+    refresh_if_pending();
+    return run_search(*current_snapshot(), query, k, mode, nullptr, nullptr);
+}
+
+std::vector<std::pair<uint32_t, double>>
+IndexEngine::search(const std::string &query, int k, SearchMode mode, const CollectionStats &stats)
+{
+    refresh_if_pending();
+    return run_search(*current_snapshot(), query, k, mode, &stats, nullptr);
+}
+
+// Identical queries are evaluated once. The snapshot is held here rather
+// than taken per query, so every query sees the same generation and the
+// shared posting lists match all of them. Only exhaustive searches share:
+// they score every posting anyway, while the pruning modes decode just the
+// blocks they cannot skip, which costs less than decoding whole lists.
+std::vector<std::vector<std::pair<uint32_t, double>>>
+IndexEngine::search_batch(const std::vector<std::string> &queries, int k, SearchMode mode,
+                          const CollectionStats *stats)
+{
+    refresh_if_pending();
+    std::shared_ptr<const IndexSnapshot> snap = get_snapshot();
+
+    BatchTerms batch;
+    batch.generation = snap->generation;
+    batch.stats = stats ? stats->version : 0;
+    std::unordered_map<std::string, size_t> first;
+    std::vector<size_t> unique;
+    std::unordered_map<std::string, size_t> query_counts;
+    Tokenizer tokenizer;
+    for (size_t q = 0; q < queries.size(); q++)
+    {
+        if (!first.emplace(queries[q], q).second)
+            continue;
+        unique.push_back(q);
+        if (mode != SearchMode::Exhaustive)
+            continue;
+        std::unordered_set<std::string_view> words;
+        for (std::string_view word : tokenizer.tokenize(queries[q]))
+            if (words.insert(word).second && ++query_counts[std::string(word)] == 2)
+                batch.shared.emplace(word);
+    }
+
+    std::vector<SearchResult> results(queries.size());
+    workers.parallel_for(0, unique.size(), [&](size_t u)
+                         {
+        size_t q = unique[u];
+        results[q] = run_search(*snap, queries[q], k, mode, stats, &batch); }, 1);
+    for (size_t q = 0; q < queries.size(); q++)
+    {
+        size_t source = first[queries[q]];
+        if (source != q)
+            results[q] = results[source];
+    }
+    return results;
 }
 
-const std::unordered_map<std::string, std::vector<Posting>> &
+std::vector<std::pair<uint32_t, double>>
+IndexEngine::run_search(const IndexSnapshot &snap, const std::string &query, int k,
+                        SearchMode mode, const CollectionStats *stats, BatchTerms *batch)
+{
+    const auto &parts = snap.parts;
+
+    // Query terms are resolved in every segment and their document
+    // frequencies summed, so idf is the same wherever a doc lives. Terms
+    // no segment has are dropped; sorting makes the cache key independent
+    // of case and word order, and scoring sums terms in that same order.
+    // Foreign statistics replace the summed df and the collection totals.
+    thread_local Tokenizer tokenizer;
+    const auto &tokens = tokenizer.tokenize(query);
+    std::vector<std::string_view> words(tokens.begin(), tokens.end());
+    std::sort(words.begin(), words.end());
+
+    std::vector<std::string_view> query_terms;
+    std::vector<double> weights;
+    uint64_t postings = 0;
+    // Term ordinal of query term i in part p at i * parts.size() + p.
+    std::vector<long> ordinals;
+    for (std::string_view word : words)
+    {
+        uint64_t df = 0;
+        size_t first = ordinals.size();
+        for (const auto &part : parts)
+        {
+            long t = part.segment->index.find_term(word);
+            ordinals.push_back(t);
+            if (t >= 0)
+                df += part.segment->index.term_info(t).df;
+        }
+        if (df == 0)
+        {
+            ordinals.resize(first);
+            continue;
+        }
+        postings += df;
+        query_terms.push_back(word);
+        if (stats)
+        {
+            auto global = stats->doc_freqs.find(std::string(word));
+            if (global != stats->doc_freqs.end())
+                df = global->second;
+            weights.push_back(Scorer::term_weight(snap.bm25, df, stats->doc_count));
+        }
+        else
+        {
+            weights.push_back(Scorer::term_weight(snap.bm25, df,
+                                                  snap.doc_count + snap.deleted_count));
+        }
+    }
+
+    uint64_t epoch = snap.generation;
+    uint64_t stats_version = stats ? stats->version : 0;
+    std::string cache_key;
+    SearchResult result;
+    if (cache_enabled)
+    {
+        cache_key.push_back(static_cast<char>(mode));
+        cache_key.append(reinterpret_cast<const char *>(&k), sizeof(k));
+        cache_key.append(reinterpret_cast<const char *>(&epoch), sizeof(epoch));
+        cache_key.push_back(stats ? 1 : 0);
+        cache_key.append(reinterpret_cast<const char *>(&stats_version), sizeof(stats_version));
+        for (std::string_view term : query_terms)
+        {
+            cache_key.append(term);
+            cache_key.push_back('\0');
+        }
+        if (cache.get(cache_key, result))
+            return result;
+    }
+
+    double avgdl = snap.avg_doc_length();
+    if (stats)
+        avgdl = stats->live_doc_count == 0
+                    ? 0
+                    : static_cast<double>(stats->total_doc_length) / stats->live_doc_count;
+    double k1 = snap.bm25.get_k1(), b = snap.bm25.get_b();
+    double norm_base = k1 * (1 - b);
+    double norm_scale = avgdl > 0 ? k1 * b / avgdl : 0;
+    size_t top_k = k > 0 ? k : 0;
+
+    // Larger segments first, so their k-th score prunes the smaller ones.
+    std::vector<size_t> order(parts.size());
+    for (size_t p = 0; p < order.size(); p++)
+        order[p] = p;
+    std::sort(order.begin(), order.end(),
+              [&](size_t a, size_t b)
+              { return parts[a].segment->index.doc_count() > parts[b].segment->index.doc_count(); });
+
+    // Scorer and terms of every part holding a query term, set up once;
+    // cursors are opened for each evaluated range.
+    struct QueryTerm
+    {
+        uint32_t term;
+        double weight;
+        std::shared_ptr<const DecodedTerm> decoded;
+    };
+    struct PartQuery
+    {
+        const FrozenIndex *index;
+        const ScoreBounds *bounds;
+        Scorer scorer;
+        std::vector<QueryTerm> terms;
+
+        bool tiered() const { return index->tier_boundary() < index->doc_count(); }
+        void open(std::vector<PostingCursor> &cursors) const
+        {
+            cursors.clear();
+            cursors.reserve(terms.size());
+            for (const auto &t : terms)
+                cursors.emplace_back(*index, t.term, t.weight, bounds, t.decoded.get());
+        }
+    };
+    // Held until the search is done; another search may replace it.
+    std::shared_ptr<const ForeignBounds> foreign =
+        stats ? foreign_bounds(snap, stats_version) : nullptr;
+    std::vector<PartQuery> plan;
+    for (size_t p : order)
+    {
+        const auto &part = parts[p];
+        const FrozenIndex &index = part.segment->index;
+        const QuantizedImpacts *impacts =
+            part.segment->impacts.empty() || stats ? nullptr : &part.segment->impacts;
+        ScoreBounds *bounds = foreign ? foreign->parts[p].get() : part.bounds.get();
+        PartQuery q{&index, bounds,
+                    Scorer{&index, part.ranks->data(), impacts, norm_base, norm_scale,
+                           part.deleted ? part.deleted->bits.data() : nullptr},
+                    {}};
+        for (size_t i = 0; i < query_terms.size(); i++)
+        {
+            long t = ordinals[i * parts.size() + p];
+            if (t < 0)
+                continue;
+            if (mode != SearchMode::Exhaustive || q.tiered())
+                bounds->ensure(index, q.scorer, t, weights[i]);
+            std::shared_ptr<const DecodedTerm> decoded;
+            if (cache_enabled)
+                decoded = decoded_term(part, t, weights[i], epoch, stats_version, q.scorer);
+            if (!decoded && batch)
+                decoded = batch_term(*batch, part, query_terms[i], t, weights[i], q.scorer);
+            q.terms.push_back({static_cast<uint32_t>(t), weights[i], std::move(decoded)});
+        }
+        if (!q.terms.empty())
+            plan.push_back(std::move(q));
+    }
+
+    TopKHeap merged(top_k);
+    std::vector<PostingCursor> cursors;
+    size_t partitions = query_partitions;
+    if (partitions > 1 && workers.size() > 1 && postings >= parallel_min_postings)
+    {
+        // Ranges of about 1/partitions of the docs, each scored by its own
+        // task into its own heap; all heaps prune against one shared
+        // threshold and are merged here once every task is done. First
+        // tiers run before any tail, and a part's tail is only queued if
+        // it can still reach the top k found in all first tiers.
+        uint64_t docs = 0;
+        for (const auto &q : plan)
+            docs += q.index->doc_count();
+        uint64_t span = std::max<uint64_t>(MIN_QUERY_RANGE, (docs + partitions - 1) / partitions);
+
+        struct Range
+        {
+            const PartQuery *query;
+            uint32_t lo, hi;
+        };
+        auto split = [&](const PartQuery &q, uint32_t lo, uint32_t hi, std::vector<Range> &out)
+        {
+            uint64_t pieces = (hi - lo + span - 1) / span;
+            for (uint64_t i = 0; i < pieces; i++)
+                out.push_back({&q, static_cast<uint32_t>(lo + (hi - lo) * i / pieces),
+                               static_cast<uint32_t>(lo + (hi - lo) * (i + 1) / pieces)});
+        };
+        auto run = [&](const std::vector<Range> &ranges)
+        {
+            SharedThreshold shared;
+            shared.raise(merged.threshold());
+            std::vector<std::vector<std::pair<uint32_t, double>>> found(ranges.size());
+            workers.parallel_for(0, ranges.size(), [&](size_t r)
+                                 {
+                const Range &range = ranges[r];
+                std::vector<PostingCursor> range_cursors;
+                range.query->open(range_cursors);
+                if (range.lo > 0)
+                    for (auto &c : range_cursors)
+                        c.advance(range.lo);
+                TopKHeap top(top_k);
+                top.set_index(range.query->index);
+                top.share(&shared);
+                evaluate(mode, range_cursors, range.query->scorer, top, range.hi);
+                found[r] = top.take_sorted(); }, 1);
+
+            for (size_t r = 0; r < ranges.size(); r++)
+                for (const auto &[ordinal, score] : found[r])
+                    merged.push(ranges[r].query->index->doc_id(ordinal), score);
+        };
+
+        std::vector<Range> heads, tails;
+        for (const auto &q : plan)
+            split(q, 0, q.tiered() ? q.index->tier_boundary() : q.index->doc_count(), heads);
+        run(heads);
+        for (const auto &q : plan)
+        {
+            if (!q.tiered())
+                continue;
+            q.open(cursors);
+            if (tail_can_enter(cursors, merged, snap.tier_guarantee))
+                split(q, q.index->tier_boundary(), q.index->doc_count(), tails);
+        }
+        if (!tails.empty())
+            run(tails);
+    }
+    else
+    {
+        for (const auto &q : plan)
+        {
+            q.open(cursors);
+            TopKHeap top(top_k);
+            top.set_index(q.index);
+            top.set_floor(merged.threshold());
+            if (q.tiered())
+                evaluate(mode, cursors, q.scorer, top, q.index->tier_boundary());
+            if (!q.tiered() || tail_can_enter(cursors, top, snap.tier_guarantee))
+                evaluate(mode, cursors, q.scorer, top, PostingCursor::END);
+
+            for (const auto &[ordinal, score] : top.take_sorted())
+                merged.push(q.index->doc_id(ordinal), score);
+        }
+    }
+    result = merged.take_sorted();
+
+    if (cache_enabled)
+        cache.put(cache_key, result);
+    return result;
+}
+
+// Concurrent searches against the same foreign statistics share one set;
+// two searches racing to replace it both build one and the last store wins,
+// which is only wasted work.
+std::shared_ptr<const IndexEngine::ForeignBounds>
+IndexEngine::foreign_bounds(const IndexSnapshot &snap, uint64_t version)
+{
+    auto latest = std::atomic_load(&latest_foreign_bounds);
+    if (latest && latest->generation == snap.generation && latest->version == version)
+        return latest;
+
+    auto next = std::make_shared<ForeignBounds>();
+    next->generation = snap.generation;
+    next->version = version;
+    for (size_t p = 0; p < snap.parts.size(); p++)
+        next->parts.push_back(std::make_shared<ScoreBounds>());
+    latest = std::move(next);
+    std::atomic_store(&latest_foreign_bounds, latest);
+    return latest;
+}
+
+CollectionStats IndexEngine::collection_stats(const std::vector<std::string> &terms) const
+{
+    auto held = current_snapshot();
+    const IndexSnapshot &snap = *held;
+    CollectionStats stats;
+    stats.version = snap.generation;
+    stats.doc_count = snap.doc_count + snap.deleted_count;
+    stats.live_doc_count = snap.doc_count;
+    stats.total_doc_length = snap.total_doc_length;
+    for (const std::string &term : terms)
+    {
+        uint64_t df = 0;
+        for (const auto &part : snap.parts)
+        {
+            long t = part.segment->index.find_term(term);
+            if (t >= 0)
+                df += part.segment->index.term_info(t).df;
+        }
+        stats.doc_freqs[term] = df;
+    }
+    return stats;
+}
+
+// Hot terms are decoded and scored once per generation. A term is only
+// materialized once the term cache's frequency sketch has seen it before,
+// so one-off terms never pay for a full decode.
+std::shared_ptr<const DecodedTerm>
+IndexEngine::decoded_term(const IndexSnapshot::Part &part, uint32_t term, double weight,
+                          uint64_t epoch, uint64_t stats, const Scorer &scorer)
+{
+    TermKey key{epoch, stats, part.segment->id, term};
+    std::shared_ptr<const DecodedTerm> decoded;
+    if (term_cache.get(key, decoded))
+        return decoded;
+    const FrozenIndex &index = part.segment->index;
+    if (index.term_info(term).df > TERM_CACHE_MAX_DF || term_cache.frequency(key) < 2)
+        return nullptr;
+
+    decoded = std::make_shared<const DecodedTerm>(DecodedTerm::build(index, scorer, term, weight));
+    term_cache.put(key, decoded);
+    return decoded;
+}
+
+// Under the term cache's df limit: a long list is better decoded block by
+// block, letting each query skip the blocks it cannot score in.
+std::shared_ptr<const DecodedTerm>
+IndexEngine::batch_term(BatchTerms &batch, const IndexSnapshot::Part &part, std::string_view word,
+                        uint32_t term, double weight, const Scorer &scorer)
+{
+    const FrozenIndex &index = part.segment->index;
+    if (index.term_info(term).df > TERM_CACHE_MAX_DF ||
+        batch.shared.find(std::string(word)) == batch.shared.end())
+        return nullptr;
+
+    std::shared_ptr<BatchTerms::Entry> entry;
+    {
+        std::lock_guard<std::mutex> lock(batch.mutex);
+        auto &slot = batch.entries[TermKey{batch.generation, batch.stats, part.segment->id, term}];
+        if (!slot)
+            slot = std::make_shared<BatchTerms::Entry>();
+        entry = slot;
+    }
+    std::call_once(entry->once, [&]
+                   { entry->decoded = std::make_shared<const DecodedTerm>(
+                         DecodedTerm::build(index, scorer, term, weight)); });
+    return entry->decoded;
+}
+
+void IndexEngine::set_pagerank(const PageRank &ranks)
+{
+    set_pagerank(ranks.snapshot());
+}
+
+void IndexEngine::set_pagerank(std::shared_ptr<const PageRank::Snapshot> ranks)
+{
+    std::lock_guard<std::mutex> lock(index_mutex);
+    std::atomic_store(&pagerank, std::move(ranks));
+    ranks_version++;
+    relayout = relayout || rank_order;
+    publish_locked();
+}
+
+void IndexEngine::set_static_rank_order(bool enabled, double tier)
+{
+    std::lock_guard<std::mutex> lock(index_mutex);
+    relayout = relayout || enabled != rank_order || (enabled && tier != first_tier);
+    rank_order = enabled;
+    first_tier = tier;
+}
+
+void IndexEngine::set_tier_guarantee(double guarantee)
+{
+    std::lock_guard<std::mutex> lock(index_mutex);
+    tier_guarantee = guarantee;
+    publish_locked();
+}
+
+void IndexEngine::set_bm25(const BM25 &params)
+{
+    std::lock_guard<std::mutex> lock(index_mutex);
+    bm25 = params;
+    settings_version++;
+    if (quantized)
+        rebuild_impacts_locked();
+    publish_locked();
+}
+
+void IndexEngine::set_quantized_impacts(bool enabled)
+{
+    std::lock_guard<std::mutex> lock(index_mutex);
+    quantized = enabled;
+    settings_version++;
+    rebuild_impacts_locked();
+    publish_locked();
+}
+
+// Payload plus a rough allowance for the node, map slot and shared_ptr.
+size_t IndexEngine::cache_weight(const std::string &key, const SearchResult &result)
+{
+    return key.size() + result.size() * sizeof(result[0]) + 128;
+}
+
+size_t IndexEngine::term_cache_weight(const TermKey &, const std::shared_ptr<const DecodedTerm> &term)
+{
+    return term->memory_usage() + 128;
+}
+
+void IndexEngine::set_cache_enabled(bool enabled)
+{
+    cache_enabled = enabled;
+}
+
+const std::unordered_map<uint32_t, std::vector<Posting>> &
 IndexEngine::get_index() const
 {
     return inverted_index;
 }
 
+TermDictionary &IndexEngine::get_term_dictionary()
+{
+    return terms;
+}
+
+std::shared_ptr<const IndexSnapshot> IndexEngine::get_snapshot() const
+{
+    return std::atomic_load(&snapshot);
+}
+
+// RCU-style read side: each thread remembers the last snapshot it loaded
+// and reuses it while no newer generation has been published, so
+// steady-state readers skip the library lock behind std::atomic_load. The
+// remembered pointer is weak: a destroyed engine's segments are not kept
+// alive by threads that searched it, and callers hold the returned pointer,
+// so reading another engine in between cannot pull the snapshot away.
+std::shared_ptr<const IndexSnapshot> IndexEngine::current_snapshot() const
+{
+    struct Cached
+    {
+        uint64_t engine = 0;
+        uint64_t generation = 0;
+        std::weak_ptr<const IndexSnapshot> snapshot;
+    };
+    thread_local Cached cached;
+
+    uint64_t latest = published.load(std::memory_order_acquire);
+    if (cached.engine == instance && cached.generation >= latest)
+    {
+        if (auto snap = cached.snapshot.lock())
+            return snap;
+    }
+    auto snap = std::atomic_load(&snapshot);
+    cached.engine = instance;
+    cached.generation = snap->generation;
+    cached.snapshot = snap;
+    return snap;
+}
+
+bool IndexEngine::has_document(uint32_t doc_id) const
+{
+    auto snap = current_snapshot();
+    for (const auto &part : snap->parts)
+        if (part.live(part.segment->index.find_doc(doc_id)))
+            return true;
+    return false;
+}
+
 uint32_t IndexEngine::get_doc_length(uint32_t doc_id) const
 {
-    return doc_lengths.at(doc_id);
+    auto snap = current_snapshot();
+    for (const auto &part : snap->parts)
+    {
+        long ordinal = part.segment->index.find_doc(doc_id);
+        if (part.live(ordinal))
+            return part.segment->index.doc_length(ordinal);
+    }
+    throw std::out_of_range("unknown doc id");
 }
 
 double IndexEngine::get_avg_doc_length() const
 {
-    return document_count == 0 ? 0 : static_cast<double>(total_doc_length) / document_count;
+    return current_snapshot()->avg_doc_length();
 }
 
 size_t IndexEngine::total_docs() const
 {
-    return document_count;
+    return current_snapshot()->doc_count;
 }
@@ -2,34 +2,369 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
 #include <mutex>
+#include <set>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include "bm25.h"
+#include "frozen_index.h"
+#include "concurrent_cache.h"
+#include "pagerank.h"
+#include "posting.h"
+#include "query_evaluator.h"
+#include "segment.h"
+#include "term_dictionary.h"
+#include "thread_pool.h"
 
-struct Posting
+enum class SearchMode
 {
-    uint32_t doc_id;
-    uint32_t term_freq;
+    Exhaustive,
+    Wand,
+    BlockMaxWand
 };
 
+// Postings and lengths for a batch of documents, built without holding the
+// engine's lock (by a bulk-indexing or WAL replay worker) and handed over
+// with IndexEngine::merge().
+// Postings are keyed by the engine's TermDictionary ids.
+struct SubIndex
+{
+    std::unordered_map<uint32_t, std::vector<Posting>> postings;
+    std::unordered_map<uint32_t, uint32_t> doc_lengths;
+    uint64_t total_doc_length = 0;
+    // Docs deleted or replaced while this sub-index was buffered. They are
+    // gone from doc_lengths; their postings are skipped when it is flushed.
+    std::unordered_set<uint32_t> dropped;
+
+    // Sorts `term_ids` in place to count term frequencies. Doc ids must be
+    // unique within one sub-index.
+    void add_document(uint32_t doc_id, std::vector<uint32_t> &term_ids);
+};
+
+// Statistics of a collection spread over several engines (the shards of a
+// distributed index), summed from each shard's collection_stats(). When
+// every shard scores against the same statistics, a document's score does
+// not depend on the shard it landed on, and per-shard top k lists merge
+// exactly.
+struct CollectionStats
+{
+    // Identifies these statistics: two sets given to one engine must not
+    // share a version. An engine's own statistics carry its generation.
+    uint64_t version = 0;
+    // N for idf, which counts deleted docs still present in some df.
+    uint64_t doc_count = 0;
+    uint64_t live_doc_count = 0;
+    uint64_t total_doc_length = 0;
+    std::unordered_map<std::string, uint64_t> doc_freqs;
+};
+
+// Documents are buffered by add_document() and become searchable when the
+// buffer is flushed into a new immutable Segment. add_documents() tokenizes
+// a batch on a thread pool into one SubIndex per worker; merge() only
+// queues sub-indexes, and a flush k-way merges them in parallel.
+//
+// Readers never lock: they load the current IndexSnapshot and score every
+// segment against collection-wide statistics, so results do not depend on
+// how documents are spread over segments, and statistics are never torn by
+// a concurrent flush. By default search() flushes pending documents itself,
+// which takes the writer's lock; with a refresh interval a background
+// thread flushes instead and queries never wait for indexing. After each flush a
+// TieredMergePolicy picks segments to merge on a background thread.
+// build() flushes and merges everything into one segment.
+//
+// Adding a doc id the engine already holds replaces that document. Deletes
+// tombstone the old version in its segment's DeletedDocs; like additions
+// they become visible with the next refresh, and merges drop the deleted
+// postings for good.
+//
+// With static-rank order enabled, segments number documents by descending
+// PageRank and split off the highest-ranked ones as a first tier. search()
+// evaluates that tier first and reads the tail only when a tail document
+// could still reach the top k (up to the configured tier guarantee).
+//
+// Expensive queries can be split into doc ranges scored in parallel on
+// the worker pool; see set_intra_query_parallelism().
 class IndexEngine
 {
 public:
+    static constexpr size_t QUERY_CACHE_BYTES = 32 << 20;
+    static constexpr size_t TERM_CACHE_BYTES = 64 << 20;
+    static constexpr uint32_t TERM_CACHE_MAX_DF = 1 << 16;
+    // Quantized impacts of a segment are rebuilt once the collection's doc
+    // count or average doc length is this far (relative) from the values
+    // they were built with.
+    static constexpr double IMPACT_DRIFT = 0.1;
+    // Smallest doc range worth a task of its own in a parallel query.
+    static constexpr uint32_t MIN_QUERY_RANGE = 1 << 12;
+
     IndexEngine();
+    ~IndexEngine();
 
     void add_document(uint32_t doc_id, const std::string &content);
+    // A doc id listed more than once keeps its last version.
+    void add_documents(const std::vector<std::pair<uint32_t, std::string>> &docs,
+                       size_t threads = std::thread::hardware_concurrency());
+    void merge(SubIndex &&sub);
+    // Returns false if the engine does not hold `doc_id`.
+    bool delete_document(uint32_t doc_id);
+    // Makes buffered documents searchable as a new segment.
+    void refresh();
     void build();
     void save(const std::string &filepath);
     void load(const std::string &filepath);
 
-    const std::unordered_map<std::string, std::vector<Posting>> &get_index() const;
+    std::vector<std::pair<uint32_t, double>> search(
+        const std::string &query, int k,
+        SearchMode mode = SearchMode::Exhaustive);
+    // Scores against `stats` instead of this engine's own statistics. A
+    // query term missing from stats.doc_freqs keeps its local df.
+    // Quantized impacts are built for the local statistics, so these
+    // searches score exactly instead.
+    std::vector<std::pair<uint32_t, double>> search(
+        const std::string &query, int k, SearchMode mode, const CollectionStats &stats);
+    // Evaluates the queries together on the worker pool against one
+    // snapshot, returning their results in order. In Exhaustive mode the
+    // posting lists of terms several queries share are decoded once for
+    // all of them.
+    // `stats`, if given, applies to every query as in search().
+    std::vector<std::vector<std::pair<uint32_t, double>>> search_batch(
+        const std::vector<std::string> &queries, int k,
+        SearchMode mode = SearchMode::Exhaustive, const CollectionStats *stats = nullptr);
+    void set_pagerank(const PageRank &ranks);
+    // Swaps in new ranks; searches already running keep the old snapshot.
+    void set_pagerank(std::shared_ptr<const PageRank::Snapshot> ranks);
+    void set_cache_enabled(bool enabled);
+    // Applies to segments created afterwards; build() rewrites them all.
+    // Later set_pagerank() calls are likewise applied to the order then.
+    void set_static_rank_order(bool enabled, double first_tier = 0.1);
+    // 1 (the default) keeps tiered results exact; see tail_can_enter().
+    void set_tier_guarantee(double guarantee);
+    void set_bm25(const BM25 &params);
+    // Scores BM25 from 8-bit per-posting impacts; see QuantizedImpacts.
+    void set_quantized_impacts(bool enabled);
+    // Zero (the default) makes search() flush pending documents itself.
+    void set_refresh_interval(std::chrono::milliseconds interval);
+    void set_merge_policy(const TieredMergePolicy &policy);
+    // Queries whose posting lists hold at least `min_postings` entries in
+    // total are split into up to `partitions` doc ranges scored in parallel,
+    // pruning against one shared top-k threshold. Cheaper queries stay on
+    // the calling thread, keeping throughput at high QPS; so do ranges the
+    // busy pool does not pick up. 0 or 1 (the default) disables it.
+    void set_intra_query_parallelism(size_t partitions, uint64_t min_postings = 1 << 16);
+    // Blocks until no background merge is running.
+    void wait_for_merges();
+
+    // Documents added by add_document() since the last flush, keyed by
+    // term id. Only safe to read while no other thread adds documents.
+    const std::unordered_map<uint32_t, std::vector<Posting>> &get_index() const;
+    TermDictionary &get_term_dictionary();
+    std::shared_ptr<const IndexSnapshot> get_snapshot() const;
+    // Like search(), these see the published snapshot: documents still in
+    // the write buffer are not counted until the next refresh.
+    bool has_document(uint32_t doc_id) const;
     uint32_t get_doc_length(uint32_t doc_id) const;
     double get_avg_doc_length() const;
     size_t total_docs() const;
+    // This engine's share of the collection statistics, with the df of
+    // each of `terms` (tokenized like queries).
+    CollectionStats collection_stats(const std::vector<std::string> &terms) const;
 
 private:
-    std::unordered_map<std::string, std::vector<Posting>> inverted_index;
+    std::shared_ptr<const IndexSnapshot> current_snapshot() const;
+    void refresh_if_pending();
+    struct BatchTerms;
+    std::vector<std::pair<uint32_t, double>> run_search(
+        const IndexSnapshot &snap, const std::string &query, int k, SearchMode mode,
+        const CollectionStats *stats, BatchTerms *batch);
+    struct ForeignBounds;
+    std::shared_ptr<const ForeignBounds> foreign_bounds(const IndexSnapshot &snap,
+                                                        uint64_t version);
+    bool has_pending_locked() const;
+    void seal_buffer_locked();
+    size_t drop_buffered_locked(uint32_t doc_id);
+    void build_locked();
+    void flush_locked();
+    void refresh_locked(bool schedule_merges);
+    size_t delete_locked(const uint32_t *doc_ids, size_t count);
+    void apply_deletes_locked();
+    std::shared_ptr<const DeletedDocs> deleted_locked(const Segment &segment) const;
+    // What new segments are built with; copied under index_mutex so a
+    // background merge sees one consistent set.
+    struct SegmentSettings
+    {
+        FrozenIndex::Layout layout;
+        BM25 bm25;
+        bool quantized;
+    };
+    SegmentSettings settings_locked() const;
+    std::shared_ptr<const Segment> make_segment(
+        FrozenIndex index, const std::vector<std::shared_ptr<const Segment>> &others,
+        const SegmentSettings &settings);
+    // Postings of the `reclaimed` docs (parallel to `sources`, may be
+    // null) are left out of the merged segment.
+    std::shared_ptr<const Segment> merge_segments(
+        const std::vector<std::shared_ptr<const Segment>> &sources,
+        const std::vector<std::shared_ptr<const DeletedDocs>> &reclaimed,
+        const std::vector<std::shared_ptr<const Segment>> &others,
+        const SegmentSettings &settings);
+    void merge_all_locked();
+    void rebuild_impacts_locked();
+    void rebuild_impacts_locked(size_t segment, const SegmentSettings &settings);
+    void refresh_impacts_locked();
+    void schedule_merges_locked();
+    void run_merge(std::vector<std::shared_ptr<const Segment>> sources);
+    void publish_locked();
+    void refresh_loop();
+    std::shared_ptr<const DecodedTerm> decoded_term(const IndexSnapshot::Part &part,
+                                                    uint32_t term, double weight,
+                                                    uint64_t epoch, uint64_t stats,
+                                                    const Scorer &scorer);
+    std::shared_ptr<const DecodedTerm> batch_term(BatchTerms &batch,
+                                                  const IndexSnapshot::Part &part,
+                                                  std::string_view word, uint32_t term,
+                                                  double weight, const Scorer &scorer);
+
+    // Term ids are never reused, so the dictionary only grows; sub-indexes
+    // built concurrently with a flush may still refer to any id.
+    TermDictionary terms;
+    std::unordered_map<uint32_t, std::vector<Posting>> inverted_index;
     std::unordered_map<uint32_t, uint32_t> doc_lengths;
-    size_t document_count;
-    uint64_t total_doc_length;
+    std::vector<SubIndex> pending_parts;
+    // Doc ids deleted or replaced since the last flush, whose versions in
+    // segments the flush tombstones.
+    std::unordered_set<uint32_t> deferred_deletes;
+    // Set when the buffer gains documents or there are deletes to publish,
+    // so search() can skip the lock.
+    std::atomic<bool> pending{false};
+    // Segments or deletes not yet in the published snapshot.
+    bool unpublished = false;
 
     std::mutex index_mutex;
+
+    // The writer's segment list, under index_mutex; searches read the
+    // published snapshot instead. Segments in `merging` belong to a running
+    // background merge.
+    std::vector<std::shared_ptr<const Segment>> segments;
+    // Keyed by segment id; segments without deletions have no entry.
+    std::unordered_map<uint64_t, std::shared_ptr<const DeletedDocs>> deletes;
+    std::set<uint64_t> merging;
+    std::atomic<uint64_t> next_segment_id{0};
+    TieredMergePolicy merge_policy;
+    // Read and replaced with std::atomic_load/atomic_store, which take a
+    // lock inside the standard library; readers go through
+    // current_snapshot() and only reload it when `published` moves on.
+    std::shared_ptr<const IndexSnapshot> snapshot = std::make_shared<const IndexSnapshot>();
+    // Bumped with every published snapshot.
+    std::atomic<uint64_t> generation{0};
+    // Generation of `snapshot`, stored after it.
+    std::atomic<uint64_t> published{0};
+    // Distinguishes engines in current_snapshot()'s per-thread cache.
+    const uint64_t instance;
+    std::atomic<bool> cache_enabled{true};
+    std::atomic<size_t> query_partitions{1};
+    std::atomic<uint64_t> parallel_min_postings{1 << 16};
+
+    bool rank_order = false;
+    double first_tier = 0.1;
+    double tier_guarantee = 1.0;
+    // Segments may not match the rank order settings until build().
+    bool relayout = false;
+    // Bumped when settings baked into segments change; a background merge
+    // started before that is discarded.
+    uint64_t settings_version = 0;
+
+    BM25 bm25;
+    bool quantized = false;
+    // Read and replaced with std::atomic_load/atomic_store.
+    std::shared_ptr<const PageRank::Snapshot> pagerank =
+        std::make_shared<const PageRank::Snapshot>();
+    // Bumped by set_pagerank() so publish_locked() knows which per-segment
+    // rank arrays it can carry over.
+    uint64_t ranks_version = 0;
+
+    // Score bounds of one snapshot's parts for searches against one
+    // foreign CollectionStats version. Only the latest pair is kept: a
+    // coordinator only moves to new statistics when some shard changed.
+    struct ForeignBounds
+    {
+        uint64_t generation;
+        uint64_t version;
+        std::vector<std::shared_ptr<ScoreBounds>> parts;
+    };
+    // Read and replaced with std::atomic_load/atomic_store.
+    std::shared_ptr<const ForeignBounds> latest_foreign_bounds;
+
+    using SearchResult = std::vector<std::pair<uint32_t, double>>;
+    static size_t cache_weight(const std::string &key, const SearchResult &result);
+
+    // Decoded terms are keyed by generation, foreign statistics version (0
+    // for the engine's own), segment and term ordinal.
+    struct TermKey
+    {
+        uint64_t generation;
+        uint64_t stats;
+        uint64_t segment;
+        uint32_t term;
+
+        bool operator==(const TermKey &other) const
+        {
+            return generation == other.generation && stats == other.stats &&
+                   segment == other.segment && term == other.term;
+        }
+    };
+    struct TermKeyHash
+    {
+        size_t operator()(const TermKey &key) const
+        {
+            return std::hash<uint64_t>()(((key.generation * 0x9E3779B97F4A7C15ull ^ key.stats) *
+                                              0x9E3779B97F4A7C15ull ^
+                                          key.segment)
+                                             << 20 ^
+                                         key.term);
+        }
+    };
+    static size_t term_cache_weight(const TermKey &key,
+                                    const std::shared_ptr<const DecodedTerm> &term);
+
+    // Posting lists shared by the queries of one search_batch() call: the
+    // first query to reach one decodes it, the others wait for and reuse
+    // it. Keyed like the term cache, though generation and statistics are
+    // the same throughout a batch.
+    struct BatchTerms
+    {
+        struct Entry
+        {
+            std::once_flag once;
+            std::shared_ptr<const DecodedTerm> decoded;
+        };
+        // Tokens in more than one of the batch's queries.
+        std::unordered_set<std::string> shared;
+        uint64_t generation;
+        uint64_t stats;
+        std::mutex mutex;
+        std::unordered_map<TermKey, std::shared_ptr<Entry>, TermKeyHash> entries;
+    };
+
+    // Shared by concurrent search() calls without taking index_mutex.
+    // Results are keyed by mode, k, generation, foreign statistics version
+    // and the sorted query terms.
+    ConcurrentCache<std::string, SearchResult> cache{QUERY_CACHE_BYTES, cache_weight};
+    ConcurrentCache<TermKey, std::shared_ptr<const DecodedTerm>, TermKeyHash> term_cache{
+        TERM_CACHE_BYTES, term_cache_weight};
+
+    std::chrono::milliseconds refresh_interval{0};
+    std::atomic<bool> background_refresh{false};
+    std::condition_variable refresh_wakeup;
+    bool stopping = false;
+    std::thread refresher;
+    // Tokenizing, flush sorting and merging fan out over these workers.
+    ThreadPool workers{std::thread::hardware_concurrency()};
+    // Last member: destroyed first, so no merge outlives the state above.
+    ThreadPool merge_pool{1};
 };
@@ -3,20 +3,68 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
 
 void *MMapLoader::map_file(const std::string &path, size_t &size)
 {
     int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("open " + path + ": " + std::strerror(errno));
+
     struct stat sb;
-    fstat(fd, &sb);
+    if (fstat(fd, &sb) != 0)
+    {
+        int err = errno;
+        close(fd);
+        throw std::runtime_error("fstat " + path + ": " + std::strerror(err));
+    }
     size = sb.st_size;
+    if (size == 0)
+    {
+        close(fd);
+        return nullptr;
+    }
 
-    void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    void *addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    int err = errno;
     close(fd);
+    if (addr == MAP_FAILED)
+        throw std::runtime_error("mmap " + path + ": " + std::strerror(err));
     return addr;
 }
 
 void MMapLoader::unmap_file(void *addr, size_t size)
 {
-    munmap(addr, size);
+    if (addr)
+        munmap(addr, size);
+}
+
+void MMapLoader::advise(const void *addr, size_t size, Advice advice)
+{
+    if (!addr || size == 0)
+        return;
+
+    static const uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = reinterpret_cast<uintptr_t>(addr) & ~(page - 1);
+    uintptr_t end = reinterpret_cast<uintptr_t>(addr) + size;
+
+    int flag = MADV_NORMAL;
+    switch (advice)
+    {
+    case Advice::Sequential:
+        flag = MADV_SEQUENTIAL;
+        break;
+    case Advice::Random:
+        flag = MADV_RANDOM;
+        break;
+    case Advice::WillNeed:
+        flag = MADV_WILLNEED;
+        break;
+    default:
+        break;
+    }
+    // Advisory only; failure leaves the kernel's default readahead.
+    madvise(reinterpret_cast<void *>(begin), end - begin, flag);
 }
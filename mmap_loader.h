@@ -1,10 +1,24 @@
 #pragma once
 #include <string>
+#include <cstddef>
 #include <cstdint>
 
 class MMapLoader
 {
 public:
+    enum class Advice
+    {
+        Normal,
+        Sequential,
+        Random,
+        WillNeed
+    };
+
+    // Maps the whole file read-only and shared, so every process serving
+    // the same file reuses one copy in the page cache. Throws on failure.
     static void *map_file(const std::string &path, size_t &size);
     static void unmap_file(void *addr, size_t size);
+
+    // madvise over [addr, addr + size), widened to page boundaries.
+    static void advise(const void *addr, size_t size, Advice advice);
 };
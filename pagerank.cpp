@@ -1,44 +1,412 @@
 #include "pagerank.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <limits>
+
+double PageRank::Snapshot::get_rank(uint32_t doc_id) const
+{
+    if (!index)
+        return 0.0;
+    auto it = index->find(doc_id);
+    if (it == index->end())
+        return 0.0;
+    return ranks[it->second];
+}
 
 void PageRank::build_graph(
     const std::unordered_map<uint32_t,
                              std::vector<uint32_t>> &adjacency)
 {
-    graph = adjacency;
-    double init = 1.0 / graph.size();
+    // Dense ids follow doc-id order so neighbouring docs share cache lines.
+    std::vector<uint32_t> nodes;
+    for (const auto &[doc, links] : adjacency)
+    {
+        nodes.push_back(doc);
+        nodes.insert(nodes.end(), links.begin(), links.end());
+    }
+    std::sort(nodes.begin(), nodes.end());
+    nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
 
-    for (auto &[doc, _] : graph)
+    size_t n = nodes.size();
+    node_index = std::make_shared<std::unordered_map<uint32_t, uint32_t>>();
+    node_index->reserve(n);
+    for (uint32_t i = 0; i < n; i++)
+        node_index->emplace(nodes[i], i);
+
+    out_degree.assign(n, 0);
+    for (const auto &[doc, links] : adjacency)
+        out_degree[node_index->at(doc)] += links.size();
+
+    out_offsets.assign(n + 1, 0);
+    for (size_t u = 0; u < n; u++)
+        out_offsets[u + 1] = out_offsets[u] + out_degree[u];
+    out_links.resize(out_offsets[n]);
+    for (const auto &[doc, links] : adjacency)
     {
-        ranks[doc] = init;
+        uint32_t *out = out_links.data() + out_offsets[node_index->at(doc)];
+        for (uint32_t dest : links)
+            *out++ = node_index->at(dest);
     }
+    build_in_links();
+
+    changed_links.clear();
+    nodes_added = false;
+    ranks.assign(n, n ? 1.0 / n : 0.0);
+    residual_valid = false;
+}
+
+// Counting sort of the forward edges by target gives the transposed CSR.
+void PageRank::build_in_links()
+{
+    size_t n = out_degree.size();
+    in_offsets.assign(n + 1, 0);
+    for (uint32_t v : out_links)
+        in_offsets[v + 1]++;
+    for (size_t v = 0; v < n; v++)
+        in_offsets[v + 1] += in_offsets[v];
+
+    in_links.resize(in_offsets[n]);
+    std::vector<uint64_t> fill(in_offsets.begin(), in_offsets.end() - 1);
+    for (uint32_t u = 0; u < n; u++)
+        for (uint64_t e = out_offsets[u]; e < out_offsets[u + 1]; e++)
+            in_links[fill[out_links[e]]++] = u;
 }
 
-void PageRank::compute(int iterations, double d)
+// Folds the incremental overlay back into both CSR arrays.
+void PageRank::rebuild()
 {
-    size_t N = graph.size();
+    if (changed_links.empty() && !nodes_added)
+        return;
+
+    size_t n = out_degree.size();
+    std::vector<uint64_t> offsets(n + 1, 0);
+    for (uint32_t u = 0; u < n; u++)
+        offsets[u + 1] = offsets[u] + out_degree[u];
+    std::vector<uint32_t> links(offsets[n]);
+    for (uint32_t u = 0; u < n; u++)
+        std::copy(links_begin(u), links_end(u), links.begin() + offsets[u]);
+
+    out_offsets.swap(offsets);
+    out_links.swap(links);
+    changed_links.clear();
+    nodes_added = false;
+    build_in_links();
+}
+
+int PageRank::compute(int max_iterations, double d, double tolerance, size_t threads)
+{
+    rebuild();
+    damping = d;
+    residual_valid = false;
+
+    size_t n = ranks.size();
+    if (n == 0)
+        return 0;
 
-    for (int iter = 0; iter < iterations; iter++)
+    // Split nodes into ranges of roughly equal in-link count.
+    size_t parts = std::max<size_t>(1, std::min(threads, n));
+    std::vector<size_t> bounds{0};
+    for (size_t p = 1; p < parts; p++)
     {
-        std::unordered_map<uint32_t, double> new_ranks;
+        uint64_t target = in_offsets[n] * p / parts;
+        size_t v = std::lower_bound(in_offsets.begin(), in_offsets.end(), target) - in_offsets.begin();
+        bounds.push_back(std::max(bounds.back(), std::min(v, n)));
+    }
+    bounds.push_back(n);
 
-        for (auto &[doc, _] : graph)
-            new_ranks[doc] = (1 - d) / N;
+    std::vector<double> contrib(n), next(n);
+    std::vector<double> deltas(parts);
+    ThreadPool pool(parts);
 
-        for (auto &[doc, out_links] : graph)
+    int iter = 0;
+    while (iter < max_iterations)
+    {
+        double dangling = 0;
+        for (size_t u = 0; u < n; u++)
         {
-            for (auto &dest : out_links)
+            if (out_degree[u])
+                contrib[u] = ranks[u] / out_degree[u];
+            else
+                dangling += ranks[u];
+        }
+        double base = (1 - d) / n + d * dangling / n;
+
+        pool.parallel_for(0, parts, [&](size_t p)
+                          {
+            double delta = 0;
+            for (size_t v = bounds[p]; v < bounds[p + 1]; v++)
             {
-                new_ranks[dest] +=
-                    d * (ranks[doc] / out_links.size());
+                double sum = 0;
+                for (uint64_t e = in_offsets[v]; e < in_offsets[v + 1]; e++)
+                    sum += contrib[in_links[e]];
+                next[v] = base + d * sum;
+                delta += std::abs(next[v] - ranks[v]);
             }
+            deltas[p] = delta; }, 1);
+
+        ranks.swap(next);
+        iter++;
+
+        double total = 0;
+        for (double r : deltas)
+            total += r;
+        if (total < tolerance)
+            break;
+    }
+    return iter;
+}
+
+uint32_t PageRank::node(uint32_t doc_id)
+{
+    auto it = node_index->find(doc_id);
+    if (it != node_index->end())
+        return it->second;
+
+    if (node_index.use_count() > 1)
+        node_index = std::make_shared<std::unordered_map<uint32_t, uint32_t>>(*node_index);
+    uint32_t u = static_cast<uint32_t>(ranks.size());
+    node_index->emplace(doc_id, u);
+    ranks.push_back(0.0);
+    out_degree.push_back(0);
+    nodes_added = true;
+
+    // N appears in every node's teleport and dangling terms, so growing it
+    // shifts every residual by the same amount; the new node starts with
+    // rank 0 and no in-links.
+    if (residual_valid && u > 0)
+    {
+        double spread = 1 - damping + damping * dangling_mass;
+        uniform_residual += spread * (1.0 / (u + 1) - 1.0 / u);
+        residual.push_back(spread / (u + 1) - uniform_residual);
+        touched.push_back(u);
+    }
+    else
+    {
+        residual.push_back(0.0);
+        residual_valid = false;
+    }
+    return u;
+}
+
+const uint32_t *PageRank::links_begin(uint32_t u) const
+{
+    auto it = changed_links.find(u);
+    if (it != changed_links.end())
+        return it->second.data();
+    if (u + 1 >= out_offsets.size())
+        return nullptr;
+    return out_links.data() + out_offsets[u];
+}
+
+const uint32_t *PageRank::links_end(uint32_t u) const
+{
+    return links_begin(u) + out_degree[u];
+}
+
+// u's rank is unchanged, so only what it passes on moves: residual is taken
+// from its old targets (or from everyone, if it was dangling) and given to
+// the new ones.
+void PageRank::replace_links(uint32_t u, std::vector<uint32_t> links)
+{
+    auto shift = [this, u](double sign)
+    {
+        if (!residual_valid)
+            return;
+        double mass = sign * damping * ranks[u];
+        if (out_degree[u] == 0)
+        {
+            uniform_residual += mass / ranks.size();
+            return;
+        }
+        double share = mass / out_degree[u];
+        for (const uint32_t *p = links_begin(u); p != links_end(u); p++)
+        {
+            residual[*p] += share;
+            touched.push_back(*p);
         }
-        ranks = new_ranks;
+    };
+
+    shift(-1);
+    if (out_degree[u] == 0 && !links.empty())
+        dangling_mass -= ranks[u];
+    else if (out_degree[u] > 0 && links.empty())
+        dangling_mass += ranks[u];
+    out_degree[u] = links.size();
+    changed_links[u] = std::move(links);
+    shift(+1);
+}
+
+void PageRank::add_edge(uint32_t from, uint32_t to)
+{
+    uint32_t u = node(from);
+    uint32_t v = node(to);
+    std::vector<uint32_t> links(links_begin(u), links_end(u));
+    links.push_back(v);
+    replace_links(u, std::move(links));
+}
+
+void PageRank::remove_edge(uint32_t from, uint32_t to)
+{
+    auto from_it = node_index->find(from);
+    auto to_it = node_index->find(to);
+    if (from_it == node_index->end() || to_it == node_index->end())
+        return;
+
+    uint32_t u = from_it->second;
+    std::vector<uint32_t> links(links_begin(u), links_end(u));
+    auto it = std::find(links.begin(), links.end(), to_it->second);
+    if (it == links.end())
+        return;
+    links.erase(it);
+    replace_links(u, std::move(links));
+}
+
+void PageRank::set_links(uint32_t doc, std::vector<uint32_t> links)
+{
+    uint32_t u = node(doc);
+    for (auto &dest : links)
+        dest = node(dest);
+    replace_links(u, std::move(links));
+}
+
+// Exact residual of every node from the current ranks: one pass over the
+// edges, the cost of a single power iteration.
+void PageRank::sweep_residual()
+{
+    size_t n = ranks.size();
+    residual.assign(n, 0.0);
+    double dangling = 0;
+    for (uint32_t u = 0; u < n; u++)
+    {
+        if (out_degree[u] == 0)
+        {
+            dangling += ranks[u];
+            continue;
+        }
+        double share = damping * ranks[u] / out_degree[u];
+        for (const uint32_t *p = links_begin(u); p != links_end(u); p++)
+            residual[*p] += share;
+    }
+    double base = (1 - damping) / n + damping * dangling / n;
+    for (uint32_t v = 0; v < n; v++)
+        residual[v] += base - ranks[v];
+
+    dangling_mass = dangling;
+    uniform_residual = 0;
+    residual_valid = true;
+    touched.resize(n);
+    for (uint32_t v = 0; v < n; v++)
+        touched[v] = v;
+}
+
+// Pushes the shared residual into every rank at once; what dangling nodes
+// pass on becomes the (smaller) new shared residual.
+void PageRank::fold_uniform_residual()
+{
+    size_t n = ranks.size();
+    double amount = uniform_residual;
+    size_t dangling = 0;
+    for (uint32_t u = 0; u < n; u++)
+    {
+        ranks[u] += amount;
+        if (out_degree[u] == 0)
+        {
+            dangling++;
+            continue;
+        }
+        double share = damping * amount / out_degree[u];
+        for (const uint32_t *p = links_begin(u); p != links_end(u); p++)
+            residual[*p] += share;
+    }
+    uniform_residual = damping * amount * dangling / n;
+    dangling_mass += amount * dangling;
+
+    touched.resize(n);
+    for (uint32_t v = 0; v < n; v++)
+        touched[v] = v;
+}
+
+size_t PageRank::refine(double tolerance)
+{
+    size_t n = ranks.size();
+    if (n == 0)
+        return 0;
+    if (!residual_valid)
+        sweep_residual();
+
+    // Half the budget for per-node residuals, half for the shared part.
+    double eps = tolerance / (2 * n);
+    std::vector<char> queued(n, 0);
+    std::deque<uint32_t> queue;
+    auto enqueue = [&](uint32_t v)
+    {
+        if (!queued[v] && std::abs(residual[v]) > eps)
+        {
+            queued[v] = 1;
+            queue.push_back(v);
+        }
+    };
+
+    size_t pushes = 0;
+    while (true)
+    {
+        for (uint32_t v : touched)
+            enqueue(v);
+        touched.clear();
+
+        // Residual spread over much of the graph is cheaper to clear with
+        // warm-started sweeps than with scattered pushes.
+        if (queue.size() > n / 4)
+        {
+            int sweeps = compute(std::numeric_limits<int>::max(), damping, tolerance);
+            return pushes + sweeps * n;
+        }
+
+        while (!queue.empty())
+        {
+            uint32_t u = queue.front();
+            queue.pop_front();
+            queued[u] = 0;
+
+            double amount = residual[u];
+            ranks[u] += amount;
+            residual[u] = 0;
+            pushes++;
+
+            if (out_degree[u] == 0)
+            {
+                uniform_residual += damping * amount / n;
+                dangling_mass += amount;
+                continue;
+            }
+            double share = damping * amount / out_degree[u];
+            for (const uint32_t *p = links_begin(u); p != links_end(u); p++)
+            {
+                residual[*p] += share;
+                enqueue(*p);
+            }
+        }
+
+        if (std::abs(uniform_residual) * n <= tolerance / 2)
+            return pushes;
+        fold_uniform_residual();
     }
 }
 
 double PageRank::get_rank(uint32_t doc_id) const
 {
-    if (ranks.find(doc_id) == ranks.end())
+    auto it = node_index->find(doc_id);
+    if (it == node_index->end())
         return 0.0;
-    return ranks.at(doc_id);
+    return ranks[it->second];
+}
+
+std::shared_ptr<const PageRank::Snapshot> PageRank::snapshot() const
+{
+    auto snap = std::make_shared<Snapshot>();
+    snap->index = node_index;
+    snap->ranks = ranks;
+    return snap;
 }
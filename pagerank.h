@@ -1,19 +1,93 @@
 #pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
+// PageRank over a link graph between doc ids. build_graph() renumbers every
+// doc that appears as a source or a target to a dense index and stores the
+// graph in compressed sparse row form both ways. compute() is a pull-based
+// sweep over the in-links with no hashing in the inner loop, split into
+// edge-balanced ranges run on a ThreadPool. Rank of dangling nodes is
+// spread uniformly, so ranks always sum to 1.
+//
+// Incremental mode: add_edge(), remove_edge() and set_links() change the
+// graph in place and adjust a per-node residual (how far each rank is from
+// satisfying the PageRank equation) only around the changed sources.
+// refine() then pushes residual along out-links until it is below the
+// tolerance, touching only the part of the graph the change reaches.
+// Changed out-lists are kept in an overlay until the next compute().
 class PageRank
 {
 public:
+    // Immutable ranks handed to scorers; a new snapshot is published after
+    // every compute() or refine() while readers keep using the old one.
+    struct Snapshot
+    {
+        std::shared_ptr<const std::unordered_map<uint32_t, uint32_t>> index;
+        std::vector<double> ranks;
+
+        double get_rank(uint32_t doc_id) const;
+    };
+
     void build_graph(
         const std::unordered_map<uint32_t,
                                  std::vector<uint32_t>> &adjacency);
 
-    void compute(int iterations = 15, double damping = 0.85);
+    // Iterates until the L1 change between iterations drops below
+    // `tolerance` or `max_iterations` is reached; returns the iterations run.
+    int compute(int max_iterations = 100, double damping = 0.85,
+                double tolerance = 1e-6,
+                size_t threads = std::thread::hardware_concurrency());
+
+    void add_edge(uint32_t from, uint32_t to);
+    void remove_edge(uint32_t from, uint32_t to);
+    // Replaces all out-links of `doc`, e.g. after a recrawl.
+    void set_links(uint32_t doc, std::vector<uint32_t> links);
+
+    // Refines the current ranks after graph changes until the L1 residual
+    // is below `tolerance`, using the damping of the last compute(). Falls
+    // back to warm-started compute() sweeps when the residual has spread
+    // over a large part of the graph. Returns the node updates performed.
+    size_t refine(double tolerance = 1e-6);
 
     double get_rank(uint32_t doc_id) const;
+    size_t node_count() const { return ranks.size(); }
+    std::shared_ptr<const Snapshot> snapshot() const;
 
 private:
-    std::unordered_map<uint32_t, std::vector<uint32_t>> graph;
-    std::unordered_map<uint32_t, double> ranks;
+    uint32_t node(uint32_t doc_id);
+    const uint32_t *links_begin(uint32_t u) const;
+    const uint32_t *links_end(uint32_t u) const;
+    void replace_links(uint32_t u, std::vector<uint32_t> links);
+    void rebuild();
+    void build_in_links();
+    void sweep_residual();
+    void fold_uniform_residual();
+
+    // Shared copy-on-write with published snapshots.
+    std::shared_ptr<std::unordered_map<uint32_t, uint32_t>> node_index =
+        std::make_shared<std::unordered_map<uint32_t, uint32_t>>();
+    std::vector<uint64_t> out_offsets{0};
+    std::vector<uint32_t> out_links;
+    std::vector<uint64_t> in_offsets{0};
+    std::vector<uint32_t> in_links;
+    std::vector<uint32_t> out_degree;
+    // Out-lists changed since the CSR arrays were built, by dense node.
+    std::unordered_map<uint32_t, std::vector<uint32_t>> changed_links;
+    bool nodes_added = false;
+
+    std::vector<double> ranks;
+    double damping = 0.85;
+
+    // Residual of every node plus a part shared by all nodes (from pushes
+    // out of dangling nodes and changes of N). Invalid until the first
+    // refine() sweeps it.
+    std::vector<double> residual;
+    double uniform_residual = 0;
+    double dangling_mass = 0;
+    bool residual_valid = false;
+    std::vector<uint32_t> touched;
 };
@@ -0,0 +1,11 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+struct Posting
+{
+    uint32_t doc_id;
+    uint32_t term_freq;
+};
+
+static constexpr size_t POSTING_BLOCK_SIZE = 128;
@@ -0,0 +1,539 @@
+#include "query_evaluator.h"
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+namespace
+{
+    // Bounds are summed in a different order than real scores, so allow a
+    // few ulps of slack before declaring a doc unable to beat the heap.
+    bool can_beat(double bound, double threshold)
+    {
+        return bound + 1e-9 * (1.0 + std::abs(bound)) > threshold;
+    }
+
+    // Scores `doc` in query-term order so every evaluator produces bit-equal
+    // sums, and moves the matching cursors past it. Quantized impacts are
+    // summed as integers and scaled once.
+    double score_doc(std::vector<PostingCursor> &cursors, uint32_t doc,
+                     const Scorer &scorer)
+    {
+        if (scorer.impacts)
+        {
+            uint32_t impact = 0, matches = 0;
+            for (auto &c : cursors)
+            {
+                while (c.doc() == doc)
+                {
+                    impact += c.impact(scorer);
+                    matches++;
+                    c.next();
+                }
+            }
+            return scorer.impacts->scale * impact +
+                   Scorer::PAGERANK_WEIGHT * scorer.ranks[doc] * matches;
+        }
+
+        double score = 0;
+        for (auto &c : cursors)
+        {
+            while (c.doc() == doc)
+            {
+                score += c.score(scorer);
+                c.next();
+            }
+        }
+        return score;
+    }
+
+    // Moves the matching cursors past a deleted doc without scoring it.
+    void skip_doc(std::vector<PostingCursor> &cursors, uint32_t doc)
+    {
+        for (auto &c : cursors)
+        {
+            while (c.doc() == doc)
+                c.next();
+        }
+    }
+
+    void sort_by_doc(std::vector<PostingCursor *> &order)
+    {
+        std::sort(order.begin(), order.end(),
+                  [](const PostingCursor *a, const PostingCursor *b)
+                  { return a->doc() < b->doc(); });
+    }
+
+    // Index of the first cursor (in doc order) at which the running sum of
+    // term upper bounds can beat the threshold, extended over every cursor
+    // positioned on the same doc. Returns -1 when no doc can qualify.
+    // Bounds are clamped at zero: a doc matching only some of the prefix
+    // terms must not be ruled out because a negative-IDF term was summed.
+    long find_pivot(const std::vector<PostingCursor *> &order, double threshold)
+    {
+        double acc = 0;
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            uint32_t doc = order[i]->doc();
+            if (doc == PostingCursor::END)
+                return -1;
+            acc += std::max(0.0, order[i]->max_score());
+            if (can_beat(acc, threshold))
+            {
+                while (i + 1 < order.size() && order[i + 1]->doc() == doc)
+                    i++;
+                return static_cast<long>(i);
+            }
+        }
+        return -1;
+    }
+}
+
+PostingCursor::PostingCursor(const FrozenIndex &index, size_t term, double weight,
+                             const ScoreBounds *bounds, const DecodedTerm *decoded)
+    : index(&index), bounds(bounds), decoded(decoded), term(term), weight(weight),
+      term_df(index.term_info(term).df),
+      first_block(index.term_info(term).first_block),
+      end_block(first_block + index.block_count(term)),
+      block(first_block), shallow(first_block), pos(0), count(0), current(END)
+{
+    load_block(first_block);
+}
+
+PostingCursor::PostingCursor(const PostingCursor &other)
+{
+    *this = other;
+}
+
+// Block pointers into the source's own buffers must be re-aimed at ours.
+PostingCursor &PostingCursor::operator=(const PostingCursor &other)
+{
+    if (this == &other)
+        return *this;
+    index = other.index;
+    bounds = other.bounds;
+    decoded = other.decoded;
+    term = other.term;
+    weight = other.weight;
+    term_df = other.term_df;
+    first_block = other.first_block;
+    end_block = other.end_block;
+    block = other.block;
+    shallow = other.shallow;
+    pos = other.pos;
+    count = other.count;
+    current = other.current;
+    block_scores = other.block_scores;
+    if (other.block_docs == other.docs)
+    {
+        std::copy(other.docs, other.docs + other.count, docs);
+        std::copy(other.freqs, other.freqs + other.count, freqs);
+        block_docs = docs;
+        block_freqs = freqs;
+    }
+    else
+    {
+        block_docs = other.block_docs;
+        block_freqs = other.block_freqs;
+    }
+    return *this;
+}
+
+void PostingCursor::load_block(size_t b)
+{
+    block = b;
+    pos = 0;
+    if (b >= end_block)
+    {
+        count = 0;
+        current = END;
+        block_docs = docs;
+        block_freqs = freqs;
+        block_scores = nullptr;
+        return;
+    }
+    if (decoded)
+    {
+        // Every block but a term's last holds exactly POSTING_BLOCK_SIZE.
+        size_t offset = (b - first_block) * POSTING_BLOCK_SIZE;
+        count = index->skip(b).count;
+        block_docs = decoded->docs.data() + offset;
+        block_freqs = decoded->freqs.data() + offset;
+        block_scores = decoded->scores.data() + offset;
+    }
+    else
+    {
+        count = index->decode_block(b, docs, freqs);
+        block_docs = docs;
+        block_freqs = freqs;
+        block_scores = nullptr;
+    }
+    current = block_docs[0];
+}
+
+void PostingCursor::advance(uint32_t target)
+{
+    if (current >= target)
+        return;
+
+    // Skip whole blocks by their last doc before decoding anything.
+    size_t b = block;
+    while (b < end_block && index->skip(b).last_doc < target)
+        b++;
+    if (b != block)
+        load_block(b);
+    if (current == END)
+        return;
+
+    pos = std::lower_bound(block_docs + pos, block_docs + count, target) - block_docs;
+    current = block_docs[pos];
+}
+
+void PostingCursor::advance_shallow(uint32_t target)
+{
+    shallow = std::max(shallow, block);
+    while (shallow < end_block && index->skip(shallow).last_doc < target)
+        shallow++;
+}
+
+double PostingCursor::block_max() const
+{
+    if (shallow >= end_block)
+        return 0;
+    return bounds->block_max[shallow];
+}
+
+uint32_t PostingCursor::block_last_doc() const
+{
+    if (shallow >= end_block)
+        return END;
+    return index->skip(shallow).last_doc;
+}
+
+DecodedTerm DecodedTerm::build(const FrozenIndex &index, const Scorer &scorer, size_t term,
+                               double weight)
+{
+    DecodedTerm decoded;
+    const auto &info = index.term_info(term);
+    decoded.docs.resize(info.df);
+    decoded.freqs.resize(info.df);
+    decoded.scores.reserve(info.df);
+
+    size_t n = 0;
+    for (size_t b = info.first_block; b < info.first_block + index.block_count(term); b++)
+    {
+        size_t count = index.decode_block(b, decoded.docs.data() + n, decoded.freqs.data() + n);
+        for (size_t i = n; i < n + count; i++)
+            decoded.scores.push_back(
+                scorer.score(weight, b, i - n, decoded.docs[i], decoded.freqs[i]));
+        n += count;
+    }
+    return decoded;
+}
+
+QuantizedImpacts QuantizedImpacts::build(const FrozenIndex &index, const Scorer &scorer,
+                                         const std::vector<double> &term_weight)
+{
+    // One pass for the largest BM25 part, which sets the scale, and one to
+    // quantize every posting against it.
+    uint32_t docs[POSTING_BLOCK_SIZE], freqs[POSTING_BLOCK_SIZE];
+    auto for_each_posting = [&](auto visit)
+    {
+        for (size_t t = 0; t < index.term_count(); t++)
+        {
+            size_t first = index.term_info(t).first_block;
+            for (size_t b = first; b < first + index.block_count(t); b++)
+            {
+                size_t count = index.decode_block(b, docs, freqs);
+                for (size_t i = 0; i < count; i++)
+                    visit(scorer.bm25(term_weight[t], b, i, docs[i], freqs[i]));
+            }
+        }
+    };
+
+    QuantizedImpacts quantized;
+    double max_part = 0;
+    for_each_posting([&](double part)
+                     { max_part = std::max(max_part, part); });
+    quantized.scale = max_part > 0 ? max_part / 255 : 1;
+
+    // Blocks are laid out in term order, so postings are visited in block
+    // order and each block's impacts start where the previous one's ended.
+    quantized.block_offsets.resize(index.block_count());
+    uint64_t offset = 0;
+    for (size_t b = 0; b < index.block_count(); b++)
+    {
+        quantized.block_offsets[b] = offset;
+        offset += index.skip(b).count;
+    }
+    quantized.impacts.reserve(offset);
+    for_each_posting([&](double part)
+                     {
+        double q = std::round(std::max(0.0, part) / quantized.scale);
+        quantized.impacts.push_back(static_cast<uint8_t>(std::min(q, 255.0))); });
+    return quantized;
+}
+
+size_t DecodedTerm::memory_usage() const
+{
+    return docs.size() * (sizeof(uint32_t) * 2 + sizeof(double));
+}
+
+void ScoreBounds::ensure(const FrozenIndex &index, const Scorer &scorer, size_t term,
+                         double weight)
+{
+    std::call_once(allocated, [&]
+                   {
+        term_max.assign(index.term_count(), 0.0);
+        block_max.assign(index.block_count(), 0.0);
+        tail_max.assign(index.term_count(), 0.0);
+        state.reset(new std::atomic<uint8_t>[index.term_count()]);
+        for (size_t t = 0; t < index.term_count(); t++)
+            state[t].store(EMPTY, std::memory_order_relaxed); });
+
+    // A term's blocks are disjoint from every other term's, so fills of
+    // different terms never write the same entries.
+    std::atomic<uint8_t> &slot = state[term];
+    if (slot.load(std::memory_order_acquire) == READY)
+        return;
+    uint8_t expected = EMPTY;
+    if (!slot.compare_exchange_strong(expected, FILLING, std::memory_order_acquire))
+    {
+        while (slot.load(std::memory_order_acquire) != READY)
+            std::this_thread::yield();
+        return;
+    }
+
+    uint32_t docs[POSTING_BLOCK_SIZE], freqs[POSTING_BLOCK_SIZE];
+    size_t first = index.term_info(term).first_block;
+    uint32_t tier_end = index.tier_boundary();
+    double max_score = -std::numeric_limits<double>::infinity();
+    double tail_score = -std::numeric_limits<double>::infinity();
+
+    for (size_t b = first; b < first + index.block_count(term); b++)
+    {
+        size_t n = index.decode_block(b, docs, freqs);
+        double block_score = -std::numeric_limits<double>::infinity();
+        for (size_t i = 0; i < n; i++)
+        {
+            double score = scorer.score(weight, b, i, docs[i], freqs[i]);
+            block_score = std::max(block_score, score);
+            if (docs[i] >= tier_end)
+                tail_score = std::max(tail_score, score);
+        }
+        block_max[b] = block_score;
+        max_score = std::max(max_score, block_score);
+    }
+    term_max[term] = max_score;
+    tail_max[term] = tail_score;
+    slot.store(READY, std::memory_order_release);
+}
+
+double TopKHeap::threshold() const
+{
+    double threshold = floor;
+    if (shared)
+        threshold = std::max(threshold, shared->get());
+    if (full())
+        threshold = std::max(threshold, heap.front().second);
+    return threshold;
+}
+
+bool TopKHeap::better(const std::pair<uint32_t, double> &a,
+                      const std::pair<uint32_t, double> &b) const
+{
+    if (a.second != b.second)
+        return a.second > b.second;
+    if (index)
+        return index->doc_id(a.first) < index->doc_id(b.first);
+    return a.first < b.first;
+}
+
+bool TopKHeap::push(uint32_t doc_id, double score)
+{
+    if (k == 0 || score < floor || (shared && score < shared->get()))
+        return false;
+
+    auto order = [this](const auto &a, const auto &b)
+    { return better(a, b); };
+    if (heap.size() < k)
+    {
+        heap.push_back({doc_id, score});
+        std::push_heap(heap.begin(), heap.end(), order);
+    }
+    else if (!better({doc_id, score}, heap.front()))
+    {
+        return false;
+    }
+    else
+    {
+        std::pop_heap(heap.begin(), heap.end(), order);
+        heap.back() = {doc_id, score};
+        std::push_heap(heap.begin(), heap.end(), order);
+    }
+
+    if (shared && full())
+        shared->raise(heap.front().second);
+    return true;
+}
+
+std::vector<std::pair<uint32_t, double>> TopKHeap::take_sorted()
+{
+    std::sort_heap(heap.begin(), heap.end(), [this](const auto &a, const auto &b)
+                   { return better(a, b); });
+    return std::move(heap);
+}
+
+std::vector<std::pair<uint32_t, double>> evaluate_daat(
+    std::vector<PostingCursor> &cursors, const Scorer &scorer, size_t k)
+{
+    TopKHeap top(k);
+    evaluate_daat(cursors, scorer, top, PostingCursor::END);
+    return top.take_sorted();
+}
+
+std::vector<std::pair<uint32_t, double>> evaluate_wand(
+    std::vector<PostingCursor> &cursors, const Scorer &scorer, size_t k)
+{
+    TopKHeap top(k);
+    evaluate_wand(cursors, scorer, top, PostingCursor::END);
+    return top.take_sorted();
+}
+
+std::vector<std::pair<uint32_t, double>> evaluate_block_max_wand(
+    std::vector<PostingCursor> &cursors, const Scorer &scorer, size_t k)
+{
+    TopKHeap top(k);
+    evaluate_block_max_wand(cursors, scorer, top, PostingCursor::END);
+    return top.take_sorted();
+}
+
+void evaluate_daat(std::vector<PostingCursor> &cursors, const Scorer &scorer,
+                   TopKHeap &top, uint32_t end)
+{
+    while (true)
+    {
+        uint32_t doc = PostingCursor::END;
+        for (const auto &c : cursors)
+            doc = std::min(doc, c.doc());
+        if (doc >= end)
+            break;
+
+        if (scorer.is_deleted(doc))
+            skip_doc(cursors, doc);
+        else
+            top.push(doc, score_doc(cursors, doc, scorer));
+    }
+}
+
+// Cursors left behind the pivot when stopping at `end` only hold docs the
+// pivot search has already ruled out, so resuming may safely revisit them.
+void evaluate_wand(std::vector<PostingCursor> &cursors, const Scorer &scorer,
+                   TopKHeap &top, uint32_t end)
+{
+    if (top.capacity() == 0)
+        return;
+
+    std::vector<PostingCursor *> order;
+    for (auto &c : cursors)
+        order.push_back(&c);
+
+    while (true)
+    {
+        sort_by_doc(order);
+        long pivot = find_pivot(order, top.threshold());
+        if (pivot < 0)
+            break;
+
+        uint32_t pivot_doc = order[pivot]->doc();
+        if (pivot_doc >= end)
+            break;
+        if (order[0]->doc() == pivot_doc)
+        {
+            if (scorer.is_deleted(pivot_doc))
+                skip_doc(cursors, pivot_doc);
+            else
+                top.push(pivot_doc, score_doc(cursors, pivot_doc, scorer));
+        }
+        else
+        {
+            for (long i = 0; i < pivot; i++)
+                order[i]->advance(pivot_doc);
+        }
+    }
+}
+
+void evaluate_block_max_wand(std::vector<PostingCursor> &cursors, const Scorer &scorer,
+                             TopKHeap &top, uint32_t end)
+{
+    if (top.capacity() == 0)
+        return;
+
+    std::vector<PostingCursor *> order;
+    for (auto &c : cursors)
+        order.push_back(&c);
+
+    while (true)
+    {
+        sort_by_doc(order);
+        double threshold = top.threshold();
+        long pivot = find_pivot(order, threshold);
+        if (pivot < 0)
+            break;
+
+        uint32_t pivot_doc = order[pivot]->doc();
+        if (pivot_doc >= end)
+            break;
+        double block_sum = 0;
+        for (long i = 0; i <= pivot; i++)
+        {
+            order[i]->advance_shallow(pivot_doc);
+            block_sum += std::max(0.0, order[i]->block_max());
+        }
+
+        if (can_beat(block_sum, threshold))
+        {
+            if (order[0]->doc() == pivot_doc)
+            {
+                if (scorer.is_deleted(pivot_doc))
+                    skip_doc(cursors, pivot_doc);
+                else
+                    top.push(pivot_doc, score_doc(cursors, pivot_doc, scorer));
+            }
+            else
+            {
+                for (long i = 0; i < pivot; i++)
+                    order[i]->advance(pivot_doc);
+            }
+            continue;
+        }
+
+        // No doc before the end of the shallowest current block can win:
+        // jump every pivot-side cursor past it (or to the next cursor).
+        uint32_t next = PostingCursor::END;
+        for (long i = 0; i <= pivot; i++)
+        {
+            uint32_t last = order[i]->block_last_doc();
+            if (last != PostingCursor::END)
+                next = std::min(next, last + 1);
+        }
+        if (pivot + 1 < static_cast<long>(order.size()))
+            next = std::min(next, order[pivot + 1]->doc());
+
+        for (long i = 0; i <= pivot; i++)
+            order[i]->advance(next);
+    }
+}
+
+// Tail maxima are clamped at zero like in find_pivot: a tail doc may match
+// only some of the terms.
+bool tail_can_enter(const std::vector<PostingCursor> &cursors, const TopKHeap &top,
+                    double guarantee)
+{
+    if (guarantee <= 0)
+        return !top.full();
+
+    double bound = 0;
+    for (const auto &c : cursors)
+        bound += std::max(0.0, c.tail_max());
+    return can_beat(guarantee * bound, top.threshold());
+}
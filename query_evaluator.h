@@ -0,0 +1,272 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "bm25.h"
+#include "frozen_index.h"
+
+struct Scorer;
+
+// BM25 parts of every posting of one FrozenIndex as 8-bit multiples of
+// `scale`, found through each block's offset, so scoring a doc becomes an
+// integer sum. Built from the term weights and length normalization of the
+// moment; negative parts (terms in over half the docs) quantize to zero.
+struct QuantizedImpacts
+{
+    std::vector<uint64_t> block_offsets;
+    std::vector<uint8_t> impacts;
+    double scale = 0;
+
+    // `term_weight` is indexed by term ordinal; see Scorer.
+    static QuantizedImpacts build(const FrozenIndex &index, const Scorer &scorer,
+                                  const std::vector<double> &term_weight);
+    bool empty() const { return block_offsets.empty(); }
+    uint32_t at(size_t block, size_t pos) const { return impacts[block_offsets[block] + pos]; }
+};
+
+// Scores postings of one FrozenIndex against collection-wide statistics,
+// which may span several indexes. A term's weight is its BM25
+// idf * (k1 + 1) over the collection, and k1 * (1 - b + b * len / avgdl) is
+// norm_base + norm_scale * len, so scoring a posting is a table read and
+// one division. `ranks` holds the PageRank of every doc ordinal. Postings
+// are addressed by skip block and position so quantized impacts, when
+// given, are read without the term frequency.
+//
+// Normalization is not tabulated per doc: avgdl changes with every
+// refresh and differs per set of foreign statistics, so a table would be
+// rebuilt for every doc of every segment that often, and reading it costs
+// 8 bytes per posting against the 4-byte length and one multiply-add.
+struct Scorer
+{
+    const FrozenIndex *index;
+    const double *ranks;
+    const QuantizedImpacts *impacts;
+    double norm_base;
+    double norm_scale;
+    // Tombstone bits by ordinal; deleted docs are skipped, never scored.
+    const uint64_t *deleted = nullptr;
+
+    static constexpr double PAGERANK_WEIGHT = 0.3;
+
+    bool is_deleted(uint32_t ordinal) const
+    {
+        return deleted && deleted[ordinal >> 6] >> (ordinal & 63) & 1;
+    }
+
+    static double term_weight(const BM25 &bm25, uint64_t df, uint64_t doc_count)
+    {
+        return bm25.idf(static_cast<int>(df), static_cast<int>(doc_count)) * (bm25.get_k1() + 1);
+    }
+
+    double bm25(double weight, size_t block, size_t pos, uint32_t ordinal, uint32_t tf) const
+    {
+        if (impacts)
+            return impacts->scale * impacts->at(block, pos);
+        return weight * tf / (tf + norm_base + norm_scale * index->doc_length(ordinal));
+    }
+
+    double score(double weight, size_t block, size_t pos, uint32_t ordinal, uint32_t tf) const
+    {
+        return bm25(weight, block, pos, ordinal, tf) + PAGERANK_WEIGHT * ranks[ordinal];
+    }
+};
+
+// Per-term and per-block maxima of Scorer::score, indexed like
+// FrozenIndex terms and skip entries, plus each term's maximum over the
+// docs past the index's tier boundary (-inf when it has none there). Terms
+// are filled on first use so opening an index never has to decode every
+// posting. Concurrent searches share one instance: the first to need a term
+// claims and fills it, the others wait for that term only.
+struct ScoreBounds
+{
+    std::vector<double> term_max;
+    std::vector<double> block_max;
+    std::vector<double> tail_max;
+
+    // Entries of `term` may be read once this returns.
+    void ensure(const FrozenIndex &index, const Scorer &scorer, size_t term, double weight);
+
+private:
+    enum : uint8_t
+    {
+        EMPTY,
+        FILLING,
+        READY
+    };
+    std::once_flag allocated;
+    std::unique_ptr<std::atomic<uint8_t>[]> state;
+};
+
+// One term's whole posting list, decoded and scored up front. Valid for
+// the FrozenIndex and Scorer it was built from; cursors over a cached hot
+// term skip both block decoding and per-posting scoring.
+struct DecodedTerm
+{
+    std::vector<uint32_t> docs;
+    std::vector<uint32_t> freqs;
+    std::vector<double> scores;
+
+    static DecodedTerm build(const FrozenIndex &index, const Scorer &scorer, size_t term,
+                             double weight);
+    size_t memory_usage() const;
+};
+
+// Forward-only cursor over one frozen posting list, decoding a block at a
+// time, or reading blocks in place from a DecodedTerm when one is given.
+// Doc ids are FrozenIndex ordinals. When bounds are attached the cursor
+// also exposes a shallow block position that can move ahead of the
+// decoded block using only the skip table.
+class PostingCursor
+{
+public:
+    static constexpr uint32_t END = UINT32_MAX;
+
+    PostingCursor(const FrozenIndex &index, size_t term, double weight,
+                  const ScoreBounds *bounds = nullptr,
+                  const DecodedTerm *decoded = nullptr);
+    PostingCursor(const PostingCursor &other);
+    PostingCursor &operator=(const PostingCursor &other);
+
+    uint32_t doc() const { return current; }
+    uint32_t freq() const { return block_freqs[pos]; }
+    uint32_t df() const { return term_df; }
+    double score(const Scorer &scorer) const
+    {
+        return block_scores ? block_scores[pos]
+                            : scorer.score(weight, block, pos, current, freq());
+    }
+    uint32_t impact(const Scorer &scorer) const { return scorer.impacts->at(block, pos); }
+
+    void next()
+    {
+        if (++pos < count)
+            current = block_docs[pos];
+        else
+            load_block(block + 1);
+    }
+    void advance(uint32_t target);
+
+    double max_score() const { return bounds->term_max[term]; }
+    double tail_max() const { return bounds->tail_max[term]; }
+    void advance_shallow(uint32_t target);
+    double block_max() const;
+    uint32_t block_last_doc() const;
+
+private:
+    void load_block(size_t b);
+
+    const FrozenIndex *index;
+    const ScoreBounds *bounds;
+    const DecodedTerm *decoded;
+    size_t term;
+    double weight;
+    uint32_t term_df;
+    size_t first_block;
+    size_t end_block;
+
+    size_t block;
+    size_t shallow;
+    size_t pos;
+    size_t count;
+    uint32_t current;
+    // The current block: either the buffers below or a slice of `decoded`.
+    const uint32_t *block_docs;
+    const uint32_t *block_freqs;
+    const double *block_scores;
+    uint32_t docs[POSTING_BLOCK_SIZE];
+    uint32_t freqs[POSTING_BLOCK_SIZE];
+};
+
+// Best k-th score so far among heaps filled in parallel for one query.
+// Each heap's k-th score is a lower bound on the final one, so all of them
+// can prune against the highest.
+class SharedThreshold
+{
+public:
+    double get() const { return value.load(std::memory_order_relaxed); }
+    void raise(double score)
+    {
+        double current = value.load(std::memory_order_relaxed);
+        while (score > current &&
+               !value.compare_exchange_weak(current, score, std::memory_order_relaxed))
+        {
+        }
+    }
+
+private:
+    std::atomic<double> value{-std::numeric_limits<double>::infinity()};
+};
+
+// Keeps the k best (doc, score) pairs seen so far. Ties on score are broken
+// towards the smaller doc id so results do not depend on evaluation order.
+// A floor, e.g. the k-th score already found in another segment, rejects
+// docs that could not make the combined top k even before the heap fills.
+// A doc scoring exactly the floor or shared threshold is still admitted,
+// since it may beat the doc that set it on doc id.
+class TopKHeap
+{
+public:
+    TopKHeap(size_t k) : k(k) {}
+
+    bool full() const { return heap.size() >= k; }
+    // Score a new doc must reach to enter: the highest of the floor (-inf
+    // unless set), the shared threshold and, once k docs are held, the
+    // k-th score.
+    double threshold() const;
+    void set_floor(double score) { floor = score; }
+    // Docs pushed are ordinals of `index`; ties go to the smaller doc id
+    // they map to rather than the smaller ordinal.
+    void set_index(const FrozenIndex *ordinals) { index = ordinals; }
+    // Prunes against `shared` and raises it with this heap's k-th score.
+    void share(SharedThreshold *threshold) { shared = threshold; }
+    bool push(uint32_t doc_id, double score);
+
+    std::vector<std::pair<uint32_t, double>> take_sorted();
+    size_t capacity() const { return k; }
+
+private:
+    size_t k;
+    double floor = -std::numeric_limits<double>::infinity();
+    SharedThreshold *shared = nullptr;
+    const FrozenIndex *index = nullptr;
+    std::vector<std::pair<uint32_t, double>> heap;
+
+    // Heap order: whether `a` ranks above `b`, so the worst entry is on top.
+    bool better(const std::pair<uint32_t, double> &a,
+                const std::pair<uint32_t, double> &b) const;
+};
+
+// Document-at-a-time disjunctive evaluation over one cursor per query term.
+std::vector<std::pair<uint32_t, double>> evaluate_daat(
+    std::vector<PostingCursor> &cursors, const Scorer &scorer, size_t k);
+
+// Same results as evaluate_daat, skipping docs whose term upper bounds
+// (WAND) or block upper bounds (Block-Max WAND) cannot beat the heap.
+// Every cursor must carry bounds.
+std::vector<std::pair<uint32_t, double>> evaluate_wand(
+    std::vector<PostingCursor> &cursors, const Scorer &scorer, size_t k);
+
+std::vector<std::pair<uint32_t, double>> evaluate_block_max_wand(
+    std::vector<PostingCursor> &cursors, const Scorer &scorer, size_t k);
+
+// Resumable forms of the evaluators above: only docs below `end` are
+// pushed into `top`, and a later call with a larger `end` and the same
+// cursors and heap continues where this one stopped.
+void evaluate_daat(std::vector<PostingCursor> &cursors, const Scorer &scorer,
+                   TopKHeap &top, uint32_t end);
+void evaluate_wand(std::vector<PostingCursor> &cursors, const Scorer &scorer,
+                   TopKHeap &top, uint32_t end);
+void evaluate_block_max_wand(std::vector<PostingCursor> &cursors, const Scorer &scorer,
+                             TopKHeap &top, uint32_t end);
+
+// Whether a doc past the tier boundary could still enter `top`, judged by
+// the sum of the terms' tail maxima; every cursor must carry bounds. A
+// `guarantee` of 1 is exact; below 1 the bound is scaled down, so a missed
+// tail doc scores at most threshold / guarantee, and 0 stops as soon as
+// the heap is full.
+bool tail_can_enter(const std::vector<PostingCursor> &cursors, const TopKHeap &top,
+                    double guarantee);
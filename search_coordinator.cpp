@@ -0,0 +1,526 @@
+#include "search_coordinator.h"
+#include <grpcpp/grpcpp.h>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include "query_evaluator.h"
+#include "tokenizer.h"
+
+namespace
+{
+    uint64_t mix(uint64_t hash, uint64_t value)
+    {
+        hash ^= value + 0x9E3779B97F4A7C15ull + (hash << 6) + (hash >> 2);
+        return hash * 0xBF58476D1CE4E5B9ull;
+    }
+
+    std::vector<std::vector<std::string>> one_replica_each(const std::vector<std::string> &shards)
+    {
+        std::vector<std::vector<std::string>> replicas;
+        for (const std::string &address : shards)
+            replicas.push_back({address});
+        return replicas;
+    }
+
+    // In doc id order first, so equal scores resolve as on a single engine.
+    std::vector<std::pair<uint32_t, double>> merge_top_k(
+        std::vector<std::pair<uint32_t, double>> found, int k)
+    {
+        std::sort(found.begin(), found.end());
+        TopKHeap merged(std::max(0, k));
+        for (const auto &[doc_id, score] : found)
+            merged.push(doc_id, score);
+        return merged.take_sorted();
+    }
+}
+
+SearchCoordinator::SearchCoordinator(const std::vector<std::string> &shards)
+    : SearchCoordinator(shards, Options()) {}
+
+SearchCoordinator::SearchCoordinator(const std::vector<std::string> &shards, Options options)
+    : SearchCoordinator(one_replica_each(shards), options) {}
+
+SearchCoordinator::SearchCoordinator(const std::vector<std::vector<std::string>> &replicas,
+                                     Options options)
+    : ring(options.placement), options(options)
+{
+    if (replicas.empty())
+        throw std::runtime_error("SearchCoordinator needs at least one shard");
+    if (options.placement.load_factor != 0)
+        throw std::runtime_error("SearchCoordinator: bounded-load placement is not supported");
+    for (const auto &addresses : replicas)
+    {
+        if (addresses.empty())
+            throw std::runtime_error("SearchCoordinator: shard without replicas");
+        auto shard = std::make_unique<Shard>();
+        for (const std::string &address : addresses)
+        {
+            auto replica = std::make_unique<Replica>();
+            replica->address = address;
+            replica->stub = SearchService::NewStub(
+                grpc::CreateChannel(address, grpc::InsecureChannelCredentials()));
+            shard->replicas.push_back(std::move(replica));
+        }
+        ring.add_node(addresses.front());
+        shard_ids[addresses.front()] = shards.size();
+        shards.push_back(std::move(shard));
+    }
+}
+
+std::string SearchCoordinator::shard_for(uint32_t doc_id)
+{
+    return ring.get_node(std::to_string(doc_id));
+}
+
+size_t SearchCoordinator::shard_index(uint32_t doc_id)
+{
+    return shard_ids.at(shard_for(doc_id));
+}
+
+void SearchCoordinator::Replica::record(double micros)
+{
+    double old = latency.load(std::memory_order_relaxed);
+    latency.store(old == 0 ? micros : old + EWMA_WEIGHT * (micros - old),
+                  std::memory_order_relaxed);
+}
+
+std::vector<size_t> SearchCoordinator::Shard::rank_replicas()
+{
+    std::vector<size_t> order(replicas.size());
+    for (size_t r = 0; r < order.size(); r++)
+        order[r] = r;
+    std::stable_sort(order.begin(), order.end(),
+                     [&](size_t a, size_t b)
+                     { return replicas[a]->latency.load(std::memory_order_relaxed) <
+                              replicas[b]->latency.load(std::memory_order_relaxed); });
+    for (size_t r = 1; r < order.size(); r++)
+    {
+        std::atomic<double> &latency = replicas[order[r]]->latency;
+        latency.store(latency.load(std::memory_order_relaxed) * (1 - SKIPPED_DECAY),
+                      std::memory_order_relaxed);
+    }
+    return order;
+}
+
+void SearchCoordinator::Shard::record(double micros)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (latencies.size() < LATENCY_WINDOW)
+        latencies.push_back(micros);
+    else
+        latencies[next_latency] = micros;
+    next_latency = (next_latency + 1) % LATENCY_WINDOW;
+}
+
+double SearchCoordinator::Shard::percentile(double p)
+{
+    std::vector<double> sorted;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (latencies.size() < LATENCY_WINDOW / 8)
+            return std::numeric_limits<double>::infinity();
+        sorted = latencies;
+    }
+    auto nth = sorted.begin() + static_cast<size_t>(p * (sorted.size() - 1));
+    std::nth_element(sorted.begin(), nth, sorted.end());
+    return *nth;
+}
+
+// Sends one request per shard, built by `prepare` for a replica's stub,
+// and hands the first answer of each shard that arrives by `deadline` to
+// `on_reply`; calls still out then are cancelled. Returns the number of
+// second-replica requests, once every call has come back.
+template <typename Response, typename Prepare, typename OnReply>
+size_t SearchCoordinator::scatter(std::chrono::system_clock::time_point deadline,
+                                  Prepare prepare, OnReply on_reply)
+{
+    using Clock = std::chrono::system_clock;
+    struct Call
+    {
+        Replica *replica;
+        Clock::time_point start;
+        bool returned = false;
+        grpc::ClientContext context;
+        Response response;
+        grpc::Status status;
+        std::unique_ptr<grpc::ClientAsyncResponseReader<Response>> reader;
+    };
+    struct Pending
+    {
+        std::vector<size_t> order;
+        // Replicas asked so far, in `order`; their calls by attempt.
+        std::vector<std::unique_ptr<Call>> calls;
+        Clock::time_point hedge_at = Clock::time_point::max();
+        bool answered = false;
+    };
+
+    grpc::CompletionQueue queue;
+    std::vector<Pending> pending(shards.size());
+    size_t outstanding = 0;
+    size_t retries = 0;
+    // The tag is shard * MAX_ATTEMPTS + attempt, and the second attempt is
+    // the last: hedging or failing over more would multiply load for little.
+    constexpr size_t MAX_ATTEMPTS = 2;
+    auto send = [&](size_t i)
+    {
+        Pending &shard = pending[i];
+        auto call = std::make_unique<Call>();
+        call->replica = shards[i]->replicas[shard.order[shard.calls.size()]].get();
+        call->start = Clock::now();
+        call->context.set_deadline(deadline);
+        call->reader = prepare(*call->replica->stub, &call->context, &queue);
+        call->reader->StartCall();
+        call->reader->Finish(&call->response, &call->status,
+                             reinterpret_cast<void *>(i * MAX_ATTEMPTS + shard.calls.size()));
+        shard.calls.push_back(std::move(call));
+        outstanding++;
+    };
+    auto can_retry = [&](size_t i)
+    {
+        return pending[i].calls.size() < std::min(MAX_ATTEMPTS, pending[i].order.size());
+    };
+
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+        pending[i].order = shards[i]->rank_replicas();
+        send(i);
+        double delay = options.hedge_percentile > 0
+                           ? shards[i]->percentile(options.hedge_percentile)
+                           : std::numeric_limits<double>::infinity();
+        if (can_retry(i) && delay < std::chrono::microseconds::max().count())
+            pending[i].hedge_at =
+                pending[i].calls[0]->start +
+                std::max(options.min_hedge_delay,
+                         std::chrono::microseconds(static_cast<int64_t>(delay)));
+    }
+
+    bool expired = false;
+    while (outstanding > 0)
+    {
+        // Calls time out on their own at the deadline; past it, stragglers
+        // are cancelled as well, and every call must still come back before
+        // the queue goes away.
+        Clock::time_point wake = expired ? Clock::time_point::max() : deadline;
+        for (const Pending &shard : pending)
+            wake = std::min(wake, shard.hedge_at);
+
+        void *tag;
+        bool ok;
+        auto status = queue.AsyncNext(&tag, &ok, wake);
+        if (status == grpc::CompletionQueue::SHUTDOWN)
+            break;
+        if (status == grpc::CompletionQueue::TIMEOUT)
+        {
+            Clock::time_point now = Clock::now();
+            for (size_t i = 0; i < pending.size(); i++)
+            {
+                if (pending[i].hedge_at > now)
+                    continue;
+                pending[i].hedge_at = Clock::time_point::max();
+                if (!pending[i].answered && now < deadline && can_retry(i))
+                {
+                    send(i);
+                    retries++;
+                }
+            }
+            if (!expired && now >= deadline)
+            {
+                expired = true;
+                for (Pending &shard : pending)
+                    for (auto &call : shard.calls)
+                        if (!call->returned)
+                            call->context.TryCancel();
+            }
+            continue;
+        }
+
+        size_t i = reinterpret_cast<size_t>(tag) / MAX_ATTEMPTS;
+        Pending &shard = pending[i];
+        Call &call = *shard.calls[reinterpret_cast<size_t>(tag) % MAX_ATTEMPTS];
+        call.returned = true;
+        outstanding--;
+        double micros = std::chrono::duration<double, std::micro>(Clock::now() - call.start).count();
+        if (ok && call.status.ok())
+        {
+            call.replica->record(micros);
+            if (shard.answered)
+                continue;
+            shard.answered = true;
+            shard.hedge_at = Clock::time_point::max();
+            shards[i]->record(micros);
+            for (auto &other : shard.calls)
+                if (!other->returned)
+                    other->context.TryCancel();
+            on_reply(i, call.response);
+        }
+        else if (call.status.error_code() != grpc::StatusCode::CANCELLED)
+        {
+            // Errors and timeouts count as taking the whole deadline.
+            call.replica->record(std::max(
+                micros, std::chrono::duration<double, std::micro>(options.deadline).count()));
+            bool others_out = std::any_of(shard.calls.begin(), shard.calls.end(),
+                                          [](const auto &c)
+                                          { return !c->returned; });
+            if (!shard.answered && !others_out && Clock::now() < deadline && can_retry(i))
+            {
+                shard.hedge_at = Clock::time_point::max();
+                send(i);
+                retries++;
+            }
+        }
+    }
+    return retries;
+}
+
+// Asks every shard for its totals and the df of `terms`. When all shards
+// are still at the cached generations, the cached dfs are kept as well.
+// Null if some shard did not answer: sums without it would not match the
+// statistics of any shard set.
+std::shared_ptr<const SearchCoordinator::GlobalStats>
+SearchCoordinator::gather_stats(const std::vector<std::string> &terms,
+                                std::shared_ptr<const GlobalStats> cached,
+                                std::chrono::system_clock::time_point deadline)
+{
+    StatsRequest request;
+    for (const std::string &term : terms)
+        request.add_terms(term);
+
+    std::vector<IndexStats> replies(shards.size());
+    std::vector<bool> answered(shards.size());
+    scatter<IndexStats>(
+        deadline,
+        [&](SearchService::Stub &stub, grpc::ClientContext *context, grpc::CompletionQueue *queue)
+        { return stub.PrepareAsyncStats(context, request, queue); },
+        [&](size_t i, IndexStats &reply)
+        {
+            replies[i] = std::move(reply);
+            answered[i] = true;
+        });
+
+    if (std::find(answered.begin(), answered.end(), false) != answered.end())
+        return nullptr;
+
+    auto next = std::make_shared<GlobalStats>();
+    uint64_t version = 0;
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+        next->generations.push_back(replies[i].version());
+        version = mix(version, replies[i].version());
+    }
+    // Terms no shard holds are recorded too, so they are not asked again.
+    IndexStats &sum = next->stats;
+    for (const std::string &term : terms)
+        (*sum.mutable_doc_freqs())[term] = 0;
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+        sum.set_doc_count(sum.doc_count() + replies[i].doc_count());
+        sum.set_live_doc_count(sum.live_doc_count() + replies[i].live_doc_count());
+        sum.set_total_doc_length(sum.total_doc_length() + replies[i].total_doc_length());
+        for (const std::string &term : terms)
+        {
+            auto df = replies[i].doc_freqs().find(term);
+            if (df != replies[i].doc_freqs().end())
+                (*sum.mutable_doc_freqs())[term] += df->second;
+        }
+    }
+    // Inserting skips the terms just summed.
+    if (cached && cached->generations == next->generations)
+        sum.mutable_doc_freqs()->insert(cached->stats.doc_freqs().begin(),
+                                        cached->stats.doc_freqs().end());
+    sum.set_version(version);
+
+    std::atomic_store(&global_stats, std::shared_ptr<const GlobalStats>(next));
+    return next;
+}
+
+std::shared_ptr<const SearchCoordinator::GlobalStats>
+SearchCoordinator::query_stats(const std::vector<std::string> &queries,
+                               std::chrono::system_clock::time_point deadline, IndexStats *stats)
+{
+    thread_local Tokenizer tokenizer;
+    std::vector<std::string> terms;
+    for (const std::string &query : queries)
+    {
+        const auto &tokens = tokenizer.tokenize(query);
+        terms.insert(terms.end(), tokens.begin(), tokens.end());
+    }
+    std::sort(terms.begin(), terms.end());
+    terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+
+    auto global = std::atomic_load(&global_stats);
+    std::vector<std::string> missing;
+    for (const std::string &term : terms)
+        if (!global || !global->stats.doc_freqs().count(term))
+            missing.push_back(term);
+    if (!missing.empty())
+        global = gather_stats(missing, global, deadline);
+    if (!global)
+        return nullptr;
+
+    stats->set_version(global->stats.version());
+    stats->set_doc_count(global->stats.doc_count());
+    stats->set_live_doc_count(global->stats.live_doc_count());
+    stats->set_total_doc_length(global->stats.total_doc_length());
+    for (const std::string &term : terms)
+        (*stats->mutable_doc_freqs())[term] = global->stats.doc_freqs().at(term);
+    return global;
+}
+
+void SearchCoordinator::drop_stats(std::shared_ptr<const GlobalStats> global)
+{
+    std::atomic_compare_exchange_strong(&global_stats, &global,
+                                        std::shared_ptr<const GlobalStats>());
+}
+
+SearchCoordinator::Result SearchCoordinator::search(const std::string &query, int k)
+{
+    return search(query, k, nullptr);
+}
+
+SearchCoordinator::Result SearchCoordinator::search(
+    const std::string &query, int k, const std::function<void(const Result &)> &on_progress)
+{
+    auto deadline = std::chrono::system_clock::now() + options.deadline;
+
+    // Without statistics every shard scores against its own.
+    QueryRequest request;
+    request.set_query(query);
+    request.set_top_k(k);
+    auto global = query_stats({query}, deadline, request.mutable_stats());
+    if (!global)
+        request.clear_stats();
+
+    Result result;
+    result.shards_queried = shards.size();
+    std::vector<std::pair<uint32_t, double>> found;
+    bool stale = false;
+    result.retries = scatter<QueryResponse>(
+        deadline,
+        [&](SearchService::Stub &stub, grpc::ClientContext *context, grpc::CompletionQueue *queue)
+        { return stub.PrepareAsyncSearch(context, request, queue); },
+        [&](size_t i, QueryResponse &response)
+        {
+            result.shards_answered++;
+            stale = stale || (global && response.generation() != global->generations[i]);
+            for (const auto &r : response.results())
+                found.push_back({r.doc_id(), r.score()});
+            if (on_progress)
+            {
+                result.results = merge_top_k(found, k);
+                on_progress(result);
+            }
+        });
+    result.results = merge_top_k(std::move(found), k);
+
+    if (stale)
+        drop_stats(std::move(global));
+    return result;
+}
+
+std::vector<SearchCoordinator::Result>
+SearchCoordinator::search_batch(const std::vector<std::string> &queries, int k)
+{
+    auto deadline = std::chrono::system_clock::now() + options.deadline;
+
+    BatchQueryRequest request;
+    for (const std::string &query : queries)
+        request.add_queries(query);
+    request.set_top_k(k);
+    auto global = query_stats(queries, deadline, request.mutable_stats());
+    if (!global)
+        request.clear_stats();
+
+    std::vector<Result> results(queries.size());
+    std::vector<std::vector<std::pair<uint32_t, double>>> found(queries.size());
+    size_t answered = 0;
+    bool stale = false;
+    size_t retries = scatter<BatchQueryResponse>(
+        deadline,
+        [&](SearchService::Stub &stub, grpc::ClientContext *context, grpc::CompletionQueue *queue)
+        { return stub.PrepareAsyncBatchSearch(context, request, queue); },
+        [&](size_t i, BatchQueryResponse &response)
+        {
+            // A shard that lost track of the queries counts as not answering.
+            if (static_cast<size_t>(response.responses_size()) != queries.size())
+                return;
+            answered++;
+            for (size_t q = 0; q < queries.size(); q++)
+            {
+                const QueryResponse &reply = response.responses(q);
+                stale = stale || (global && reply.generation() != global->generations[i]);
+                for (const auto &r : reply.results())
+                    found[q].push_back({r.doc_id(), r.score()});
+            }
+        });
+
+    for (size_t q = 0; q < queries.size(); q++)
+    {
+        results[q].results = merge_top_k(std::move(found[q]), k);
+        results[q].shards_queried = shards.size();
+        results[q].shards_answered = answered;
+        results[q].retries = retries;
+    }
+    if (stale)
+        drop_stats(std::move(global));
+    return results;
+}
+
+// Writes are synchronous, so a slow replica holds up the rest of the
+// stream; for bulk loads that is the back pressure wanted. A replica whose
+// stream broke gets no more documents, and its error is reported at the end.
+grpc::Status SearchCoordinator::index(const std::function<bool(Document &)> &next,
+                                      IndexResponse *response)
+{
+    struct Stream
+    {
+        grpc::ClientContext context;
+        IndexResponse response;
+        std::unique_ptr<grpc::ClientWriter<Document>> writer;
+        bool open = true;
+    };
+    // Opened on a shard's first document.
+    std::vector<std::vector<std::unique_ptr<Stream>>> streams(shards.size());
+
+    Document document;
+    while (next(document))
+    {
+        size_t i = shard_index(document.doc_id());
+        if (streams[i].empty())
+        {
+            for (const auto &replica : shards[i]->replicas)
+            {
+                auto stream = std::make_unique<Stream>();
+                stream->writer = replica->stub->Index(&stream->context, &stream->response);
+                streams[i].push_back(std::move(stream));
+            }
+        }
+        for (auto &stream : streams[i])
+            if (stream->open)
+                stream->open = stream->writer->Write(document);
+    }
+
+    grpc::Status status;
+    for (auto &replicas : streams)
+    {
+        bool counted = false;
+        for (auto &stream : replicas)
+        {
+            if (stream->open)
+                stream->writer->WritesDone();
+            grpc::Status finished = stream->writer->Finish();
+            if (!finished.ok())
+            {
+                if (status.ok())
+                    status = finished;
+                continue;
+            }
+            if (!counted)
+            {
+                response->set_indexed(response->indexed() + stream->response.indexed());
+                response->set_deleted(response->deleted() + stream->response.deleted());
+                counted = true;
+            }
+        }
+    }
+    return status;
+}
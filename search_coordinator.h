@@ -0,0 +1,160 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "consistent_hash.h"
+#include "search.grpc.pb.h"
+
+// Scatter-gather over the shard servers of a sharded index. Documents are
+// placed on shards by a ConsistentHash of their id; a query can match on
+// any of them, so search() sends it to every shard at once over async gRPC
+// and merges the per-shard top k lists in a heap.
+//
+// Shards score against collection statistics summed over all of them, so
+// their lists are comparable. The coordinator caches the sums for the
+// shard generations it gathered them at, with the df of every term queried
+// since, and ships them with each query; only a query with a term not seen
+// yet pays for a statistics round trip first. A response from a newer
+// shard generation drops the cache.
+//
+// Every shard call carries the query's deadline. A shard that has not
+// answered by then is cancelled and left out, and the result reports how
+// many shards answered, so one slow or unreachable shard costs recall
+// rather than latency.
+//
+// A shard may be served by several replicas. Each call goes to the replica
+// with the lowest latency EWMA. If it has not answered once the shard's
+// recent latencies put it past `hedge_percentile`, the request is also
+// sent to the next replica; the first answer wins and the other call is
+// cancelled. A replica that fails is retried on the next one at once.
+// Latencies of replicas not picked decay slowly, so a replica that was
+// slow once is tried again later instead of being shunned for good.
+//
+// search_batch() sends all its queries to each shard in one request, and
+// index() streams documents to the shards that own them.
+class SearchCoordinator
+{
+public:
+    struct Options
+    {
+        // Covers the statistics round trip too, when one is needed.
+        std::chrono::milliseconds deadline{100};
+        // 0 disables hedging.
+        double hedge_percentile = 0.95;
+        // Lower limit of the hedge delay, so noise on a fast shard does
+        // not double its load.
+        std::chrono::microseconds min_hedge_delay{500};
+        // How shard_for() places documents. shard_for() must find a doc
+        // again without remembering it, so load_factor has to stay 0.
+        ConsistentHash::Options placement;
+    };
+
+    struct Result
+    {
+        std::vector<std::pair<uint32_t, double>> results;
+        size_t shards_queried = 0;
+        size_t shards_answered = 0;
+        // Requests sent to a second replica, hedged or after a failure.
+        size_t retries = 0;
+
+        bool partial() const { return shards_answered < shards_queried; }
+    };
+
+    // `shards` are gRPC addresses, e.g. "127.0.0.1:50051".
+    explicit SearchCoordinator(const std::vector<std::string> &shards);
+    SearchCoordinator(const std::vector<std::string> &shards, Options options);
+    // The addresses of every shard's replicas, in no particular order.
+    SearchCoordinator(const std::vector<std::vector<std::string>> &replicas, Options options);
+
+    // Thread-safe; each call uses its own completion queues.
+    Result search(const std::string &query, int k);
+    // Also calls `on_progress`, on the calling thread, with the results
+    // merged so far each time a shard answers.
+    Result search(const std::string &query, int k,
+                  const std::function<void(const Result &)> &on_progress);
+    // One request per shard carries every query, and one statistics round
+    // trip covers the terms of all of them. Results are in query order.
+    std::vector<Result> search_batch(const std::vector<std::string> &queries, int k);
+    // Streams the documents `next` yields, until it returns false, to every
+    // replica of the shard that owns each one, over one client stream per
+    // replica. Counts are summed over shards from their first replica to
+    // answer; the status is that of the first stream that failed.
+    grpc::Status index(const std::function<bool(Document &)> &next, IndexResponse *response);
+    // First replica address of the shard that holds `doc_id`.
+    std::string shard_for(uint32_t doc_id);
+
+    static constexpr double EWMA_WEIGHT = 0.2;
+    // Applied to every replica passed over by a call.
+    static constexpr double SKIPPED_DECAY = 0.01;
+    // Latencies per shard the hedge delay is taken from.
+    static constexpr size_t LATENCY_WINDOW = 256;
+
+private:
+    struct Replica
+    {
+        std::string address;
+        std::unique_ptr<SearchService::Stub> stub;
+        // Smoothed latency in microseconds; 0 until the first answer, so
+        // new replicas are tried first. Updates may race and lose one
+        // sample, which the average absorbs.
+        std::atomic<double> latency{0};
+
+        void record(double micros);
+    };
+
+    struct Shard
+    {
+        std::vector<std::unique_ptr<Replica>> replicas;
+        // Recent answer latencies in microseconds, as a ring.
+        std::mutex mutex;
+        std::vector<double> latencies;
+        size_t next_latency = 0;
+
+        // Replica indexes, lowest latency first; decays the others.
+        std::vector<size_t> rank_replicas();
+        void record(double micros);
+        // Microseconds; infinite while there are too few latencies.
+        double percentile(double p);
+    };
+
+    template <typename Response, typename Prepare, typename OnReply>
+    size_t scatter(std::chrono::system_clock::time_point deadline, Prepare prepare,
+                   OnReply on_reply);
+
+    // Statistics summed over all shards at `generations` (by shard).
+    struct GlobalStats
+    {
+        std::vector<uint64_t> generations;
+        IndexStats stats;
+    };
+
+    std::shared_ptr<const GlobalStats> gather_stats(
+        const std::vector<std::string> &terms, std::shared_ptr<const GlobalStats> cached,
+        std::chrono::system_clock::time_point deadline);
+    // Copies into `stats` the global statistics for the terms of `queries`,
+    // gathering those not cached yet. Returns the statistics used, or null
+    // (leaving `stats` alone) if they could not be gathered.
+    std::shared_ptr<const GlobalStats> query_stats(const std::vector<std::string> &queries,
+                                                   std::chrono::system_clock::time_point deadline,
+                                                   IndexStats *stats);
+    // Drops `global` from the cache after a shard answered from another
+    // generation, unless it was replaced already.
+    void drop_stats(std::shared_ptr<const GlobalStats> global);
+    size_t shard_index(uint32_t doc_id);
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    ConsistentHash ring;
+    // Shard index by the first replica address, as the ring names shards.
+    std::unordered_map<std::string, size_t> shard_ids;
+    Options options;
+    // Read and replaced with std::atomic_load/atomic_store; null until the
+    // first query and after a shard moves to a new generation.
+    std::shared_ptr<const GlobalStats> global_stats;
+};
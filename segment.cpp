@@ -0,0 +1,55 @@
+#include "segment.h"
+#include <algorithm>
+#include <map>
+
+size_t TieredMergePolicy::tier(size_t doc_count) const
+{
+    size_t tier = 0;
+    size_t limit = std::max<size_t>(1, floor_docs);
+    size_t factor = std::max<size_t>(2, merge_factor);
+    while (doc_count > limit)
+    {
+        tier++;
+        limit *= factor;
+    }
+    return tier;
+}
+
+std::vector<size_t> TieredMergePolicy::select(const std::vector<size_t> &doc_counts,
+                                              const std::vector<size_t> &deleted,
+                                              const std::vector<bool> &busy) const
+{
+    size_t factor = std::max<size_t>(2, merge_factor);
+    std::map<size_t, std::vector<size_t>> tiers;
+    for (size_t i = 0; i < doc_counts.size(); i++)
+    {
+        if (!busy[i])
+            tiers[tier(doc_counts[i] - deleted[i])].push_back(i);
+    }
+
+    for (auto &[level, members] : tiers)
+    {
+        if (members.size() < factor)
+            continue;
+        std::sort(members.begin(), members.end(),
+                  [&](size_t a, size_t b)
+                  { return doc_counts[a] - deleted[a] < doc_counts[b] - deleted[b]; });
+        members.resize(factor);
+        return members;
+    }
+
+    long worst = -1;
+    double worst_ratio = max_deleted_ratio;
+    for (size_t i = 0; i < doc_counts.size(); i++)
+    {
+        double ratio = doc_counts[i] == 0 ? 0 : static_cast<double>(deleted[i]) / doc_counts[i];
+        if (!busy[i] && ratio > worst_ratio)
+        {
+            worst = i;
+            worst_ratio = ratio;
+        }
+    }
+    if (worst >= 0)
+        return {static_cast<size_t>(worst)};
+    return {};
+}
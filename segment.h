@@ -0,0 +1,115 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "bm25.h"
+#include "frozen_index.h"
+#include "query_evaluator.h"
+
+// An immutable, searchable part of the index. Segments are created by
+// flushing IndexEngine's write buffer and by merging smaller segments, and
+// are never modified afterwards. Quantized impacts, when enabled, are
+// computed against the collection statistics at creation; once those
+// drift too far the engine replaces the segment with one whose impacts
+// are rebuilt. In between, quantized scores are relative to the
+// statistics the segment was built with.
+struct Segment
+{
+    uint64_t id = 0;
+    FrozenIndex index;
+    QuantizedImpacts impacts;
+    // Collection doc count and total length, deleted docs included, that
+    // the impacts were built with.
+    uint64_t impact_docs = 0;
+    uint64_t impact_length = 0;
+};
+
+// Tombstones of a segment's deleted documents, by ordinal. Copied on
+// write: each delete publishes a new set, so snapshots already handed out
+// never change. Deleted postings stay in the segment until a merge drops
+// them.
+struct DeletedDocs
+{
+    std::vector<uint64_t> bits;
+    uint32_t count = 0;
+    // Summed length of the deleted documents.
+    uint64_t doc_length = 0;
+
+    explicit DeletedDocs(uint32_t doc_count) : bits((doc_count + 63) / 64) {}
+
+    bool contains(uint32_t ordinal) const { return bits[ordinal >> 6] >> (ordinal & 63) & 1; }
+    void add(uint32_t ordinal, uint32_t length)
+    {
+        bits[ordinal >> 6] |= uint64_t(1) << (ordinal & 63);
+        count++;
+        doc_length += length;
+    }
+};
+
+// What one search sees: the segment list as of one generation, collection
+// statistics over all of it, the settings results depend on, and
+// per-segment state that depends on those statistics or on PageRank.
+// Published whole and swapped atomically, so a search never observes a
+// half-applied flush or merge.
+struct IndexSnapshot
+{
+    struct Part
+    {
+        std::shared_ptr<const Segment> segment;
+        // PageRank by doc ordinal of the segment.
+        std::shared_ptr<const std::vector<double>> ranks;
+        // Filled lazily by searches; only valid for this snapshot's stats.
+        std::shared_ptr<ScoreBounds> bounds;
+        // Null when the segment has no deletions.
+        std::shared_ptr<const DeletedDocs> deleted;
+
+        bool live(long ordinal) const
+        {
+            return ordinal >= 0 && !(deleted && deleted->contains(ordinal));
+        }
+    };
+
+    std::vector<Part> parts;
+    // Live documents only.
+    uint64_t doc_count = 0;
+    uint64_t total_doc_length = 0;
+    // Deleted documents whose postings are still in some segment. Document
+    // frequencies keep counting them until they are merged away, so idf
+    // uses doc_count + deleted_count as N to stay consistent with them.
+    uint64_t deleted_count = 0;
+    uint64_t generation = 0;
+    uint64_t ranks_version = 0;
+    uint64_t settings_version = 0;
+    BM25 bm25;
+    double tier_guarantee = 1.0;
+
+    double avg_doc_length() const
+    {
+        return doc_count == 0 ? 0 : static_cast<double>(total_doc_length) / doc_count;
+    }
+};
+
+// Groups segments into tiers by live doc count, each tier `merge_factor`
+// times larger than the one below it, starting at `floor_docs`. Once a tier
+// holds `merge_factor` segments that are not already being merged, they
+// are merged into one segment of the next tier, so the segment count stays
+// logarithmic in the index size and each doc is rewritten about
+// log(N / floor_docs) times. Otherwise the segment with the largest share
+// of deleted docs above `max_deleted_ratio` is rewritten on its own to
+// reclaim them.
+struct TieredMergePolicy
+{
+    size_t merge_factor = 10;
+    size_t floor_docs = 1000;
+    double max_deleted_ratio = 0.3;
+
+    size_t tier(size_t doc_count) const;
+    // Indexes into `doc_counts` of the segments to merge next, smallest
+    // tier first; empty when there is nothing to do. `deleted` counts each
+    // segment's deleted docs (included in `doc_counts`) and `busy` marks
+    // segments that are already part of a running merge.
+    std::vector<size_t> select(const std::vector<size_t> &doc_counts,
+                               const std::vector<size_t> &deleted,
+                               const std::vector<bool> &busy) const;
+};
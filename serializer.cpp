@@ -1,4 +1,6 @@
 #include "serializer.h"
+#include "block_codec.h"
+#include <algorithm>
 #include <fstream>
 
 void Serializer::save_index(
@@ -16,6 +18,9 @@ void Serializer::save_index(
     size_t index_size = index.size();
     out.write(reinterpret_cast<const char *>(&index_size), sizeof(index_size));
 
+    std::vector<uint8_t> encoded;
+    uint32_t docs[POSTING_BLOCK_SIZE], freqs[POSTING_BLOCK_SIZE];
+
     for (const auto &[term, postings] : index)
     {
         size_t term_size = term.size();
@@ -25,11 +30,27 @@ void Serializer::save_index(
         size_t postings_size = postings.size();
         out.write(reinterpret_cast<const char *>(&postings_size), sizeof(postings_size));
 
-        for (const auto &posting : postings)
+        // Doc-id sorted, delta-coded blocks of POSTING_BLOCK_SIZE postings.
+        std::vector<Posting> sorted = postings;
+        std::sort(sorted.begin(), sorted.end(),
+                  [](const Posting &a, const Posting &b)
+                  { return a.doc_id < b.doc_id; });
+
+        encoded.clear();
+        for (size_t start = 0; start < sorted.size(); start += POSTING_BLOCK_SIZE)
         {
-            out.write(reinterpret_cast<const char *>(&posting.doc_id), sizeof(posting.doc_id));
-            out.write(reinterpret_cast<const char *>(&posting.term_freq), sizeof(posting.term_freq));
+            size_t count = std::min(POSTING_BLOCK_SIZE, sorted.size() - start);
+            for (size_t i = 0; i < count; i++)
+            {
+                docs[i] = sorted[start + i].doc_id;
+                freqs[i] = sorted[start + i].term_freq;
+            }
+            BlockCodec::encode_block(docs, freqs, count, encoded);
         }
+
+        size_t encoded_size = encoded.size();
+        out.write(reinterpret_cast<const char *>(&encoded_size), sizeof(encoded_size));
+        out.write(reinterpret_cast<const char *>(encoded.data()), encoded_size);
     }
 
     size_t doc_len_size = doc_lengths.size();
@@ -57,6 +78,9 @@ void Serializer::load_index(
     size_t index_size;
     in.read(reinterpret_cast<char *>(&index_size), sizeof(index_size));
 
+    std::vector<uint8_t> encoded;
+    uint32_t docs[POSTING_BLOCK_SIZE], freqs[POSTING_BLOCK_SIZE];
+
     for (size_t i = 0; i < index_size; i++)
     {
         size_t term_size;
@@ -68,15 +92,23 @@ void Serializer::load_index(
         size_t postings_size;
         in.read(reinterpret_cast<char *>(&postings_size), sizeof(postings_size));
 
-        std::vector<Posting> postings(postings_size);
+        size_t encoded_size;
+        in.read(reinterpret_cast<char *>(&encoded_size), sizeof(encoded_size));
+
+        encoded.assign(encoded_size + BlockCodec::PADDING, 0);
+        in.read(reinterpret_cast<char *>(encoded.data()), encoded_size);
 
-        for (size_t j = 0; j < postings_size; j++)
+        std::vector<Posting> postings(postings_size);
+        size_t offset = 0;
+        for (size_t start = 0; start < postings_size; start += POSTING_BLOCK_SIZE)
         {
-            in.read(reinterpret_cast<char *>(&postings[j].doc_id), sizeof(uint32_t));
-            in.read(reinterpret_cast<char *>(&postings[j].term_freq), sizeof(uint32_t));
+            size_t count = std::min(POSTING_BLOCK_SIZE, postings_size - start);
+            offset += BlockCodec::decode_block(encoded.data() + offset, count, docs, freqs);
+            for (size_t j = 0; j < count; j++)
+                postings[start + j] = {docs[j], freqs[j]};
         }
 
-        index[term] = postings;
+        index[term] = std::move(postings);
     }
 
     size_t doc_len_size;
@@ -0,0 +1,67 @@
+#include "term_dictionary.h"
+#include <cstring>
+#include <mutex>
+
+uint32_t TermDictionary::intern(std::string_view term)
+{
+    size_t hash = std::hash<std::string_view>{}(term);
+    uint32_t shard_index = hash & ((1u << SHARD_BITS) - 1);
+    Shard &shard = shards[shard_index];
+
+    {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.ids.find(term);
+        if (it != shard.ids.end())
+            return it->second;
+    }
+
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    auto it = shard.ids.find(term);
+    if (it != shard.ids.end())
+        return it->second;
+
+    char *text;
+    if (term.size() > CHUNK_SIZE / 4)
+    {
+        shard.chunks.emplace_back(new char[term.size()]);
+        text = shard.chunks.back().get();
+        // Keep filling the previous chunk; swap the dedicated one behind it.
+        if (shard.chunks.size() > 1)
+            std::swap(shard.chunks.back(), shard.chunks[shard.chunks.size() - 2]);
+    }
+    else
+    {
+        if (shard.chunk_used + term.size() > CHUNK_SIZE)
+        {
+            shard.chunks.emplace_back(new char[CHUNK_SIZE]);
+            shard.chunk_used = 0;
+        }
+        text = shard.chunks.back().get() + shard.chunk_used;
+        shard.chunk_used += term.size();
+    }
+    std::memcpy(text, term.data(), term.size());
+
+    uint32_t id = static_cast<uint32_t>(shard.terms.size() << SHARD_BITS) | shard_index;
+    std::string_view stored(text, term.size());
+    shard.terms.push_back(stored);
+    shard.ids.emplace(stored, id);
+    return id;
+}
+
+std::string_view TermDictionary::term(uint32_t id) const
+{
+    const Shard &shard = shards[id & ((1u << SHARD_BITS) - 1)];
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    return shard.terms[id >> SHARD_BITS];
+}
+
+size_t TermDictionary::size() const
+{
+    size_t total = 0;
+    for (const Shard &shard : shards)
+    {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        total += shard.terms.size();
+    }
+    return total;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Thread-safe interning of term text to 32-bit ids, shared by every worker
+// that indexes into one IndexEngine. The table is split into shards by term
+// hash, each behind a shared_mutex, so concurrent lookups of known terms do
+// not serialize. An id is (index within shard << SHARD_BITS) | shard; ids
+// and the views returned by term() stay valid for the dictionary's lifetime.
+class TermDictionary
+{
+public:
+    TermDictionary() = default;
+    TermDictionary(const TermDictionary &) = delete;
+    TermDictionary &operator=(const TermDictionary &) = delete;
+
+    uint32_t intern(std::string_view term);
+    std::string_view term(uint32_t id) const;
+    size_t size() const;
+
+private:
+    static constexpr uint32_t SHARD_BITS = 6;
+    static constexpr size_t CHUNK_SIZE = 64 << 10;
+
+    struct Shard
+    {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<std::string_view, uint32_t> ids;
+        std::vector<std::string_view> terms;
+        // Term text lives in fixed chunks so views never move.
+        std::vector<std::unique_ptr<char[]>> chunks;
+        size_t chunk_used = CHUNK_SIZE;
+    };
+
+    std::array<Shard, size_t(1) << SHARD_BITS> shards;
+};
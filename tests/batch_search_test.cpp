@@ -0,0 +1,67 @@
+// search_batch() must return, for every query, exactly what search()
+// returns for it alone, including repeated queries and shared terms.
+#include "check.h"
+#include "index_engine.h"
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+
+int main()
+{
+    IndexEngine engine;
+    engine.set_cache_enabled(false);
+
+    std::mt19937 rng(5);
+    std::vector<std::pair<uint32_t, std::string>> docs;
+    for (uint32_t doc_id = 0; doc_id < 30000; doc_id++)
+    {
+        std::string text;
+        int length = 5 + rng() % 30;
+        for (int i = 0; i < length; i++)
+        {
+            double u = (rng() % 100000 + 1) / 100000.0;
+            text += "w" + std::to_string(int(std::pow(u, -1.2)) % 5000) + " ";
+        }
+        docs.push_back({doc_id, text});
+    }
+    engine.add_documents(docs);
+    engine.refresh();
+    for (uint32_t doc_id = 0; doc_id < 30000; doc_id += 97)
+        engine.delete_document(doc_id);
+    engine.add_documents({docs.begin(), docs.begin() + 2000});
+    engine.refresh();
+
+    std::mt19937 query_rng(3);
+    std::vector<std::string> queries;
+    for (int i = 0; i < 300; i++)
+        queries.push_back("w" + std::to_string(8 + query_rng() % 20) +
+                          " w" + std::to_string(200 + query_rng() % 300) +
+                          " W" + std::to_string(300 + query_rng() % 40));
+    queries.push_back(queries[3]);
+    queries.push_back("");
+    queries.push_back("unknownterm");
+
+    CollectionStats stats = engine.collection_stats({});
+    stats.version = 77;
+    stats.doc_count += 1000;
+    stats.total_doc_length += 5000;
+    stats.live_doc_count += 1000;
+
+    for (SearchMode mode : {SearchMode::Exhaustive, SearchMode::Wand, SearchMode::BlockMaxWand})
+    {
+        for (int k : {1, 10})
+        {
+            auto batch = engine.search_batch(queries, k, mode);
+            CHECK(batch.size() == queries.size());
+            for (size_t i = 0; i < queries.size(); i++)
+                CHECK(batch[i] == engine.search(queries[i], k, mode));
+
+            auto global = engine.search_batch(queries, k, mode, &stats);
+            CHECK(global.size() == queries.size());
+            for (size_t i = 0; i < queries.size(); i++)
+                CHECK(global[i] == engine.search(queries[i], k, mode, stats));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,63 @@
+// Every decode kernel the CPU supports must reproduce exactly what was
+// encoded, and consume exactly the encoded bytes, for any block length
+// and any mix of 1- to 4-byte values.
+#include "block_codec.h"
+#include "check.h"
+#include <random>
+#include <vector>
+
+namespace
+{
+    // Gaps and frequencies drawn across all four Stream VByte lengths.
+    uint32_t draw(std::mt19937 &rng)
+    {
+        static const uint32_t limits[] = {1u << 8, 1u << 16, 1u << 24, 1u << 30};
+        return rng() % limits[rng() % 4];
+    }
+}
+
+int main()
+{
+    std::mt19937 rng(3);
+    std::vector<std::vector<uint32_t>> docs, freqs;
+    std::vector<uint8_t> encoded;
+    for (size_t count = 1; count <= 128; count++)
+    {
+        std::vector<uint32_t> d(count), f(count);
+        uint32_t doc = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            doc += draw(rng) / 4 + (i > 0);
+            d[i] = doc;
+            f[i] = 1 + draw(rng);
+        }
+        BlockCodec::encode_block(d.data(), f.data(), count, encoded);
+        docs.push_back(d);
+        freqs.push_back(f);
+    }
+    size_t encoded_size = encoded.size();
+    encoded.resize(encoded_size + BlockCodec::PADDING);
+
+    BlockCodec::Kernel initial = BlockCodec::active_kernel();
+    size_t kernels = 0;
+    for (BlockCodec::Kernel kernel :
+         {BlockCodec::Kernel::Scalar, BlockCodec::Kernel::Ssse3, BlockCodec::Kernel::Avx2})
+    {
+        if (!BlockCodec::set_kernel(kernel))
+            continue;
+        kernels++;
+        size_t offset = 0;
+        for (size_t b = 0; b < docs.size(); b++)
+        {
+            size_t count = docs[b].size();
+            std::vector<uint32_t> d(count), f(count);
+            offset += BlockCodec::decode_block(encoded.data() + offset, count, d.data(), f.data());
+            CHECK(d == docs[b]);
+            CHECK(f == freqs[b]);
+        }
+        CHECK(offset == encoded_size);
+    }
+    CHECK(kernels >= 1);
+    BlockCodec::set_kernel(initial);
+    return 0;
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include <cstdlib>
+#include <iostream>
+
+// Assertion for the test executables: reports the failed condition and
+// exits non-zero, which ctest counts as a failure.
+#define CHECK(cond)                                                       \
+    do                                                                    \
+    {                                                                     \
+        if (!(cond))                                                      \
+        {                                                                 \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK failed: " \
+                      << #cond << std::endl;                              \
+            std::exit(1);                                                 \
+        }                                                                 \
+    } while (0)
@@ -0,0 +1,115 @@
+// W-TinyLFU behaviour of ConcurrentCache: the byte budget holds, a scan of
+// one-off keys does not evict a frequently requested working set, values
+// are replaced in place, and the admission sketch separates hot from cold
+// keys.
+#include "check.h"
+#include "concurrent_cache.h"
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    using Cache = ConcurrentCache<int, std::string>;
+
+    Cache make_cache(size_t capacity, size_t shards)
+    {
+        return Cache(capacity, [](const int &, const std::string &value)
+                     { return value.size(); }, shards);
+    }
+}
+
+int main()
+{
+    // The budget holds whatever is put, on every shard count.
+    for (size_t shards : {1, 4, 16})
+    {
+        Cache cache = make_cache(64 << 10, shards);
+        for (int key = 0; key < 20000; key++)
+            cache.put(key, std::string(100 + key % 900, 'x'));
+        CHECK(cache.stats().bytes <= (64 << 10));
+        CHECK(cache.stats().entries > 0);
+    }
+
+    // Scan resistance: 100 hot keys requested repeatedly keep their place
+    // while 20000 one-off keys stream through.
+    {
+        Cache cache = make_cache(100 << 10, 1);
+        std::string value(1 << 10, 'v');
+        for (int round = 0; round < 10; round++)
+            for (int key = 0; key < 80; key++)
+            {
+                std::string found;
+                if (!cache.get(key, found))
+                    cache.put(key, value);
+            }
+        for (int key = 1000; key < 21000; key++)
+        {
+            std::string found;
+            cache.get(key, found);
+            cache.put(key, value);
+            if (key % 200 == 0)
+                for (int hot = 0; hot < 80; hot++)
+                    cache.get(hot, found);
+        }
+        int kept = 0;
+        std::string found;
+        for (int key = 0; key < 80; key++)
+            kept += cache.get(key, found);
+        CHECK(kept >= 75);
+        CHECK(cache.frequency(1) > cache.frequency(20500));
+    }
+
+    // Replacing a value, then replacing it with one too large to admit,
+    // which must also drop the old value.
+    {
+        Cache cache = make_cache(1000, 1);
+        std::string found;
+        cache.put(1, "small");
+        cache.put(1, "smaller!");
+        CHECK(cache.get(1, found) && found == "smaller!");
+        CHECK(cache.stats().entries == 1 && cache.stats().bytes == 8);
+        cache.put(1, std::string(2000, 'x'));
+        CHECK(!cache.get(1, found));
+        CHECK(cache.stats().entries == 0 && cache.stats().bytes == 0);
+        cache.put(2, "value");
+        cache.clear();
+        CHECK(!cache.get(2, found));
+    }
+
+    // The sketch's rows hash independently: with 200 keys counted in a
+    // 64-counter-wide sketch a single row would put about 3 on every
+    // unseen key, while the minimum over independent rows stays well
+    // below that.
+    {
+        Cache cache = make_cache(64 << 10, 1);
+        for (int key = 0; key < 200; key++)
+            cache.put(key, "x");
+        double total = 0;
+        for (int key = 100000; key < 101000; key++)
+            total += cache.frequency(key);
+        CHECK(total / 1000 < 2.0);
+    }
+
+    // Concurrent use across shards keeps the accounting consistent.
+    {
+        Cache cache = make_cache(256 << 10, 8);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; t++)
+            threads.emplace_back([&cache, t]
+                                 {
+                std::string found;
+                for (int i = 0; i < 20000; i++)
+                {
+                    int key = (i * 7 + t) % 3000;
+                    if (!cache.get(key, found))
+                        cache.put(key, std::string(64 + key % 64, 'c'));
+                } });
+        for (auto &thread : threads)
+            thread.join();
+        auto stats = cache.stats();
+        CHECK(stats.hits + stats.misses == 80000);
+        CHECK(stats.bytes <= (256 << 10));
+    }
+    return 0;
+}
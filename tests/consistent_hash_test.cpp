@@ -0,0 +1,88 @@
+// Adding a node must move only the keys that now land on it, and about
+// its share of them; removing a node must move only the keys it held.
+#include "check.h"
+#include "consistent_hash.h"
+#include <cmath>
+#include <string>
+#include <vector>
+
+namespace
+{
+    constexpr size_t KEYS = 100000;
+
+    std::vector<std::string> place(const ConsistentHash &ring)
+    {
+        std::vector<std::string> owners;
+        for (size_t key = 0; key < KEYS; key++)
+            owners.push_back(ring.get_node(std::to_string(key)));
+        return owners;
+    }
+
+    void check_add_and_remove(ConsistentHash::Mode mode, double tolerance)
+    {
+        ConsistentHash::Options options;
+        options.mode = mode;
+        ConsistentHash ring(options);
+        for (int node = 0; node < 8; node++)
+            ring.add_node("shard" + std::to_string(node));
+        std::vector<std::string> before = place(ring);
+
+        ring.add_node("shard8");
+        std::vector<std::string> after = place(ring);
+        size_t moved = 0;
+        for (size_t key = 0; key < KEYS; key++)
+        {
+            if (before[key] == after[key])
+                continue;
+            CHECK(after[key] == "shard8");
+            moved++;
+        }
+        double expected = KEYS / 9.0;
+        CHECK(std::abs(moved - expected) <= tolerance * expected);
+
+        // Jump mode can only remove the last node, which undoes the add.
+        CHECK(ring.remove_node("shard8"));
+        CHECK(place(ring) == before);
+        CHECK(!ring.remove_node("shard8"));
+    }
+
+    // Removing a node from the middle of the ring only moves its own keys.
+    void check_remove_middle()
+    {
+        ConsistentHash ring;
+        for (int node = 0; node < 8; node++)
+            ring.add_node("shard" + std::to_string(node));
+        std::vector<std::string> before = place(ring);
+        CHECK(ring.remove_node("shard3"));
+        std::vector<std::string> after = place(ring);
+        for (size_t key = 0; key < KEYS; key++)
+        {
+            CHECK(after[key] != "shard3");
+            if (before[key] != "shard3")
+                CHECK(after[key] == before[key]);
+        }
+    }
+
+    // Nodes added in any order build the same ring.
+    void check_order_independent()
+    {
+        ConsistentHash forward, backward;
+        for (int node = 0; node < 8; node++)
+        {
+            forward.add_node("shard" + std::to_string(node));
+            backward.add_node("shard" + std::to_string(7 - node));
+        }
+        CHECK(place(forward) == place(backward));
+    }
+}
+
+int main()
+{
+    // With 160 virtual nodes a ring node's share is still off by several
+    // percent; jump hashing splits evenly up to sampling noise.
+    check_add_and_remove(ConsistentHash::Mode::Ring, 0.2);
+    check_add_and_remove(ConsistentHash::Mode::Jump, 0.05);
+    check_remove_middle();
+    check_order_independent();
+    return 0;
+}
@@ -0,0 +1,91 @@
+// open() must reject a truncated or corrupt image with std::runtime_error
+// instead of serving postings from outside the mapping.
+#include "check.h"
+#include "frozen_index.h"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+namespace
+{
+    std::vector<char> read_file(const std::string &path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        return std::vector<char>(std::istreambuf_iterator<char>(in), {});
+    }
+
+    bool rejected(const std::string &path, const std::vector<char> &image)
+    {
+        std::ofstream(path, std::ios::binary | std::ios::trunc).write(image.data(), image.size());
+        try
+        {
+            FrozenIndex::open(path);
+        }
+        catch (const std::runtime_error &)
+        {
+            return true;
+        }
+        return false;
+    }
+}
+
+int main()
+{
+    namespace fs = std::filesystem;
+    fs::path dir = fs::temp_directory_path() / ("frozen_index_test." + std::to_string(getpid()));
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    std::string good = (dir / "good.idx").string();
+    std::string bad = (dir / "bad.idx").string();
+
+    std::unordered_map<std::string, std::vector<Posting>> index;
+    std::unordered_map<uint32_t, uint32_t> lengths;
+    for (uint32_t doc_id = 0; doc_id < 1000; doc_id++)
+    {
+        lengths[doc_id] = 3;
+        index["alpha"].push_back({doc_id, 1});
+        if (doc_id % 3 == 0)
+            index["beta"].push_back({doc_id, 2});
+    }
+    FrozenIndex::build(index, lengths).write(good);
+    CHECK(FrozenIndex::open(good).term_count() == 2);
+
+    std::vector<char> image = read_file(good);
+    FrozenIndex::Header header;
+    std::memcpy(&header, image.data(), sizeof(header));
+
+    for (size_t size : {size_t(0), size_t(7), sizeof(header) - 1, image.size() / 2, image.size() - 1})
+        CHECK(rejected(bad, std::vector<char>(image.begin(), image.begin() + size)));
+
+    using Mutation = std::function<void(std::vector<char> &)>;
+    auto term = [&](std::vector<char> &copy, size_t t)
+    { return reinterpret_cast<FrozenIndex::TermInfo *>(copy.data() + header.terms_offset) + t; };
+    auto skip = [&](std::vector<char> &copy, size_t b)
+    { return reinterpret_cast<FrozenIndex::SkipEntry *>(copy.data() + header.skips_offset) + b; };
+    std::vector<Mutation> mutations = {
+        [&](std::vector<char> &c) { c[0] ^= 1; },
+        [&](std::vector<char> &c) { reinterpret_cast<FrozenIndex::Header *>(c.data())->version = 99; },
+        [&](std::vector<char> &c) { reinterpret_cast<FrozenIndex::Header *>(c.data())->postings_size *= 2; },
+        [&](std::vector<char> &c) { term(c, 1)->first_block = 1000; },
+        [&](std::vector<char> &c) { term(c, 1)->text_offset = 1 << 20; },
+        [&](std::vector<char> &c) { term(c, 0)->df = 5000; },
+        [&](std::vector<char> &c) { skip(c, 1)->count = 5000; },
+        [&](std::vector<char> &c) { skip(c, 2)->offset = header.postings_size; },
+    };
+    for (const Mutation &mutate : mutations)
+    {
+        std::vector<char> copy = image;
+        mutate(copy);
+        CHECK(rejected(bad, copy));
+    }
+
+    fs::remove_all(dir);
+    return 0;
+}
@@ -0,0 +1,138 @@
+// PageRank::compute() against a direct power iteration over an adjacency
+// map, on a random graph with dangling nodes, cycles and duplicate links,
+// and refine() after graph changes against a full recompute.
+#include "check.h"
+#include "pagerank.h"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace
+{
+    using Graph = std::unordered_map<uint32_t, std::vector<uint32_t>>;
+
+    // Every doc named as a source or a target is a node; the rank of
+    // dangling nodes is spread uniformly.
+    std::unordered_map<uint32_t, double> reference_ranks(const Graph &graph, double damping)
+    {
+        std::unordered_set<uint32_t> nodes;
+        for (const auto &[from, links] : graph)
+        {
+            nodes.insert(from);
+            nodes.insert(links.begin(), links.end());
+        }
+        double n = nodes.size();
+        std::unordered_map<uint32_t, double> ranks;
+        for (uint32_t node : nodes)
+            ranks[node] = 1 / n;
+
+        for (int iteration = 0; iteration < 1000; iteration++)
+        {
+            double dangling = 0;
+            for (uint32_t node : nodes)
+            {
+                auto it = graph.find(node);
+                if (it == graph.end() || it->second.empty())
+                    dangling += ranks[node];
+            }
+            std::unordered_map<uint32_t, double> next;
+            for (uint32_t node : nodes)
+                next[node] = (1 - damping) / n + damping * dangling / n;
+            for (const auto &[from, links] : graph)
+                for (uint32_t to : links)
+                    next[to] += damping * ranks[from] / links.size();
+            double change = 0;
+            for (uint32_t node : nodes)
+                change += std::abs(next[node] - ranks[node]);
+            ranks.swap(next);
+            if (change < 1e-13)
+                break;
+        }
+        return ranks;
+    }
+
+    Graph random_graph(std::mt19937 &rng, uint32_t nodes, size_t edges)
+    {
+        Graph graph;
+        for (size_t e = 0; e < edges; e++)
+        {
+            uint32_t from = rng() % nodes;
+            // Every tenth doc only ever receives links.
+            if (from % 10 == 0)
+                from++;
+            graph[from].push_back(rng() % nodes);
+        }
+        return graph;
+    }
+
+    double distance(const PageRank &ranks, const std::unordered_map<uint32_t, double> &expected)
+    {
+        double l1 = 0;
+        for (const auto &[doc_id, rank] : expected)
+            l1 += std::abs(ranks.get_rank(doc_id) - rank);
+        return l1;
+    }
+}
+
+int main()
+{
+    std::mt19937 rng(4);
+    Graph graph = random_graph(rng, 2000, 10000);
+    auto expected = reference_ranks(graph, 0.85);
+
+    for (size_t threads : {1, 4})
+    {
+        PageRank ranks;
+        ranks.build_graph(graph);
+        ranks.compute(1000, 0.85, 1e-12, threads);
+        CHECK(ranks.node_count() == expected.size());
+        CHECK(distance(ranks, expected) < 1e-9);
+
+        auto snapshot = ranks.snapshot();
+        for (const auto &[doc_id, rank] : expected)
+            CHECK(snapshot->get_rank(doc_id) == ranks.get_rank(doc_id));
+    }
+
+    // Small changes, a recrawl, a source going dangling and new nodes,
+    // each refined in place and compared with recomputing from scratch.
+    PageRank incremental;
+    incremental.build_graph(graph);
+    incremental.compute(1000, 0.85, 1e-12);
+    auto remove_one = [&](uint32_t from, uint32_t to)
+    {
+        auto &links = graph[from];
+        links.erase(std::find(links.begin(), links.end(), to));
+        incremental.remove_edge(from, to);
+    };
+    std::vector<std::function<void()>> changes = {
+        [&] { graph[5].push_back(17); incremental.add_edge(5, 17); },
+        [&] { remove_one(5, 17); },
+        [&] { graph[33] = {1, 2, 3}; incremental.set_links(33, {1, 2, 3}); },
+        [&] { graph[41].clear(); incremental.set_links(41, {}); },
+        [&] { graph[3000].push_back(7); incremental.add_edge(3000, 7); },
+        [&] { graph[7].push_back(3001); incremental.add_edge(7, 3001); },
+    };
+    for (auto &change : changes)
+    {
+        change();
+        incremental.refine(1e-12);
+        auto recomputed = reference_ranks(graph, 0.85);
+        CHECK(incremental.node_count() == recomputed.size());
+        CHECK(distance(incremental, recomputed) < 1e-8);
+    }
+
+    // A burst of random changes at once.
+    for (int i = 0; i < 200; i++)
+    {
+        uint32_t from = 1 + rng() % 1999, to = rng() % 2000;
+        graph[from].push_back(to);
+        incremental.add_edge(from, to);
+    }
+    incremental.refine(1e-12);
+    CHECK(distance(incremental, reference_ranks(graph, 0.85)) < 1e-8);
+    return 0;
+}
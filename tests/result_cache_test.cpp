@@ -0,0 +1,96 @@
+// The result cache is keyed by index generation, so any change a search
+// could see must bypass old entries. An engine with the cache on must
+// always answer like a twin with it off, including repeated queries and
+// queries differing only in case and word order.
+#include "bm25.h"
+#include "check.h"
+#include "index_engine.h"
+#include "pagerank.h"
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+    const std::vector<std::vector<std::string>> QUERIES = {
+        {"distributed systems", "Systems DISTRIBUTED", "systems distributed unknownword"},
+        {"search engine index", "Index search ENGINE"},
+        {"w3", "W3"},
+        {"w1 w7 w12", "w12 w1 w7"},
+    };
+
+    std::string make_doc(std::mt19937 &rng)
+    {
+        static const std::vector<std::string> words = {
+            "distributed", "systems", "search", "engine", "index", "w1", "w3", "w7", "w12"};
+        std::string text;
+        int length = 3 + rng() % 10;
+        for (int i = 0; i < length; i++)
+            text += words[rng() % words.size()] + " ";
+        return text;
+    }
+
+    void check_same(IndexEngine &cached, IndexEngine &plain)
+    {
+        for (const auto &variants : QUERIES)
+        {
+            for (int k : {3, 10})
+            {
+                auto expected = plain.search(variants[0], k);
+                // The second round is served from the cache.
+                for (int round = 0; round < 2; round++)
+                    for (const std::string &query : variants)
+                        CHECK(cached.search(query, k) == expected);
+            }
+        }
+    }
+}
+
+int main()
+{
+    IndexEngine cached, plain;
+    plain.set_cache_enabled(false);
+    auto both = [&](const std::function<void(IndexEngine &)> &change)
+    {
+        change(cached);
+        change(plain);
+        check_same(cached, plain);
+    };
+
+    std::mt19937 rng(1);
+    std::vector<std::pair<uint32_t, std::string>> docs;
+    for (uint32_t doc_id = 0; doc_id < 500; doc_id++)
+        docs.push_back({doc_id, make_doc(rng)});
+    both([&](IndexEngine &e)
+         { e.add_documents(docs); e.refresh(); });
+
+    // Buffered documents are flushed by search() itself.
+    std::string added = make_doc(rng);
+    both([&](IndexEngine &e)
+         { e.add_document(1000, added); });
+    both([&](IndexEngine &e)
+         { e.delete_document(7); e.refresh(); });
+    std::string updated = make_doc(rng);
+    both([&](IndexEngine &e)
+         { e.add_document(8, updated); e.refresh(); });
+
+    BM25 params(0.9, 0.4);
+    both([&](IndexEngine &e)
+         { e.set_bm25(params); });
+
+    PageRank ranks;
+    std::unordered_map<uint32_t, std::vector<uint32_t>> links;
+    for (uint32_t doc_id = 0; doc_id < 500; doc_id++)
+        links[doc_id] = {(doc_id * 7) % 500, (doc_id + 1) % 50};
+    ranks.build_graph(links);
+    ranks.compute();
+    both([&](IndexEngine &e)
+         { e.set_pagerank(ranks); });
+
+    both([&](IndexEngine &e)
+         { e.set_static_rank_order(true); e.build(); });
+    both([&](IndexEngine &e)
+         { e.set_quantized_impacts(true); });
+    return 0;
+}
@@ -0,0 +1,105 @@
+// WAND and block-max WAND must return exactly what exhaustive DAAT scoring
+// does: the same docs, in the same order, with the same scores.
+#include "check.h"
+#include "index_engine.h"
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+    // Zipf-like term draws, so lists range from a few postings to most docs.
+    std::string make_doc(std::mt19937 &rng)
+    {
+        std::string text;
+        int length = 5 + rng() % 40;
+        for (int i = 0; i < length; i++)
+        {
+            double u = (rng() % 100000 + 1) / 100000.0;
+            text += "w" + std::to_string(int(std::pow(u, -1.2)) % 3000) + " ";
+        }
+        return text;
+    }
+
+    std::vector<std::string> make_queries(std::mt19937 &rng, size_t count)
+    {
+        std::vector<std::string> queries;
+        for (size_t i = 0; i < count; i++)
+        {
+            std::string query;
+            int terms = 1 + rng() % 4;
+            for (int t = 0; t < terms; t++)
+                query += "w" + std::to_string(rng() % (t == 0 ? 20 : 600)) + " ";
+            queries.push_back(query);
+        }
+        return queries;
+    }
+
+    // Several segments, deletions and updates, so tombstones and doc ids
+    // spread over segments are exercised as well.
+    void fill(IndexEngine &engine)
+    {
+        std::mt19937 rng(7);
+        for (uint32_t batch = 0; batch < 4; batch++)
+        {
+            std::vector<std::pair<uint32_t, std::string>> docs;
+            for (uint32_t i = 0; i < 5000; i++)
+                docs.push_back({batch * 5000 + i, make_doc(rng)});
+            engine.add_documents(docs);
+            engine.refresh();
+        }
+        for (uint32_t doc_id = 0; doc_id < 20000; doc_id += 31)
+            engine.delete_document(doc_id);
+        for (uint32_t doc_id = 1; doc_id < 20000; doc_id += 53)
+            engine.add_document(doc_id, make_doc(rng));
+        engine.refresh();
+        engine.wait_for_merges();
+    }
+
+    void check_modes_agree(IndexEngine &engine, int k)
+    {
+        std::mt19937 rng(11);
+        for (const std::string &query : make_queries(rng, 200))
+        {
+            auto exhaustive = engine.search(query, k, SearchMode::Exhaustive);
+            for (SearchMode mode : {SearchMode::Wand, SearchMode::BlockMaxWand})
+            {
+                auto pruned = engine.search(query, k, mode);
+                CHECK(pruned.size() == exhaustive.size());
+                for (size_t i = 0; i < pruned.size(); i++)
+                {
+                    CHECK(pruned[i].first == exhaustive[i].first);
+                    CHECK(std::abs(pruned[i].second - exhaustive[i].second) <=
+                          1e-9 * std::max(1.0, std::abs(exhaustive[i].second)));
+                }
+            }
+        }
+    }
+}
+
+int main()
+{
+    {
+        IndexEngine engine;
+        engine.set_cache_enabled(false);
+        fill(engine);
+        for (int k : {1, 10, 100})
+            check_modes_agree(engine, k);
+    }
+    {
+        IndexEngine engine;
+        engine.set_cache_enabled(false);
+        engine.set_quantized_impacts(true);
+        fill(engine);
+        check_modes_agree(engine, 10);
+    }
+    {
+        IndexEngine engine;
+        engine.set_cache_enabled(false);
+        engine.set_intra_query_parallelism(4, 1);
+        fill(engine);
+        check_modes_agree(engine, 10);
+    }
+    return 0;
+}
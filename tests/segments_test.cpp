@@ -0,0 +1,71 @@
+// Near-real-time visibility: with a background refresh interval, adds,
+// deletes and updates show up together at the next refresh, never through
+// a publish in between such as a finished background merge.
+#include "bm25.h"
+#include "check.h"
+#include "index_engine.h"
+#include <algorithm>
+#include <chrono>
+#include <string>
+
+namespace
+{
+    bool found(IndexEngine &engine, const std::string &query, uint32_t doc_id)
+    {
+        auto results = engine.search(query, 1000);
+        return std::any_of(results.begin(), results.end(), [&](const auto &result)
+                           { return result.first == doc_id; });
+    }
+}
+
+int main()
+{
+    IndexEngine engine;
+    engine.set_cache_enabled(false);
+    engine.set_refresh_interval(std::chrono::hours(1));
+    TieredMergePolicy no_merges;
+    no_merges.merge_factor = 1000;
+    engine.set_merge_policy(no_merges);
+
+    for (uint32_t segment = 0; segment < 4; segment++)
+    {
+        for (uint32_t i = 0; i < 50; i++)
+        {
+            uint32_t doc_id = segment * 50 + i;
+            engine.add_document(doc_id, "original text " + std::to_string(doc_id));
+        }
+        engine.refresh();
+    }
+    CHECK(engine.get_snapshot()->parts.size() == 4);
+    CHECK(engine.total_docs() == 200);
+
+    engine.delete_document(3);
+    engine.add_document(5, "replaced words");
+    engine.add_document(999, "brand new words");
+    CHECK(!engine.delete_document(3));
+
+    // Publishes without a refresh: a background merge and new settings.
+    TieredMergePolicy eager;
+    eager.merge_factor = 2;
+    engine.set_merge_policy(eager);
+    engine.wait_for_merges();
+    engine.set_bm25(BM25());
+    CHECK(engine.get_snapshot()->parts.size() < 4);
+
+    CHECK(engine.total_docs() == 200);
+    CHECK(engine.has_document(3));
+    CHECK(found(engine, "3", 3));
+    CHECK(found(engine, "original 5", 5));
+    CHECK(!found(engine, "replaced", 5));
+    CHECK(!engine.has_document(999));
+
+    engine.refresh();
+    engine.wait_for_merges();
+    CHECK(engine.total_docs() == 200);
+    CHECK(!engine.has_document(3));
+    CHECK(!found(engine, "3", 3));
+    CHECK(!found(engine, "5", 5));
+    CHECK(found(engine, "replaced", 5));
+    CHECK(found(engine, "brand", 999));
+    return 0;
+}
@@ -0,0 +1,109 @@
+// ThreadPool: batches of every size relative to the worker count run each
+// task exactly once, futures carry results and exceptions, parallel_for
+// nests inside tasks, and destruction drains the queue and returns.
+#include "check.h"
+#include "thread_pool.h"
+#include <atomic>
+#include <stdexcept>
+#include <unistd.h>
+#include <vector>
+
+int main()
+{
+    // A hang (a worker spinning or never woken) fails instead of blocking.
+    alarm(120);
+
+    for (size_t workers = 1; workers <= 8; workers++)
+    {
+        for (size_t batch = 1; batch <= 3 * workers + 1; batch++)
+        {
+            std::vector<std::atomic<int>> runs(batch);
+            {
+                ThreadPool pool(workers);
+                std::vector<std::function<void()>> tasks;
+                for (size_t i = 0; i < batch; i++)
+                    tasks.push_back([&runs, i]
+                                    { runs[i]++; });
+                pool.enqueue_batch(std::move(tasks));
+                pool.wait();
+                for (auto &count : runs)
+                    CHECK(count == 1);
+
+                // From inside a task the batch lands on the worker's deque.
+                pool.submit([&]
+                            {
+                    std::vector<std::function<void()>> nested;
+                    for (size_t i = 0; i < batch; i++)
+                        nested.push_back([&runs, i]
+                                         { runs[i]++; });
+                    pool.enqueue_batch(std::move(nested)); })
+                    .get();
+                pool.wait();
+                for (auto &count : runs)
+                    CHECK(count == 2);
+            }
+        }
+    }
+
+    {
+        ThreadPool pool(4);
+        CHECK(pool.submit([]
+                          { return 42; })
+                  .get() == 42);
+        auto failing = pool.submit([]() -> int
+                                   { throw std::runtime_error("task failed"); });
+        bool thrown = false;
+        try
+        {
+            failing.get();
+        }
+        catch (const std::runtime_error &)
+        {
+            thrown = true;
+        }
+        CHECK(thrown);
+
+        // parallel_for from a task must not deadlock on the busy pool.
+        std::atomic<long> sum{0};
+        std::vector<std::future<void>> outer;
+        for (int t = 0; t < 8; t++)
+            outer.push_back(pool.submit([&]
+                                        { pool.parallel_for(0, 1000, [&](size_t i)
+                                                            { sum += i; }); }));
+        for (auto &done : outer)
+            done.get();
+        CHECK(sum == 8 * 999 * 1000 / 2);
+
+        bool rethrown = false;
+        try
+        {
+            pool.parallel_for(0, 100, [](size_t i)
+                              { if (i == 50) throw std::runtime_error("body failed"); });
+        }
+        catch (const std::runtime_error &)
+        {
+            rethrown = true;
+        }
+        CHECK(rethrown);
+    }
+
+    // Tasks still queued at destruction run before it returns.
+    std::atomic<int> drained{0};
+    {
+        ThreadPool pool(2);
+        for (int i = 0; i < 1000; i++)
+            pool.enqueue([&]
+                         { drained++; });
+    }
+    CHECK(drained == 1000);
+
+    ThreadPool::Options pinned;
+    pinned.pin_threads = true;
+    {
+        ThreadPool pool(3, pinned);
+        CHECK(pool.submit([]
+                          { return 1; })
+                  .get() == 1);
+    }
+    return 0;
+}
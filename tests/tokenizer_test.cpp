@@ -0,0 +1,84 @@
+// The single-pass tokenizer must split text exactly like the original
+// stream-based one: whitespace-separated words, lowercased, stripped of
+// everything but ASCII alphanumerics, without empty words or stopwords.
+#include "check.h"
+#include "term_dictionary.h"
+#include "tokenizer.h"
+#include <algorithm>
+#include <cctype>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+    std::vector<std::string> reference_tokenize(const std::string &text)
+    {
+        static const std::set<std::string> stopwords = {
+            "the", "is", "at", "which", "on", "and", "a", "an", "of", "to", "in", "for"};
+        std::stringstream in(text);
+        std::string word;
+        std::vector<std::string> tokens;
+        while (in >> word)
+        {
+            std::string norm;
+            for (unsigned char c : word)
+                if (std::isalnum(c))
+                    norm += static_cast<char>(std::tolower(c));
+            if (!norm.empty() && !stopwords.count(norm))
+                tokens.push_back(norm);
+        }
+        return tokens;
+    }
+
+    // Words, stopwords, punctuation, every whitespace character and bytes
+    // above 0x7F, in runs long and short enough to cross the 16-byte
+    // vector boundary anywhere.
+    std::string random_text(std::mt19937 &rng)
+    {
+        static const std::vector<std::string> pieces = {
+            "Search", "ENGINE", "bm25", "The", "of", "a", "x", "Don't", "e-mail",
+            "caf\xc3\xa9", "\xff\x80", "!!!", "--", "9", "Distributed_Systems",
+            "averyveryverylongwordthatspansmorethansixteenbytes", "MiXeD123CaSe"};
+        static const std::string spaces = " \t\n\v\f\r";
+        std::string text;
+        int count = rng() % 40;
+        for (int i = 0; i < count; i++)
+        {
+            text += pieces[rng() % pieces.size()];
+            int gap = rng() % 3;
+            for (int g = 0; g < gap; g++)
+                text += spaces[rng() % spaces.size()];
+            if (rng() % 8 == 0)
+                text += static_cast<char>(rng() % 256);
+        }
+        return text;
+    }
+}
+
+int main()
+{
+    Tokenizer tokenizer;
+    TermDictionary dictionary;
+    std::mt19937 rng(9);
+    for (int round = 0; round < 20000; round++)
+    {
+        std::string text = random_text(rng);
+        std::vector<std::string> expected = reference_tokenize(text);
+
+        const auto &tokens = tokenizer.tokenize(text);
+        CHECK(std::equal(tokens.begin(), tokens.end(), expected.begin(), expected.end()));
+
+        std::vector<uint32_t> ids;
+        tokenizer.tokenize(text, dictionary, ids);
+        CHECK(ids.size() == expected.size());
+        for (size_t i = 0; i < ids.size(); i++)
+        {
+            CHECK(dictionary.term(ids[i]) == expected[i]);
+            CHECK(dictionary.intern(expected[i]) == ids[i]);
+        }
+    }
+    return 0;
+}
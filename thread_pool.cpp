@@ -1,41 +1,181 @@
 #include "thread_pool.h"
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
-ThreadPool::ThreadPool(size_t threads) : stop(false)
+namespace
 {
+    // Set on pool threads, so enqueue() can keep a worker's tasks local.
+    thread_local const ThreadPool *current_pool = nullptr;
+    thread_local size_t current_worker = 0;
+}
+
+ThreadPool::ThreadPool(size_t threads) : ThreadPool(threads, Options()) {}
+
+ThreadPool::ThreadPool(size_t threads, Options options)
+{
+    threads = std::max<size_t>(1, threads);
+    for (size_t i = 0; i < threads; i++)
+        queues.push_back(std::make_unique<Queue>());
+
+    size_t cpus = std::max(1u, std::thread::hardware_concurrency());
     for (size_t i = 0; i < threads; i++)
     {
-        workers.emplace_back([this]
+        // Each worker pins itself before taking a task, so none of its
+        // tasks runs on the wrong CPU.
+        size_t cpu = (options.first_cpu + i) % cpus;
+        workers.emplace_back([this, i, cpu, pin = options.pin_threads]
                              {
-            while (true) {
-                std::function<void()> task;
-                {
-                    std::unique_lock<std::mutex> lock(queue_mutex);
-                    condition.wait(lock, [this] { return stop || !tasks.empty(); });
-                    if (stop && tasks.empty()) return;
-                    task = std::move(tasks.front());
-                    tasks.pop();
-                }
-                task();
-            } });
+#ifdef __linux__
+                                 if (pin)
+                                 {
+                                     cpu_set_t set;
+                                     CPU_ZERO(&set);
+                                     CPU_SET(cpu, &set);
+                                     pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+                                 }
+#else
+                                 (void)cpu;
+                                 (void)pin;
+#endif
+                                 worker_loop(i); });
     }
 }
 
+// Workers drain every queued task before exiting.
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        stop = true;
+    }
+    wakeup.notify_all();
+    for (std::thread &worker : workers)
+        worker.join();
+}
+
+void ThreadPool::worker_loop(size_t index)
+{
+    current_pool = this;
+    current_worker = index;
+
+    std::function<void()> task;
+    while (true)
+    {
+        if (take(index, task))
+        {
+            task();
+            task = nullptr;
+            if (--unfinished == 0)
+            {
+                std::lock_guard<std::mutex> lock(idle_mutex);
+                idle.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        wakeup.wait(lock, [this]
+                    { return stop || queued.load() > 0; });
+        if (stop && queued.load() == 0)
+            return;
+    }
+}
+
+// Own deque from the back, then the others' from the front.
+bool ThreadPool::take(size_t index, std::function<void()> &task)
+{
+    {
+        Queue &own = *queues[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty())
+        {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            queued--;
+            return true;
+        }
+    }
+    for (size_t k = 1; k < queues.size(); k++)
+    {
+        Queue &victim = *queues[(index + k) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t ThreadPool::home_queue()
+{
+    if (current_pool == this)
+        return current_worker;
+    return next_queue++ % queues.size();
+}
+
+// Taking sleep_mutex orders the notification after any worker's check of
+// `queued`, so a worker about to sleep cannot miss new tasks.
+void ThreadPool::wake(size_t tasks)
+{
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+    }
+    if (tasks == 1)
+        wakeup.notify_one();
+    else
+        wakeup.notify_all();
+}
+
 void ThreadPool::enqueue(std::function<void()> task)
 {
+    unfinished++;
+    Queue &queue = *queues[home_queue()];
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        tasks.push(task);
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+        queued++;
     }
-    condition.notify_one();
+    wake(1);
 }
 
-ThreadPool::~ThreadPool()
+// From a worker the whole batch lands on its own deque for the others to
+// steal; from outside it is dealt out in contiguous slices.
+void ThreadPool::enqueue_batch(std::vector<std::function<void()>> tasks)
 {
+    if (tasks.empty())
+        return;
+    unfinished += tasks.size();
+
+    bool local = current_pool == this;
+    size_t targets = local ? 1 : std::min(queues.size(), tasks.size());
+    size_t first = home_queue();
+    size_t per_queue = (tasks.size() + targets - 1) / targets;
+    for (size_t q = 0; q < targets; q++)
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        stop = true;
+        Queue &queue = *queues[(first + q) % queues.size()];
+        size_t lo = q * per_queue;
+        size_t hi = std::min(tasks.size(), lo + per_queue);
+        // Rounding per_queue up can use up the batch before every target
+        // gets a slice, e.g. 5 tasks on 4 queues.
+        if (lo >= hi)
+            break;
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        for (size_t i = lo; i < hi; i++)
+            queue.tasks.push_back(std::move(tasks[i]));
+        queued += hi - lo;
     }
-    condition.notify_all();
-    for (std::thread &worker : workers)
-        worker.join();
+    wake(tasks.size());
+}
+
+void ThreadPool::wait()
+{
+    std::unique_lock<std::mutex> lock(idle_mutex);
+    idle.wait(lock, [this]
+              { return unfinished.load() == 0; });
 }
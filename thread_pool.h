@@ -1,22 +1,167 @@
 #pragma once
-#include <vector>
-#include <queue>
-#include <thread>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
 #include <functional>
+#include <future>
+#include <memory>
 #include <mutex>
-#include <condition_variable>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
+// Work-stealing pool. Every worker owns a deque: it takes its own tasks
+// from the back, newest first while their data is still in cache, and when
+// it runs dry steals the oldest task from the front of another deque.
+// Tasks enqueued by a worker go to its own deque; tasks from other threads
+// are spread round-robin. Idle workers sleep on one condition variable.
 class ThreadPool
 {
 public:
-    ThreadPool(size_t threads);
+    struct Options
+    {
+        // Pins worker i to CPU (first_cpu + i) modulo the CPU count. Only
+        // supported on Linux; ignored elsewhere.
+        bool pin_threads = false;
+        size_t first_cpu = 0;
+    };
+
+    explicit ThreadPool(size_t threads);
+    ThreadPool(size_t threads, Options options);
     ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // The task must not throw; use submit() for work that can fail.
     void enqueue(std::function<void()> task);
+    // Queues all tasks with one lock per deque and a single wake-up.
+    void enqueue_batch(std::vector<std::function<void()>> tasks);
+
+    // The future holds f's result or exception.
+    template <typename F>
+    auto submit(F &&f) -> std::future<std::invoke_result_t<std::decay_t<F>>>;
+
+    // Calls body(i) for every i in [begin, end) and returns once all calls
+    // are done, rethrowing the first exception (indexes not started by then
+    // are skipped). Chunks of `grain` indexes (0: about four per worker) are
+    // claimed from a shared counter by the calling thread and by helper
+    // tasks, so it is safe to call from a task running on this pool.
+    template <typename F>
+    void parallel_for(size_t begin, size_t end, F &&body, size_t grain = 0);
+
+    // Blocks until every queued task has finished. Must not be called from
+    // a task running on this pool.
+    void wait();
+
+    size_t size() const { return workers.size(); }
 
 private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    void worker_loop(size_t index);
+    bool take(size_t index, std::function<void()> &task);
+    size_t home_queue();
+    void wake(size_t tasks);
+
+    std::vector<std::unique_ptr<Queue>> queues;
     std::vector<std::thread> workers;
-    std::queue<std::function<void()>> tasks;
-    std::mutex queue_mutex;
-    std::condition_variable condition;
-    bool stop;
+    // Tasks in the deques, changed under the lock of the deque pushed to or
+    // taken from. A worker woken by a nonzero count therefore finds a task
+    // unless another worker took it first; it never spins waiting for a
+    // push to land.
+    std::atomic<size_t> queued{0};
+    // Queued or running.
+    std::atomic<size_t> unfinished{0};
+    std::atomic<size_t> next_queue{0};
+
+    std::mutex sleep_mutex;
+    std::condition_variable wakeup;
+    bool stop = false;
+
+    std::mutex idle_mutex;
+    std::condition_variable idle;
 };
+
+template <typename F>
+auto ThreadPool::submit(F &&f) -> std::future<std::invoke_result_t<std::decay_t<F>>>
+{
+    using Result = std::invoke_result_t<std::decay_t<F>>;
+    // std::function needs a copyable target; packaged_task is move-only.
+    auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(f));
+    std::future<Result> result = task->get_future();
+    enqueue([task]
+            { (*task)(); });
+    return result;
+}
+
+template <typename F>
+void ThreadPool::parallel_for(size_t begin, size_t end, F &&body, size_t grain)
+{
+    if (begin >= end)
+        return;
+    size_t count = end - begin;
+    if (grain == 0)
+        grain = std::max<size_t>(1, count / (4 * workers.size()));
+    size_t chunks = (count + grain - 1) / grain;
+
+    struct Shared
+    {
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> done{0};
+        std::atomic<bool> failed{false};
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+    auto shared = std::make_shared<Shared>();
+
+    // Helpers that start after every chunk is claimed return without
+    // touching `body`, so it may live on the caller's stack.
+    auto run = [shared, &body, begin, end, grain, chunks]
+    {
+        size_t chunk;
+        while ((chunk = shared->next.fetch_add(1)) < chunks)
+        {
+            size_t lo = begin + chunk * grain;
+            size_t hi = std::min(end, lo + grain);
+            if (!shared->failed)
+            {
+                try
+                {
+                    for (size_t i = lo; i < hi; i++)
+                        body(i);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(shared->mutex);
+                    if (!shared->failed.exchange(true))
+                        shared->error = std::current_exception();
+                }
+            }
+            if (shared->done.fetch_add(1) + 1 == chunks)
+            {
+                std::lock_guard<std::mutex> lock(shared->mutex);
+                shared->finished.notify_all();
+            }
+        }
+    };
+
+    size_t helpers = std::min(workers.size(), chunks - 1);
+    if (helpers > 0)
+        enqueue_batch(std::vector<std::function<void()>>(helpers, run));
+    run();
+
+    std::unique_lock<std::mutex> lock(shared->mutex);
+    shared->finished.wait(lock, [&]
+                          { return shared->done.load() == chunks; });
+    if (shared->error)
+        std::rethrow_exception(shared->error);
+}
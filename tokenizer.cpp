@@ -1,41 +1,120 @@
 #include "tokenizer.h"
-#include <sstream>
+#include "term_dictionary.h"
 #include <algorithm>
-#include <cctype>
+#include <array>
 
-Tokenizer::Tokenizer()
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace
 {
-    stopwords = {
+    const char SEPARATOR = 1;
+
+    // Per byte: the lowercased character for [A-Za-z0-9], SEPARATOR for the
+    // C-locale whitespace set and 0 for characters that are dropped.
+    struct CharTable
+    {
+        std::array<char, 256> fold{};
+
+        CharTable()
+        {
+            for (int c = '0'; c <= '9'; c++)
+                fold[c] = c;
+            for (int c = 'a'; c <= 'z'; c++)
+                fold[c] = c;
+            for (int c = 'A'; c <= 'Z'; c++)
+                fold[c] = c - 'A' + 'a';
+            for (char c : {' ', '\t', '\n', '\v', '\f', '\r'})
+                fold[static_cast<unsigned char>(c)] = SEPARATOR;
+        }
+    };
+
+    const CharTable table;
+
+    const std::string_view STOPWORDS[] = {
         "the", "is", "at", "which", "on", "and", "a", "an", "of", "to", "in", "for"};
-}
 
-std::string Tokenizer::normalize(const std::string &word)
-{
-    std::string w = word;
-    std::transform(w.begin(), w.end(), w.begin(),
-                   [](unsigned char c)
-                   { return std::tolower(c); });
-
-    w.erase(std::remove_if(w.begin(), w.end(),
-                           [](char c)
-                           { return !std::isalnum(c); }),
-            w.end());
-    return w;
+    bool is_stopword(std::string_view word)
+    {
+        if (word.size() > 5)
+            return false;
+        return std::find(std::begin(STOPWORDS), std::end(STOPWORDS), word) != std::end(STOPWORDS);
+    }
+
+#ifdef __SSE2__
+    // Lowercases the 16 bytes at `in` into `out` and returns how many of
+    // them, from the start, are ASCII alphanumeric.
+    size_t fold_run(const char *in, char *out)
+    {
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+        // Signed compares: bytes >= 0x80 are negative and fall outside every range.
+        auto in_range = [c](char lo, char hi)
+        {
+            return _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(lo - 1)),
+                                 _mm_cmplt_epi8(c, _mm_set1_epi8(hi + 1)));
+        };
+        __m128i upper = in_range('A', 'Z');
+        __m128i alnum = _mm_or_si128(_mm_or_si128(upper, in_range('a', 'z')),
+                                     in_range('0', '9'));
+        __m128i lowered = _mm_or_si128(c, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out), lowered);
+
+        unsigned mask = ~static_cast<unsigned>(_mm_movemask_epi8(alnum)) & 0xFFFF;
+        return mask ? __builtin_ctz(mask) : 16;
+    }
+#endif
 }
 
-std::vector<std::string> Tokenizer::tokenize(const std::string &text)
+const std::vector<std::string_view> &Tokenizer::tokenize(std::string_view text)
 {
-    std::stringstream ss(text);
-    std::string word;
-    std::vector<std::string> tokens;
+    tokens.clear();
+    // Normalized text is never longer than the input; the slack lets the
+    // SIMD path store a full vector at the end.
+    if (buffer.size() < text.size() + 16)
+        buffer.resize(text.size() + 16);
+
+    const char *in = text.data();
+    const size_t size = text.size();
+    char *out = &buffer[0];
+    size_t word_start = 0, pos = 0;
 
-    while (ss >> word)
+    auto end_word = [&]
     {
-        std::string norm = normalize(word);
-        if (!norm.empty() && stopwords.find(norm) == stopwords.end())
+        std::string_view word(out + word_start, pos - word_start);
+        if (!word.empty() && !is_stopword(word))
+            tokens.push_back(word);
+        else
+            pos = word_start;
+        word_start = pos;
+    };
+
+    size_t i = 0;
+    while (i < size)
+    {
+#ifdef __SSE2__
+        if (i + 16 <= size)
         {
-            tokens.push_back(norm);
+            size_t run = fold_run(in + i, out + pos);
+            pos += run;
+            i += run;
+            if (run == 16)
+                continue;
         }
+#endif
+        char c = table.fold[static_cast<unsigned char>(in[i++])];
+        if (c == SEPARATOR)
+            end_word();
+        else if (c != 0)
+            out[pos++] = c;
     }
+    end_word();
     return tokens;
 }
+
+void Tokenizer::tokenize(std::string_view text, TermDictionary &dictionary,
+                         std::vector<uint32_t> &ids)
+{
+    for (std::string_view token : tokenize(text))
+        ids.push_back(dictionary.intern(token));
+}
@@ -1,15 +1,27 @@
 #pragma once
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
-#include <unordered_set>
 
+class TermDictionary;
+
+// Splits on ASCII whitespace, lowercases, and drops every character that is
+// not ASCII alphanumeric; empty words and stopwords are skipped. The input
+// is scanned once, 16 bytes at a time where SSE2 is available.
+//
+// Tokens are views into a buffer owned by the tokenizer and stay valid until
+// the next call, so a Tokenizer is meant to be reused (one per thread).
 class Tokenizer
 {
 public:
-    Tokenizer();
-    std::vector<std::string> tokenize(const std::string &text);
+    const std::vector<std::string_view> &tokenize(std::string_view text);
+
+    // Appends the dictionary id of every token to `ids`.
+    void tokenize(std::string_view text, TermDictionary &dictionary,
+                  std::vector<uint32_t> &ids);
 
 private:
-    std::unordered_set<std::string> stopwords;
-    std::string normalize(const std::string &word);
+    std::string buffer;
+    std::vector<std::string_view> tokens;
 };
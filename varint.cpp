@@ -1,4 +1,5 @@
 #include "varint.h"
+#include <stdexcept>
 
 void VarInt::encode_uint32(uint32_t value, std::vector<uint8_t> &out)
 {
@@ -17,8 +18,10 @@ uint32_t VarInt::decode_uint32(const std::vector<uint8_t> &data, size_t &offset)
 
     while (true)
     {
+        if (offset >= data.size() || shift > 28)
+            throw std::runtime_error("VarInt: truncated or overlong value");
         uint8_t byte = data[offset++];
-        result |= (byte & 0x7F) << shift;
+        result |= static_cast<uint32_t>(byte & 0x7F) << shift;
         if (!(byte & 0x80))
             break;
         shift += 7;
@@ -42,3 +45,19 @@ std::vector<uint8_t> VarInt::encode_postings(
     }
     return out;
 }
+
+void VarInt::decode_postings(
+    const std::vector<uint8_t> &data,
+    std::vector<uint32_t> &doc_ids,
+    std::vector<uint32_t> &term_freqs)
+{
+    size_t offset = 0;
+    uint32_t prev = 0;
+
+    while (offset < data.size())
+    {
+        prev += decode_uint32(data, offset);
+        doc_ids.push_back(prev);
+        term_freqs.push_back(decode_uint32(data, offset));
+    }
+}
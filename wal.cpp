@@ -1,35 +1,438 @@
 #include "wal.h"
+#include "crc32c.h"
+#include "index_engine.h"
+#include "mmap_loader.h"
+#include "thread_pool.h"
+#include "tokenizer.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
+#include <stdexcept>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
 
-WAL::WAL(const std::string &path) : log_path(path) {}
+namespace
+{
+    const size_t RECORD_HEADER = 2 * sizeof(uint32_t);
+
+    std::string segment_name(const std::string &path, uint64_t seq)
+    {
+        char suffix[32];
+        std::snprintf(suffix, sizeof(suffix), ".%08llu",
+                      static_cast<unsigned long long>(seq));
+        return path + suffix;
+    }
+
+    // Existing segments of `path`, oldest first.
+    std::vector<std::pair<uint64_t, std::string>> list_segments(const std::string &path)
+    {
+        namespace fs = std::filesystem;
+        fs::path base(path);
+        fs::path dir = base.has_parent_path() ? base.parent_path() : fs::path(".");
+        std::string prefix = base.filename().string() + ".";
+
+        std::vector<std::pair<uint64_t, std::string>> segments;
+        std::error_code ec;
+        for (const auto &entry : fs::directory_iterator(dir, ec))
+        {
+            std::string name = entry.path().filename().string();
+            if (name.size() <= prefix.size() || name.compare(0, prefix.size(), prefix) != 0)
+                continue;
+            std::string digits = name.substr(prefix.size());
+            if (!std::all_of(digits.begin(), digits.end(),
+                             [](unsigned char c)
+                             { return std::isdigit(c); }))
+                continue;
+            segments.push_back({std::stoull(digits), entry.path().string()});
+        }
+        std::sort(segments.begin(), segments.end());
+        return segments;
+    }
+
+    void sync_directory(const std::string &path)
+    {
+        std::filesystem::path dir = std::filesystem::path(path).parent_path();
+        int dfd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (dfd >= 0)
+        {
+            fsync(dfd);
+            close(dfd);
+        }
+    }
+}
+
+WAL::WAL(const std::string &path) : WAL(path, Options()) {}
+
+WAL::WAL(const std::string &path, Options options)
+    : log_path(path), options(options)
+{
+    // Never append after a possibly torn tail: always start a new segment.
+    // replay() reads on past a torn segment into the ones after it.
+    auto segments = list_segments(log_path);
+    open_segment(segments.empty() ? 1 : segments.back().first + 1);
+    writer = std::thread([this]
+                         { writer_loop(); });
+}
+
+WAL::~WAL()
+{
+    {
+        std::lock_guard<std::mutex> lock(wal_mutex);
+        stopping = true;
+    }
+    work_cv.notify_one();
+    writer.join();
+    if (fd >= 0)
+        close(fd);
+}
 
 void WAL::append(uint32_t doc_id,
                  const std::string &content)
 {
-    std::ofstream out(log_path,
-                      std::ios::binary | std::ios::app);
+    append_record(doc_id, content.data(), content.size(), false);
+}
 
-    size_t size = content.size();
-    out.write(reinterpret_cast<char *>(&doc_id), sizeof(doc_id));
-    out.write(reinterpret_cast<char *>(&size), sizeof(size));
-    out.write(content.c_str(), size);
+void WAL::append_delete(uint32_t doc_id)
+{
+    append_record(doc_id, nullptr, 0, true);
 }
 
-void WAL::replay(IndexEngine &engine)
+void WAL::append_record(uint32_t doc_id, const char *content, size_t size, bool tombstone)
 {
-    std::ifstream in(log_path, std::ios::binary);
+    uint32_t payload_size = static_cast<uint32_t>(sizeof(doc_id) + size);
+    if (payload_size & TOMBSTONE)
+        throw std::runtime_error("WAL: record too large");
+    uint32_t length = tombstone ? payload_size | TOMBSTONE : payload_size;
+    uint32_t crc = CRC32C::compute(&length, sizeof(length));
+    crc = CRC32C::compute(&doc_id, sizeof(doc_id), crc);
+    crc = CRC32C::compute(content, size, crc);
+
+    std::unique_lock<std::mutex> lock(wal_mutex);
+    if (!error.empty())
+        throw std::runtime_error(error);
 
-    while (in.peek() != EOF)
+    size_t at = pending.size();
+    pending.resize(at + RECORD_HEADER + payload_size);
+    uint8_t *out = pending.data() + at;
+    std::memcpy(out, &length, sizeof(length));
+    std::memcpy(out + 4, &crc, sizeof(crc));
+    std::memcpy(out + 8, &doc_id, sizeof(doc_id));
+    if (size > 0)
+        std::memcpy(out + 12, content, size);
+    uint64_t seq = ++appended_seq;
+
+    work_cv.notify_one();
+
+    if (options.sync == SyncPolicy::EveryRecord)
+    {
+        done_cv.wait(lock, [&]
+                     { return synced_seq >= seq || !error.empty(); });
+        if (synced_seq < seq)
+            throw std::runtime_error(error);
+    }
+}
+
+void WAL::flush()
+{
+    std::unique_lock<std::mutex> lock(wal_mutex);
+    uint64_t seq = appended_seq;
+    flush_requested = true;
+    work_cv.notify_one();
+    done_cv.wait(lock, [&]
+                 { return synced_seq >= seq || !error.empty(); });
+    if (synced_seq < seq)
+        throw std::runtime_error(error);
+}
+
+uint64_t WAL::rotate()
+{
+    std::unique_lock<std::mutex> lock(wal_mutex);
+    rotate_requested = true;
+    flush_requested = true;
+    work_cv.notify_one();
+    done_cv.wait(lock, [&]
+                 { return !rotate_requested || !error.empty(); });
+    if (rotate_requested)
+        throw std::runtime_error(error);
+    return rotated_segment;
+}
+
+void WAL::checkpoint(uint64_t segment)
+{
+    std::string path = checkpoint_path();
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        out << segment << '\n';
+        out.flush();
+        if (!out)
+            throw std::runtime_error("WAL: cannot write " + tmp);
+    }
+    int cfd = open(tmp.c_str(), O_RDONLY);
+    if (cfd >= 0)
+    {
+        fsync(cfd);
+        close(cfd);
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0)
+        throw std::runtime_error("WAL: rename " + tmp + ": " + std::strerror(errno));
+    sync_directory(path);
+
+    for (auto &[seq, name] : list_segments(log_path))
+        if (seq < segment)
+            std::remove(name.c_str());
+}
+
+std::string WAL::checkpoint_path() const
+{
+    return log_path + ".checkpoint";
+}
+
+void WAL::writer_loop()
+{
+    std::vector<uint8_t> batch;
+    bool dirty = false;
+    auto last_sync = std::chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> lock(wal_mutex);
+    while (true)
+    {
+        // Wakes for new records or a flush; the timeout drives the
+        // interval policy when ingest goes quiet.
+        work_cv.wait_for(lock, options.sync_interval, [this]
+                         { return stopping || flush_requested || !pending.empty(); });
+
+        batch.swap(pending);
+        uint64_t batch_seq = appended_seq;
+        bool force = flush_requested || stopping;
+        bool rotate = rotate_requested;
+        bool stop = stopping;
+        flush_requested = false;
+        lock.unlock();
+
+        std::string failure;
+        try
+        {
+            if (!batch.empty())
+            {
+                write_batch(batch);
+                dirty = true;
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            bool due = force || options.sync == SyncPolicy::EveryRecord ||
+                       (options.sync == SyncPolicy::Interval &&
+                        now - last_sync >= options.sync_interval);
+            if (dirty && due)
+            {
+                sync();
+                dirty = false;
+                last_sync = now;
+            }
+            if (rotate && segment_size > 0)
+                open_segment(segment_seq + 1);
+        }
+        catch (const std::exception &e)
+        {
+            failure = e.what();
+        }
+        batch.clear();
+
+        lock.lock();
+        if (!failure.empty())
+            error = failure;
+        else
+        {
+            if (!dirty)
+                synced_seq = batch_seq;
+            if (rotate)
+            {
+                rotate_requested = false;
+                rotated_segment = segment_seq;
+            }
+        }
+        done_cv.notify_all();
+
+        if (stop && pending.empty())
+            return;
+    }
+}
+
+void WAL::open_segment(uint64_t seq)
+{
+    std::string name = segment_name(log_path, seq);
+    int next = open(name.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (next < 0)
+        throw std::runtime_error("WAL: open " + name + ": " + std::strerror(errno));
+    sync_directory(name);
+
+    if (fd >= 0)
+        close(fd);
+    fd = next;
+    segment_seq = seq;
+    segment_size = 0;
+}
+
+void WAL::write_batch(const std::vector<uint8_t> &batch)
+{
+    const uint8_t *p = batch.data();
+    size_t left = batch.size();
+    while (left > 0)
+    {
+        ssize_t n = ::write(fd, p, left);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error(std::string("WAL: write: ") + std::strerror(errno));
+        }
+        p += n;
+        left -= n;
+    }
+    segment_size += batch.size();
+
+    // Rotate on batch boundaries; the finished segment is synced first so
+    // later segments never become durable ahead of earlier ones. This holds
+    // under SyncPolicy::None too: flush() only syncs the open segment, and
+    // replay relies on no segment but the last one at a crash being torn.
+    if (segment_size >= options.segment_bytes)
+    {
+        sync();
+        open_segment(segment_seq + 1);
+    }
+}
+
+void WAL::sync()
+{
+    if (fdatasync(fd) != 0)
+        throw std::runtime_error(std::string("WAL: fdatasync: ") + std::strerror(errno));
+}
+
+std::vector<std::string> WAL::segment_files() const
+{
+    std::vector<std::string> files;
+    for (auto &[seq, name] : list_segments(log_path))
+        files.push_back(name);
+    return files;
+}
+
+size_t WAL::replay(IndexEngine &engine, size_t threads)
+{
+    uint64_t start = 0;
+    {
+        std::ifstream in(checkpoint_path());
+        in >> start;
+    }
+
+    struct Record
     {
         uint32_t doc_id;
+        const char *content;
         size_t size;
+        bool tombstone;
+    };
+
+    // Reader stage: map each segment and validate its framing. Records point
+    // into the mappings, which stay alive until the workers are done.
+    std::vector<std::pair<void *, size_t>> mappings;
+    std::vector<Record> records;
+    try
+    {
+        for (auto &[seq, name] : list_segments(log_path))
+        {
+            if (seq < start)
+                continue;
 
-        in.read(reinterpret_cast<char *>(&doc_id), sizeof(doc_id));
-        in.read(reinterpret_cast<char *>(&size), sizeof(size));
+            size_t size = 0;
+            void *addr = MMapLoader::map_file(name, size);
+            mappings.push_back({addr, size});
+            MMapLoader::advise(addr, size, MMapLoader::Advice::Sequential);
+            const uint8_t *data = static_cast<const uint8_t *>(addr);
 
-        std::string content(size, ' ');
-        in.read(&content[0], size);
+            size_t offset = 0;
+            while (offset + RECORD_HEADER <= size)
+            {
+                uint32_t length, crc;
+                std::memcpy(&length, data + offset, sizeof(length));
+                std::memcpy(&crc, data + offset + 4, sizeof(crc));
+                const uint8_t *payload = data + offset + RECORD_HEADER;
+                bool tombstone = length & TOMBSTONE;
+                uint32_t payload_size = length & ~TOMBSTONE;
 
-        engine.add_document(doc_id, content);
+                if (payload_size < sizeof(uint32_t) ||
+                    (tombstone && payload_size != sizeof(uint32_t)) ||
+                    payload_size > size - offset - RECORD_HEADER ||
+                    CRC32C::compute(payload, payload_size,
+                                    CRC32C::compute(data + offset, sizeof(length))) != crc)
+                    break; // torn or corrupt tail: nothing after it in this segment is trusted
+
+                uint32_t doc_id;
+                std::memcpy(&doc_id, payload, sizeof(doc_id));
+                records.push_back({doc_id, reinterpret_cast<const char *>(payload) + 4,
+                                   payload_size - 4, tombstone});
+                offset += RECORD_HEADER + payload_size;
+            }
+            // A torn segment still ends in a crash, but the segments after
+            // it were started by a reopen and hold acknowledged records.
+        }
+    }
+    catch (...)
+    {
+        for (auto &[addr, size] : mappings)
+            MMapLoader::unmap_file(addr, size);
+        throw;
+    }
+
+    // Keep the last record of each doc id, in log order; tombstones are
+    // applied right away.
+    std::unordered_map<uint32_t, size_t> last;
+    for (size_t i = 0; i < records.size(); i++)
+        last[records[i].doc_id] = i;
+    size_t kept = 0;
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        if (last[records[i].doc_id] != i)
+            continue;
+        if (records[i].tombstone)
+            engine.delete_document(records[i].doc_id);
+        else
+            records[kept++] = records[i];
     }
+    size_t applied = last.size();
+    records.resize(kept);
+
+    // Tokenize stage: contiguous slices of the log, one SubIndex per worker,
+    // tokenized in place from the mapping.
+    TermDictionary &terms = engine.get_term_dictionary();
+    threads = std::max<size_t>(1, std::min(threads, records.size()));
+    std::vector<SubIndex> parts(threads);
+    {
+        ThreadPool pool(threads);
+        size_t per_worker = (records.size() + threads - 1) / threads;
+        pool.parallel_for(0, threads, [&](size_t w)
+                          {
+            Tokenizer tokenizer;
+            std::vector<uint32_t> term_ids;
+            size_t end = std::min(records.size(), (w + 1) * per_worker);
+            for (size_t i = w * per_worker; i < end; i++)
+            {
+                const Record &r = records[i];
+                term_ids.clear();
+                tokenizer.tokenize(std::string_view(r.content, r.size), terms, term_ids);
+                parts[w].add_document(r.doc_id, term_ids);
+            } }, 1);
+    }
+
+    for (auto &[addr, size] : mappings)
+        MMapLoader::unmap_file(addr, size);
+
+    // Merge stage, in log order.
+    for (auto &part : parts)
+        engine.merge(std::move(part));
+    return applied;
 }
@@ -1,16 +1,109 @@
 #pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
+// Write-ahead log with group commit. Records from concurrent append() calls
+// are batched by one writer thread into a single write() and, depending on
+// the sync policy, a single fdatasync(). The log is a sequence of segment
+// files "<path>.<seq>"; each record is framed as
+//   [u32 payload length][u32 CRC32C][u32 doc id][content]
+// so replay can detect a torn or corrupt tail. It skips the rest of that
+// segment and goes on with the next one, which a reopen after the crash
+// started. Deletes are logged as tombstones: the TOMBSTONE bit is set in
+// the length word and the payload is just the doc id. The CRC covers the
+// length word as well as the payload, so a flipped TOMBSTONE bit is caught
+// too.
+//
+// Checkpointing: rotate() closes the current segment and returns the
+// sequence number of the next one; once a snapshot taken after that call is
+// durable, checkpoint(seq) records it and deletes the older segments, and
+// replay() starts from that segment instead of the beginning of the log.
 class WAL
 {
 public:
+    enum class SyncPolicy
+    {
+        EveryRecord, // append() returns once its record is fdatasync'ed
+        Interval,    // fdatasync at most every sync_interval, append() does not wait
+        None         // leave flushing to the OS
+    };
+
+    struct Options
+    {
+        SyncPolicy sync = SyncPolicy::EveryRecord;
+        std::chrono::milliseconds sync_interval{10};
+        size_t segment_bytes = 64 << 20;
+    };
+
     WAL(const std::string &path);
+    WAL(const std::string &path, Options options);
+    ~WAL();
+
+    WAL(const WAL &) = delete;
+    WAL &operator=(const WAL &) = delete;
+
+    static constexpr uint32_t TOMBSTONE = 1u << 31;
 
+    // Records the document's new content; replay replaces older versions.
     void append(uint32_t doc_id,
                 const std::string &content);
+    void append_delete(uint32_t doc_id);
+
+    // Blocks until every record appended so far is written and synced.
+    void flush();
+
+    // Starts a new segment; every record appended before the call lives in
+    // a segment older than the returned sequence number.
+    uint64_t rotate();
+
+    // Persists `segment` (a value returned by rotate()) as the replay start
+    // and removes all older segments.
+    void checkpoint(uint64_t segment);
 
-    void replay(class IndexEngine &engine);
+    // Applies every intact record from the checkpointed segment onward and
+    // returns the count applied. Only the last record of each doc id
+    // counts: tombstones delete the doc, others replace whatever version
+    // the engine holds (e.g. from the snapshot), so replaying twice is
+    // harmless. Segments are memory-mapped and scanned on this thread;
+    // tokenizing is spread over `threads` workers, each building a SubIndex
+    // that is merged into `engine` at the end.
+    size_t replay(class IndexEngine &engine,
+                  size_t threads = std::thread::hardware_concurrency());
+
+    std::vector<std::string> segment_files() const;
 
 private:
+    void append_record(uint32_t doc_id, const char *content, size_t size, bool tombstone);
+    void writer_loop();
+    void open_segment(uint64_t seq);
+    void write_batch(const std::vector<uint8_t> &batch);
+    void sync();
+
+    std::string checkpoint_path() const;
+
     std::string log_path;
+    Options options;
+
+    int fd = -1;
+    uint64_t segment_seq = 0;
+    size_t segment_size = 0;
+
+    std::mutex wal_mutex;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+    std::vector<uint8_t> pending;
+    uint64_t appended_seq = 0;
+    uint64_t synced_seq = 0;
+    bool flush_requested = false;
+    bool rotate_requested = false;
+    uint64_t rotated_segment = 0;
+    bool stopping = false;
+    std::string error;
+
+    std::thread writer;
 };